@@ -32,12 +32,7 @@ namespace scrpt
 
     AstNode::~AstNode()
     {
-        for (AstNode* child : _children)
-        {
-            delete child;
-        }
-
-        _children.clear();
+        this->RemoveChildren();
     }
 
     AstNode* AstNode::AddChild(std::shared_ptr<Token> token)
@@ -79,6 +74,38 @@ namespace scrpt
 		return newNode;
 	}
 
+    void AstNode::SetToken(std::shared_ptr<Token> token)
+    {
+        AssertNotNull(token);
+        _token = token;
+    }
+
+    AstNode* AstNode::ReleaseChild(AstNode* child)
+    {
+        AssertNotNull(child);
+
+        auto iter = std::find(_children.begin(), _children.end(), child);
+        Assert(iter != _children.end(), "Releasing a node that is not a child");
+        _children.erase(iter);
+        child->_parent = nullptr;
+        return child;
+    }
+
+    void AstNode::RemoveChild(AstNode* child)
+    {
+        delete this->ReleaseChild(child);
+    }
+
+    void AstNode::RemoveChildren()
+    {
+        for (AstNode* child : _children)
+        {
+            delete child;
+        }
+
+        _children.clear();
+    }
+
     std::shared_ptr<Token> AstNode::GetToken() const
     {
         return _token;
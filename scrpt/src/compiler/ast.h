@@ -15,6 +15,11 @@ namespace scrpt
         AstNode* AddEmptyChild();
         AstNode* GetParent() const;
 		AstNode* SwapUnaryOp(std::shared_ptr<Token> token, bool postfix);
+        // Tree rewriting used by AstOptimizer
+        void SetToken(std::shared_ptr<Token> token);
+        AstNode* ReleaseChild(AstNode* child);
+        void RemoveChild(AstNode* child);
+        void RemoveChildren();
         std::shared_ptr<Token> GetToken() const;
         const ChildList& GetChildren() const;
 		bool IsPostfix() const;
@@ -3,11 +3,16 @@
 #define COMPONENTNAME "BytecodeGen"
 
 const size_t MAX_PARAM = 125;
+const size_t DEFAULT_INLINE_BUDGET = 24;
 
 namespace scrpt
 {
     BytecodeGen::BytecodeGen()
-        : _fd(nullptr)
+        : _scopeFloor(0)
+        , _stackDepth(0)
+        , _inlineBudget(DEFAULT_INLINE_BUDGET)
+        , _fd(nullptr)
+        , _stats{ 0, 0, 0 }
     {
     }
 
@@ -19,6 +24,7 @@ namespace scrpt
 
         _functionLookup[name] = (unsigned int)_functions.size();
         _functions.push_back(FunctionData{ name, nParam, 0, 0xFFFFFFFF, true, func });
+        _functionNodes.push_back(nullptr);
     }
 
     void BytecodeGen::Consume(const AstNode& ast)
@@ -44,6 +50,16 @@ namespace scrpt
         return bytecode;
     }
 
+    const BytecodeGenStats& BytecodeGen::GetStats() const
+    {
+        return _stats;
+    }
+
+    void BytecodeGen::SetInlineBudget(size_t nodes)
+    {
+        _inlineBudget = nodes;
+    }
+
     void BytecodeGen::RecordFunction(const AstNode& node)
     {
         // Check the node
@@ -69,6 +85,7 @@ namespace scrpt
 
         _functionLookup[name] = (unsigned int)_functions.size();
         _functions.push_back(FunctionData{ ident.GetToken()->GetString(), (unsigned char)nParam, 0, 0xFFFFFFFF, false });
+        _functionNodes.push_back(&node);
     }
 
     void BytecodeGen::CompileFunction(const AstNode& node)
@@ -114,6 +131,17 @@ namespace scrpt
 
         this->PopScope();
 
+        size_t opsBefore = 0;
+        for (size_t idx = _fd->entry; idx < _byteBuffer.size(); idx += GetOpSize((OpCode)_byteBuffer[idx])) ++opsBefore;
+        this->OptimizeOps(_fd->entry);
+        this->AllocateRegisters(_fd->entry);
+        this->SpecializeScalarStores(_fd->entry);
+        this->PatchArgSlots(ident);
+        _localRanges.clear();
+
+        _stats.opsBefore += opsBefore;
+        for (size_t idx = _fd->entry; idx < _byteBuffer.size(); idx += GetOpSize((OpCode)_byteBuffer[idx])) ++_stats.opsAfter;
+
         _fd = nullptr;
     }
 
@@ -271,12 +299,9 @@ namespace scrpt
                 {
                     // TODO: Ideally the math ops can write to one of their own input registers rather than
                     // perform the op and then store it
-                    char rhsReg = GetRegResult(this->CompileExpression(node.GetSecondChild()));
-                    outReg = this->LookupIdentOffset(node.GetFirstChild());
-                    char tmpReg = this->ClaimRegister(node);
-                    this->AddOp(this->MapUnaryAssignOp(node.GetSym()), outReg, rhsReg, tmpReg);
+                    outReg = this->LookupIdentOffset(firstChild);
+                    char tmpReg = this->CompileBinaryOp(this->MapUnaryAssignOp(node.GetSym()), firstChild, node.GetSecondChild(), node);
                     this->AddOp(OpCode::Store, outReg, tmpReg);
-                    this->ReleaseRegister(rhsReg);
                     this->ReleaseRegister(tmpReg);
                 }
                 else if (firstChildSym == Symbol::LSquare || firstChildSym == Symbol::Dot)
@@ -337,12 +362,7 @@ namespace scrpt
         case Symbol::GreaterThan:
         case Symbol::GreaterThanEq:
             Assert(node.GetChildren().size() == 2, "Unexpected number of children");
-            reg0 = GetRegResult(this->CompileExpression(node.GetFirstChild()));
-            reg1 = GetRegResult(this->CompileExpression(node.GetSecondChild()));
-            outReg = this->ClaimRegister(node);
-            this->AddOp(this->MapBinaryOp(node.GetSym()), reg0, reg1, outReg);
-            this->ReleaseRegister(reg0);
-            this->ReleaseRegister(reg1);
+            outReg = this->CompileBinaryOp(this->MapBinaryOp(node.GetSym()), node.GetFirstChild(), node.GetSecondChild(), node);
             break;
 
         case Symbol::PlusPlus:
@@ -418,6 +438,637 @@ namespace scrpt
         return std::make_tuple(success, outReg);
     }
 
+    void BytecodeGen::BuildFlowGraph(size_t start, FlowGraph* flow) const
+    {
+        AssertNotNull(flow);
+
+        flow->offsets.clear();
+        for (size_t idx = start; idx < _byteBuffer.size(); idx += GetOpSize((OpCode)_byteBuffer[idx]))
+        {
+            flow->offsets.push_back(idx);
+        }
+
+        size_t nOps = flow->offsets.size();
+        flow->opAtOffset.assign(_byteBuffer.size() - start + 1, nOps);
+        for (size_t op = 0; op < nOps; ++op)
+        {
+            flow->opAtOffset[flow->offsets[op] - start] = op;
+        }
+
+        flow->uses.assign(nOps, std::bitset<128>());
+        flow->defs.assign(nOps, std::bitset<128>());
+        flow->successors.assign(nOps, std::vector<size_t>());
+        for (size_t op = 0; op < nOps; ++op)
+        {
+            const unsigned char* raw = &_byteBuffer[flow->offsets[op]];
+            OpCode code = (OpCode)raw[0];
+            OpRegisters regs = this->GetRegisterOperands(flow->offsets[op]);
+            for (size_t read = 0; read < regs.nReads; ++read)
+            {
+                if ((char)raw[regs.reads[read]] >= 0) flow->uses[op].set(raw[regs.reads[read]]);
+            }
+            if (regs.write != 0 && (char)raw[regs.write] >= 0) flow->defs[op].set(raw[regs.write]);
+
+            if (code != OpCode::Jmp && code != OpCode::Ret && code != OpCode::TailCall && op + 1 < nOps)
+            {
+                flow->successors[op].push_back(op + 1);
+            }
+
+            size_t targetPos = GetOpTargetPosition(code);
+            if (targetPos != 0)
+            {
+                size_t target = flow->opAtOffset[*((unsigned int*)&raw[targetPos]) - start];
+                if (target < nOps) flow->successors[op].push_back(target);
+            }
+        }
+
+        flow->liveIn.assign(nOps, std::bitset<128>());
+        flow->liveOut.assign(nOps, std::bitset<128>());
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (size_t op = nOps; op-- > 0;)
+            {
+                std::bitset<128> out;
+                for (size_t succ : flow->successors[op])
+                {
+                    out |= flow->liveIn[succ];
+                }
+
+                std::bitset<128> in = (out & ~flow->defs[op]) | flow->uses[op];
+                if (in != flow->liveIn[op] || out != flow->liveOut[op])
+                {
+                    flow->liveIn[op] = in;
+                    flow->liveOut[op] = out;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    void BytecodeGen::OptimizeOps(size_t start)
+    {
+        // Cleans up after the statement at a time code generation, repeating until nothing changes:
+        // * Ops unreachable from the entry, e.g. after a Ret or the Jmp closing an If block, are removed
+        // * Jumps to a Jmp go straight to its target and a Jmp to the next op is removed
+        // * A Store of a temporary written by the op just before it has that op write the Store's destination
+        // * Loads and Stores into a register that is never read afterwards are removed
+        bool changed = true;
+        while (changed)
+        {
+            FlowGraph flow;
+            this->BuildFlowGraph(start, &flow);
+            size_t nOps = flow.offsets.size();
+
+            std::vector<bool> reachable(nOps, false);
+            std::vector<bool> isTarget(nOps, false);
+            std::vector<size_t> pending;
+            if (nOps > 0)
+            {
+                reachable[0] = true;
+                pending.push_back(0);
+            }
+            while (!pending.empty())
+            {
+                size_t op = pending.back();
+                pending.pop_back();
+                for (size_t succ : flow.successors[op])
+                {
+                    if (succ != op + 1) isTarget[succ] = true;
+                    if (!reachable[succ])
+                    {
+                        reachable[succ] = true;
+                        pending.push_back(succ);
+                    }
+                }
+            }
+
+            std::vector<size_t> removeOps;
+            changed = false;
+            for (size_t op = 0; op < nOps; ++op)
+            {
+                unsigned char* raw = &_byteBuffer[flow.offsets[op]];
+                OpCode code = (OpCode)raw[0];
+                if (!reachable[op])
+                {
+                    removeOps.push_back(flow.offsets[op]);
+                    continue;
+                }
+
+                size_t targetPos = GetOpTargetPosition(code);
+                if (targetPos != 0)
+                {
+                    unsigned int target = *((unsigned int*)&raw[targetPos]);
+                    for (size_t hops = 0; hops < nOps; ++hops)
+                    {
+                        size_t targetOp = flow.opAtOffset[target - start];
+                        if (targetOp >= nOps || (OpCode)_byteBuffer[target] != OpCode::Jmp) break;
+                        unsigned int next = *((unsigned int*)&_byteBuffer[target + 1]);
+                        if (next == target) break;
+                        target = next;
+                    }
+
+                    if (target != *((unsigned int*)&raw[targetPos]))
+                    {
+                        this->SetOpOperand(flow.offsets[op], (int)targetPos - 1, target);
+                        changed = true;
+                    }
+
+                    if (code == OpCode::Jmp && flow.opAtOffset[target - start] == op + 1)
+                    {
+                        removeOps.push_back(flow.offsets[op]);
+                        continue;
+                    }
+                }
+
+                OpRegisters regs = this->GetRegisterOperands(flow.offsets[op]);
+                char dest = regs.write != 0 ? (char)raw[regs.write] : -1;
+                bool pureWrite = code == OpCode::Store ||
+                    code == OpCode::LoadNull ||
+                    code == OpCode::LoadTrue ||
+                    code == OpCode::LoadFalse ||
+                    code == OpCode::LoadInt ||
+                    code == OpCode::LoadFloat ||
+                    code == OpCode::LoadString ||
+                    code == OpCode::LoadFunc;
+                if (pureWrite && dest >= 0 && !flow.liveOut[op][dest])
+                {
+                    removeOps.push_back(flow.offsets[op]);
+                    continue;
+                }
+
+                // The previous op must run right before the Store, on every path to it, and still be there
+                if (code != OpCode::Store || op == 0 || isTarget[op] || !reachable[op - 1] ||
+                    (!removeOps.empty() && removeOps.back() == flow.offsets[op - 1]))
+                {
+                    continue;
+                }
+
+                // A Store to an argument slot hands the slot over to the previous op, which can't read it
+                char src = (char)raw[2];
+                bool slotDest = regs.write == 0;
+                dest = (char)raw[1];
+                unsigned char* prevRaw = &_byteBuffer[flow.offsets[op - 1]];
+                OpRegisters prevRegs = this->GetRegisterOperands(flow.offsets[op - 1]);
+                if (src < 0 || (!slotDest && src == dest) || prevRegs.write == 0 || (char)prevRaw[prevRegs.write] != src ||
+                    flow.liveOut[op][src])
+                {
+                    continue;
+                }
+
+                bool readsDest = false;
+                bool readsResult = false;
+                for (size_t read = 0; read < prevRegs.nReads; ++read)
+                {
+                    readsDest = readsDest || (!slotDest && (char)prevRaw[prevRegs.reads[read]] == dest);
+                    readsResult = readsResult || prevRegs.reads[read] == prevRegs.write;
+                }
+
+                if (!readsResult && (!readsDest || CanWriteOverOperand((OpCode)prevRaw[0])))
+                {
+                    prevRaw[prevRegs.write] = (unsigned char)dest;
+                    removeOps.push_back(flow.offsets[op]);
+                    if (slotDest)
+                    {
+                        size_t operand = flow.offsets[op - 1] + prevRegs.write;
+                        _argSlotOperands.insert(std::lower_bound(_argSlotOperands.begin(), _argSlotOperands.end(), operand), operand);
+                    }
+                }
+            }
+
+            changed = changed || !removeOps.empty();
+            this->RemoveOps(start, removeOps);
+        }
+    }
+
+    void BytecodeGen::AllocateRegisters(size_t start)
+    {
+        // Code generation hands out registers in a stack discipline and locals keep theirs until their scope
+        // closes. Reassign them from liveness instead: each register is split into webs, the connected ranges
+        // over which one of its values is live, and each web in order of its first op takes the lowest register
+        // that no web live at the same time holds. A Store prefers its source's register so the move can go.
+        FlowGraph flow;
+        this->BuildFlowGraph(start, &flow);
+        const std::vector<size_t>& offsets = flow.offsets;
+        const std::vector< std::vector<size_t> >& successors = flow.successors;
+        const std::vector< std::bitset<128> >& defs = flow.defs;
+        const std::vector< std::bitset<128> >& liveIn = flow.liveIn;
+        const std::vector< std::bitset<128> >& liveOut = flow.liveOut;
+        size_t nOps = offsets.size();
+
+        // Union find over the (op, register) points where a register is live or written, joined along the edges
+        // that a value stays live across
+        std::vector<size_t> parent(nOps * 128);
+        auto find = [&parent](size_t point)
+        {
+            while (parent[point] != point)
+            {
+                parent[point] = parent[parent[point]];
+                point = parent[point];
+            }
+            return point;
+        };
+
+        for (size_t point = 0; point < parent.size(); ++point)
+        {
+            parent[point] = point;
+        }
+
+        for (size_t op = 0; op < nOps; ++op)
+        {
+            for (size_t succ : successors[op])
+            {
+                std::bitset<128> shared = liveOut[op] & liveIn[succ];
+                for (size_t reg = 0; shared.any() && reg < 128; ++reg)
+                {
+                    if (shared[reg]) parent[find(op * 128 + reg)] = find(succ * 128 + reg);
+                }
+            }
+        }
+
+        struct Web
+        {
+            char reg;
+            int color;
+            std::vector<size_t> ops;
+            std::vector<size_t> moves;
+        };
+        std::vector<Web> webs;
+        std::vector<size_t> webAtRoot(parent.size(), SIZE_MAX);
+        std::vector< std::vector<size_t> > opWebs(nOps);
+        for (size_t op = 0; op < nOps; ++op)
+        {
+            std::bitset<128> present = liveIn[op] | defs[op];
+            for (size_t reg = 0; present.any() && reg < 128; ++reg)
+            {
+                if (!present[reg]) continue;
+
+                size_t root = find(op * 128 + reg);
+                if (webAtRoot[root] == SIZE_MAX)
+                {
+                    webAtRoot[root] = webs.size();
+                    webs.push_back(Web{ (char)reg, -1 });
+                }
+                webs[webAtRoot[root]].ops.push_back(op);
+                opWebs[op].push_back(webAtRoot[root]);
+            }
+        }
+
+        auto webOf = [&](size_t op, char reg) { return webAtRoot[find(op * 128 + reg)]; };
+        auto isMove = [&](size_t op, size_t web0, size_t web1)
+        {
+            const unsigned char* raw = &_byteBuffer[offsets[op]];
+            if ((OpCode)raw[0] != OpCode::Store || (char)raw[1] < 0 || (char)raw[2] < 0 || this->IsArgSlotOperand(offsets[op] + 1))
+            {
+                return false;
+            }
+            size_t dest = webOf(op, raw[1]);
+            size_t src = webOf(op, raw[2]);
+            return (web0 == dest && web1 == src) || (web0 == src && web1 == dest);
+        };
+
+        for (size_t op = 0; op < nOps; ++op)
+        {
+            const unsigned char* raw = &_byteBuffer[offsets[op]];
+            if ((OpCode)raw[0] == OpCode::Store && (char)raw[1] >= 0 && (char)raw[2] >= 0 && !this->IsArgSlotOperand(offsets[op] + 1))
+            {
+                size_t dest = webOf(op, raw[1]);
+                size_t src = webOf(op, raw[2]);
+                webs[dest].moves.push_back(src);
+                webs[src].moves.push_back(dest);
+            }
+        }
+
+        // Values read before anything is written rely on the null the frame starts with, so their register is
+        // left to them alone
+        std::bitset<128> reserved;
+        int nColors = 0;
+        for (Web& web : webs)
+        {
+            if (web.ops.front() == 0 && liveIn[0][web.reg])
+            {
+                web.color = nColors++;
+                reserved.set(web.color);
+            }
+        }
+
+        for (size_t webIdx = 0; webIdx < webs.size(); ++webIdx)
+        {
+            Web& web = webs[webIdx];
+            if (web.color >= 0) continue;
+
+            std::bitset<128> used = reserved;
+            for (size_t op : web.ops)
+            {
+                for (size_t other : opWebs[op])
+                {
+                    if (other != webIdx && webs[other].color >= 0 && !isMove(op, webIdx, other))
+                    {
+                        used.set(webs[other].color);
+                    }
+                }
+            }
+
+            for (size_t partner : web.moves)
+            {
+                if (webs[partner].color >= 0 && !used[webs[partner].color])
+                {
+                    web.color = webs[partner].color;
+                    break;
+                }
+            }
+
+            for (int color = 0; web.color < 0 && color < 128; ++color)
+            {
+                if (!used[color]) web.color = color;
+            }
+
+            if (web.color < 0)
+            {
+                // Keep the registers code generation assigned
+                return;
+            }
+
+            nColors = std::max(nColors, web.color + 1);
+        }
+
+        if ((size_t)nColors > _fd->nLocalRegisters)
+        {
+            return;
+        }
+
+        // Rewrite the register operands and drop the Stores that now copy a register onto itself
+        std::vector<size_t> removeOps;
+        for (size_t op = 0; op < nOps; ++op)
+        {
+            unsigned char* raw = &_byteBuffer[offsets[op]];
+            OpRegisters regs = this->GetRegisterOperands(offsets[op]);
+
+            // Look up every operand before writing any since Inc and friends read and write the same byte
+            unsigned char positions[4];
+            size_t nPositions = 0;
+            for (size_t read = 0; read < regs.nReads; ++read)
+            {
+                positions[nPositions++] = regs.reads[read];
+            }
+            if (regs.write != 0) positions[nPositions++] = regs.write;
+
+            char newRegs[4];
+            for (size_t pos = 0; pos < nPositions; ++pos)
+            {
+                char reg = (char)raw[positions[pos]];
+                newRegs[pos] = reg >= 0 ? (char)webs[webOf(op, reg)].color : reg;
+            }
+            for (size_t pos = 0; pos < nPositions; ++pos)
+            {
+                raw[positions[pos]] = (unsigned char)newRegs[pos];
+            }
+
+            if ((OpCode)raw[0] == OpCode::Store && raw[1] == raw[2] && !this->IsArgSlotOperand(offsets[op] + 1))
+            {
+                removeOps.push_back(offsets[op]);
+            }
+        }
+
+        // Debug names follow the locals to their new registers, params keep theirs
+        std::map<int, std::string> localLookup;
+        for (auto& entry : _fd->localLookup)
+        {
+            if (entry.first < 0) localLookup.insert(entry);
+        }
+        for (const Web& web : webs)
+        {
+            size_t webStart = offsets[web.ops.front()];
+            size_t webEnd = offsets[web.ops.back()];
+            for (const LocalRange& local : _localRanges)
+            {
+                if (local.reg == web.reg && webEnd >= local.start && webStart < local.end)
+                {
+                    localLookup.insert(std::make_pair(web.color, local.name));
+                    break;
+                }
+            }
+        }
+        _fd->localLookup = std::move(localLookup);
+        _fd->nLocalRegisters = nColors;
+
+        this->RemoveOps(start, removeOps);
+    }
+
+    void BytecodeGen::RemoveOps(size_t start, const std::vector<size_t>& opOffsets)
+    {
+        if (opOffsets.empty()) return;
+
+        // Compact the ops, mapping every old op offset to its new one. A removed op maps to the op that took
+        // its place so jumps to it land on the next op.
+        // Argument slot operands move with their op and go with it when it is removed.
+        std::vector<unsigned int> newOffsets(_byteBuffer.size() - start + 1);
+        size_t writeIdx = start;
+        auto removeIter = opOffsets.begin();
+        auto slotIter = _argSlotOperands.begin();
+        auto slotWrite = _argSlotOperands.begin();
+        for (size_t idx = start; idx < _byteBuffer.size();)
+        {
+            size_t size = GetOpSize((OpCode)_byteBuffer[idx]);
+            newOffsets[idx - start] = (unsigned int)writeIdx;
+            bool removed = removeIter != opOffsets.end() && *removeIter == idx;
+            for (; slotIter != _argSlotOperands.end() && *slotIter < idx + size; ++slotIter)
+            {
+                if (!removed) *slotWrite++ = *slotIter - idx + writeIdx;
+            }
+
+            if (removed)
+            {
+                ++removeIter;
+            }
+            else
+            {
+                memmove(&_byteBuffer[writeIdx], &_byteBuffer[idx], size);
+                writeIdx += size;
+            }
+            idx += size;
+        }
+        _argSlotOperands.erase(slotWrite, _argSlotOperands.end());
+        Assert(removeIter == opOffsets.end(), "Removed op offsets must be sorted op starts");
+        newOffsets[_byteBuffer.size() - start] = (unsigned int)writeIdx;
+        _byteBuffer.resize(writeIdx);
+
+        for (size_t idx = start; idx < _byteBuffer.size(); idx += GetOpSize((OpCode)_byteBuffer[idx]))
+        {
+            size_t targetPos = GetOpTargetPosition((OpCode)_byteBuffer[idx]);
+            if (targetPos != 0)
+            {
+                unsigned int target = *((unsigned int*)&_byteBuffer[idx + targetPos]);
+                this->SetOpOperand(idx, (int)targetPos - 1, newOffsets[target - start]);
+            }
+        }
+    }
+
+    void BytecodeGen::SpecializeScalarStores(size_t start)
+    {
+        // Find the registers that may ever hold a ref counted value. Stores copy that possibility from their
+        // source so the scan repeats until it settles. Params hold caller values and are never scalar only.
+        std::bitset<128> refRegisters;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (size_t idx = start; idx < _byteBuffer.size(); idx += GetOpSize((OpCode)_byteBuffer[idx]))
+            {
+                const unsigned char* raw = &_byteBuffer[idx];
+                char dest;
+                bool refResult;
+                switch ((OpCode)raw[0])
+                {
+                case OpCode::Call:
+                    dest = (char)raw[3];
+                    refResult = true;
+                    break;
+                case OpCode::CallDirect:
+                    dest = (char)raw[6];
+                    refResult = true;
+                    break;
+                case OpCode::MakeList:
+                case OpCode::MakeMap:
+                    dest = (char)raw[1];
+                    refResult = true;
+                    break;
+                case OpCode::Concat:
+                case OpCode::Index:
+                    dest = (char)raw[3];
+                    refResult = true;
+                    break;
+                case OpCode::Store:
+                    dest = (char)raw[1];
+                    refResult = (char)raw[2] < 0 || refRegisters[(char)raw[2]];
+                    break;
+                default:
+                    // Every other op either writes no register or produces a number, boolean, function or
+                    // static string
+                    continue;
+                }
+
+                if (this->GetRegisterOperands(idx).write == 0)
+                {
+                    // Argument slots are passed on to the callee rather than read here
+                    continue;
+                }
+
+                if (refResult && dest >= 0 && !refRegisters[dest])
+                {
+                    refRegisters[dest] = true;
+                    changed = true;
+                }
+            }
+        }
+
+        // Switch the stores into scalar only registers to the forms that skip the Deref
+        for (size_t idx = start; idx < _byteBuffer.size(); idx += GetOpSize((OpCode)_byteBuffer[idx]))
+        {
+            unsigned char* raw = &_byteBuffer[idx];
+            OpCode scalarOp;
+            char dest;
+            switch ((OpCode)raw[0])
+            {
+            case OpCode::LoadInt: scalarOp = OpCode::LoadIntS; dest = (char)raw[1]; break;
+            case OpCode::Store: scalarOp = OpCode::StoreS; dest = (char)raw[1]; break;
+            case OpCode::Add: scalarOp = OpCode::AddS; dest = (char)raw[3]; break;
+            case OpCode::Sub: scalarOp = OpCode::SubS; dest = (char)raw[3]; break;
+            case OpCode::Mul: scalarOp = OpCode::MulS; dest = (char)raw[3]; break;
+            case OpCode::AddImm: scalarOp = OpCode::AddImmS; dest = (char)raw[6]; break;
+            case OpCode::MulImm: scalarOp = OpCode::MulImmS; dest = (char)raw[6]; break;
+            default: continue;
+            }
+
+            // Argument slots start out null so only the source of a Store into one needs to be scalar
+            if (this->GetRegisterOperands(idx).write == 0)
+            {
+                if (scalarOp == OpCode::StoreS && ((char)raw[2] < 0 || refRegisters[(char)raw[2]])) continue;
+            }
+            else if (dest < 0 || refRegisters[dest])
+            {
+                continue;
+            }
+
+            raw[0] = (unsigned char)scalarOp;
+        }
+    }
+
+    void BytecodeGen::PatchArgSlots(const AstNode& node)
+    {
+        // Argument slots sit right above the frame's registers
+        for (size_t operand : _argSlotOperands)
+        {
+            size_t reg = _fd->nLocalRegisters + _byteBuffer[operand];
+            if (reg > CHAR_MAX)
+            {
+                throw CreateEx(Err::BytecodeGen_InsufficientRegisters, node.GetToken());
+            }
+
+            _byteBuffer[operand] = (unsigned char)reg;
+        }
+        _argSlotOperands.clear();
+    }
+
+    char BytecodeGen::CompileBinaryOp(OpCode op, const AstNode& lhs, const AstNode& rhs, const AstNode& node)
+    {
+        // Integer literal operands of add, subtract and multiply are folded into the immediate forms
+        if (op == OpCode::Add || op == OpCode::Sub || op == OpCode::Mul)
+        {
+            const AstNode* valueExpr = nullptr;
+            int immediate = 0;
+            if (rhs.GetSym() == Symbol::Int && !(op == OpCode::Sub && rhs.GetToken()->GetInt() == INT_MIN))
+            {
+                valueExpr = &lhs;
+                immediate = op == OpCode::Sub ? -rhs.GetToken()->GetInt() : rhs.GetToken()->GetInt();
+            }
+            else if (lhs.GetSym() == Symbol::Int && op != OpCode::Sub)
+            {
+                valueExpr = &rhs;
+                immediate = lhs.GetToken()->GetInt();
+            }
+
+            if (valueExpr != nullptr)
+            {
+                char reg = GetRegResult(this->CompileExpression(*valueExpr));
+                char outReg = this->ClaimRegister(node);
+                this->AddOp(op == OpCode::Mul ? OpCode::MulImm : OpCode::AddImm, reg, immediate, outReg);
+                this->ReleaseRegister(reg);
+                return outReg;
+            }
+        }
+
+        char reg0 = GetRegResult(this->CompileExpression(lhs));
+        char reg1 = GetRegResult(this->CompileExpression(rhs));
+        char outReg = this->ClaimRegister(node);
+        this->AddOp(op, reg0, reg1, outReg);
+        this->ReleaseRegister(reg0);
+        this->ReleaseRegister(reg1);
+        return outReg;
+    }
+
+    void BytecodeGen::CompileBranchTrue(const AstNode& checkExpr, unsigned int target)
+    {
+        // Comparisons branch directly rather than materializing a boolean for BrT
+        OpCode branchOp = this->MapCompareBranchOp(checkExpr.GetSym());
+        if (branchOp != OpCode::Unknown)
+        {
+            Assert(checkExpr.GetChildren().size() == 2, "Unexpected number of children");
+            char reg0 = GetRegResult(this->CompileExpression(checkExpr.GetFirstChild()));
+            char reg1 = GetRegResult(this->CompileExpression(checkExpr.GetSecondChild()));
+            this->AddOp(branchOp, reg0, reg1, target);
+            this->ReleaseRegister(reg0);
+            this->ReleaseRegister(reg1);
+        }
+        else
+        {
+            char reg = GetRegResult(this->CompileExpression(checkExpr));
+            this->AddOp(OpCode::BrT, reg, target);
+            this->ReleaseRegister(reg);
+        }
+    }
+
     void BytecodeGen::CompileFor(const AstNode& node)
     {
         Assert(node.GetSym() == Symbol::For, "Unexpected node");
@@ -444,17 +1095,15 @@ namespace scrpt
             }
         }
 
-        // Check
-        unsigned int reentry = (unsigned int)_byteBuffer.size();
-        size_t brIdx = 0;
+        // Loops are laid out with the check at the bottom so each iteration only takes one branch
+        size_t checkJmpIdx = 0;
         if (!checkExpr.IsEmpty())
         {
-            char reg = GetRegResult(this->CompileExpression(checkExpr));
-            brIdx = this->AddOp(OpCode::BrF, reg, unsigned int(0xFFFFFFFF));
-            this->ReleaseRegister(reg);
+            checkJmpIdx = this->AddOp(OpCode::Jmp, unsigned int(0xFFFFFFFF));
         }
 
         // Block
+        unsigned int reentry = (unsigned int)_byteBuffer.size();
         this->PushScope();
         this->CompileStatement(blockStatement);
         this->PopScope();
@@ -465,10 +1114,16 @@ namespace scrpt
             char reg = GetRegResult(this->CompileExpression(endExpr));
             this->ReleaseRegister(reg);
         }
-        this->AddOp(OpCode::Jmp, reentry);
+
+        // Check
         if (!checkExpr.IsEmpty())
         {
-            this->SetOpOperand(brIdx, 1, (unsigned int)_byteBuffer.size());
+            this->SetOpOperand(checkJmpIdx, 0, (unsigned int)_byteBuffer.size());
+            this->CompileBranchTrue(checkExpr, reentry);
+        }
+        else
+        {
+            this->AddOp(OpCode::Jmp, reentry);
         }
 
         this->PopScope();
@@ -484,15 +1139,14 @@ namespace scrpt
 
         this->PushScope();
 
+        // Check is at the bottom of the loop, see CompileFor
+        size_t checkJmpIdx = this->AddOp(OpCode::Jmp, unsigned int(0xFFFFFFFF));
         unsigned int reentry = (unsigned int)_byteBuffer.size();
-        char checkReg = GetRegResult(this->CompileExpression(checkExpr));
-        size_t brIdx = this->AddOp(OpCode::BrF, checkReg, unsigned int(0xFFFFFFFF));
-        this->ReleaseRegister(checkReg);
         this->PushScope();
         this->CompileStatement(blockStatement);
         this->PopScope();
-        this->AddOp(OpCode::Jmp, reentry);
-        this->SetOpOperand(brIdx, 1, (unsigned int)_byteBuffer.size());
+        this->SetOpOperand(checkJmpIdx, 0, (unsigned int)_byteBuffer.size());
+        this->CompileBranchTrue(checkExpr, reentry);
 
         this->PopScope();
     }
@@ -508,9 +1162,7 @@ namespace scrpt
         this->PushScope();
         this->CompileStatement(node.GetFirstChild());
         this->PopScope();
-        char checkReg = GetRegResult(this->CompileExpression(node.GetSecondChild()));
-        this->AddOp(OpCode::BrT, checkReg, reentry);
-        this->ReleaseRegister(checkReg);
+        this->CompileBranchTrue(node.GetSecondChild(), reentry);
 
         this->PopScope();
     }
@@ -571,14 +1223,34 @@ namespace scrpt
         char reg;
         if (node.GetChildren().size() > 0)
         {
-            reg = GetRegResult(this->CompileExpression(node.GetFirstChild()));
+            const AstNode& value = node.GetFirstChild();
+            if (!value.IsEmpty() && value.GetSym() == Symbol::LParen && value.IsPostfix())
+            {
+                bool tailCall = false;
+                reg = this->CompileCall(value, &tailCall);
+                if (tailCall) return;
+            }
+            else
+            {
+                reg = GetRegResult(this->CompileExpression(value));
+            }
         }
         else
         {
             reg = this->ClaimRegister(node);
             this->AddOp(OpCode::LoadNull, reg);
         }
-        this->AddOp(OpCode::Ret, reg);
+
+        if (!_inlineFrames.empty())
+        {
+            InlineFrame& frame = _inlineFrames.back();
+            this->AddOp(OpCode::Store, frame.resultReg, reg);
+            frame.exitJmps.push_back(this->AddOp(OpCode::Jmp, unsigned int(0xFFFFFFFF)));
+        }
+        else
+        {
+            this->AddOp(OpCode::Ret, reg);
+        }
         this->ReleaseRegister(reg);
     }
 
@@ -587,18 +1259,24 @@ namespace scrpt
         Assert(node.GetSym() == Symbol::Var, "Unexpected node");
         Assert(node.GetChildren().size() > 0 && node.GetChildren().size() < 3, "Unexpected number of children");
 
-        // TODO: Claiming the register before resolving the expression does result in some register
-        // use bloat that isn't necessary.
-        char identReg = this->AddLocal(node.GetFirstChild());
+        // The initializer is resolved before the local is claimed so its temporaries don't sit under the local's
+        // register, AllocateRegisters then coalesces the Store away when it can
         if (node.GetChildren().size() == 2)
         {
             char rhsReg = GetRegResult(this->CompileExpression(node.GetSecondChild()));
+            char identReg = this->AddLocal(node.GetFirstChild());
             this->AddOp(OpCode::Store, identReg, rhsReg);
             this->ReleaseRegister(rhsReg);
         }
+        else
+        {
+            // Registers are shared with earlier values, so a declaration without an initializer sets null
+            char identReg = this->AddLocal(node.GetFirstChild());
+            this->AddOp(OpCode::LoadNull, identReg);
+        }
     }
 
-    char BytecodeGen::CompileCall(const AstNode& node)
+    char BytecodeGen::CompileCall(const AstNode& node, bool* tailCall /* = nullptr */)
     {
         Assert(node.GetSym() == Symbol::LParen, "Unexpected node");
         Assert(node.GetChildren().size() >= 1, "Unexpected child count on Call node");
@@ -612,8 +1290,46 @@ namespace scrpt
             throw CreateEx(Err::BytecodeGen_ParameterCountExceeded, node.GetToken());
         }
 
+        // A return inside a body inlined by a return leaves the function just the same
+        bool tail = tailCall != nullptr && (_inlineFrames.empty() || _inlineFrames.back().tail);
+
+        // A call by name that no local shadows always reaches the same function, so its arity is checked here
+        // and the call needs no function handle
+        bool direct = false;
+        unsigned int funcId = 0;
+        char shadowReg;
+        if (!classCall && firstChild.GetSym() == Symbol::Ident && !this->LookupIdentOffset(firstChild.GetToken()->GetString(), &shadowReg))
+        {
+            auto funcIter = _functionLookup.find(firstChild.GetToken()->GetString());
+            if (funcIter != _functionLookup.end())
+            {
+                direct = true;
+                funcId = funcIter->second;
+                if (_functions[funcId].nParam != nParam)
+                {
+                    throw CreateEx(Err::BytecodeGen_IncorrectCallArity, node.GetToken());
+                }
+
+                char inlineReg;
+                if (this->CompileInlineCall(node, funcId, tail, &inlineReg))
+                {
+                    return inlineReg;
+                }
+            }
+        }
+
+        // Arguments go to slots pushed above the frame, which become the callee's params. They are reserved before
+        // any argument is evaluated so that nested calls and list literals push above them.
+        size_t slot = _stackDepth;
+        auto reserveSlots = [&]()
+        {
+            if (nParam == 0) return;
+            this->AddOp(OpCode::PushN, (char)nParam);
+            _stackDepth += nParam;
+        };
+
         // Get the function handle
-        char funcReg;
+        char funcReg = 0;
         if (classCall)
         {
             // If the LHS is a ":" then we special case for a class call (implicit this)
@@ -627,14 +1343,16 @@ namespace scrpt
             this->AddOp(OpCode::LoadString, indexReg, strId);
             funcReg = this->ClaimRegister(node);
             this->AddOp(OpCode::Index, sourceReg, indexReg, funcReg);
-            this->AddOp(OpCode::Push, sourceReg);
+            reserveSlots();
+            this->AddArgSlotStore(firstChild, slot++, sourceReg);
             this->ReleaseRegister(sourceReg);
             this->ReleaseRegister(indexReg);
         }
         else
         {
             // Otherwise just compile the LHS as an expression
-            funcReg = GetRegResult(this->CompileExpression(firstChild));
+            if (!direct) funcReg = GetRegResult(this->CompileExpression(firstChild));
+            reserveSlots();
         }
 
         // Compile parameters for the call
@@ -642,20 +1360,161 @@ namespace scrpt
         for (auto child = ++children.begin(); child != children.end(); ++child)
         {
             char reg = GetRegResult(this->CompileExpression(**child));
-            this->AddOp(OpCode::Push, reg);
+            this->AddArgSlotStore(**child, slot++, reg);
             this->ReleaseRegister(reg);
         }
 
-        this->AddOp(OpCode::Call, funcReg, (char)nParam);
-        this->ReleaseRegister(funcReg);
-
-        if (nParam > 0) this->AddOp(OpCode::PopN, (char)nParam);
+        // A script function called by a return whose arguments fit in the returning function's slots takes over
+        // its frame, so recursion in tail position runs in constant stack space
+        if (tail && direct && !_functions[funcId].external && nParam <= _fd->nParam)
+        {
+            this->AddOp(OpCode::TailCall, funcId, (char)nParam, (char)_fd->nParam);
+            _stackDepth -= nParam;
+            *tailCall = true;
+            return 0;
+        }
 
+        // Returning releases the slots and writes the result straight to its register
         char reg = this->ClaimRegister(node);
-        this->AddOp(OpCode::RestoreRet, reg);
+        if (direct)
+        {
+            this->AddOp(OpCode::CallDirect, funcId, (char)nParam, reg);
+        }
+        else
+        {
+            this->AddOp(OpCode::Call, funcReg, (char)nParam, reg);
+            this->ReleaseRegister(funcReg);
+        }
+        _stackDepth -= nParam;
+
         return reg;
     }
 
+    void BytecodeGen::AddArgSlotStore(const AstNode& node, size_t slot, char reg)
+    {
+        // Slot operands hold the slot's depth above the frame until the frame size is known
+        if (slot > CHAR_MAX)
+        {
+            throw CreateEx(Err::BytecodeGen_InsufficientRegisters, node.GetToken());
+        }
+
+        size_t op = this->AddOp(OpCode::Store, (char)slot, reg);
+        _argSlotOperands.push_back(op + 1);
+    }
+
+    bool BytecodeGen::CompileInlineCall(const AstNode& node, unsigned int funcId, bool tail, char* outReg)
+    {
+        if (_functionNodes[funcId] == nullptr)
+        {
+            return false;
+        }
+
+        const AstNode& func = *_functionNodes[funcId];
+        std::vector<const AstNode*> args(++node.GetChildren().begin(), node.GetChildren().end());
+        size_t nArg = args.size();
+        Assert(func.GetChildren().size() - 2 == nArg, "Arity is checked before inlining");
+
+        // A function already being compiled further out would inline itself forever
+        if (&_functions[funcId] == _fd)
+        {
+            return false;
+        }
+        for (const InlineFrame& frame : _inlineFrames)
+        {
+            if (frame.funcId == funcId) return false;
+        }
+
+        const AstNode& block = func.GetLastChild();
+        size_t budget = _inlineFrames.empty() ? _inlineBudget : _inlineFrames.back().budget;
+        size_t size = CountNodes(block);
+        if (size > budget || _registers.count() + nArg + size + 1 > _registers.size())
+        {
+            return false;
+        }
+
+        // Arguments are evaluated in order like the Pushes of a call. A temporary becomes the param outright and
+        // a local's register is shared unless the body assigns the param or a later argument assigns the local,
+        // in which case the param is a copy of the value as it was passed.
+        std::vector<bool> laterAssigns(nArg, false);
+        for (size_t arg = nArg; arg > 1; --arg)
+        {
+            laterAssigns[arg - 2] = laterAssigns[arg - 1] || AssignsIdent(*args[arg - 1], nullptr);
+        }
+
+        std::vector<char> argRegs;
+        auto param = ++func.GetChildren().begin();
+        for (size_t arg = 0; arg < nArg; ++arg, ++param)
+        {
+            char reg = GetRegResult(this->CompileExpression(*args[arg]));
+            bool temporary = reg >= 0 && !_lockedRegisters.test(reg);
+            if (!temporary && (laterAssigns[arg] || AssignsIdent(block, (*param)->GetToken()->GetString())))
+            {
+                char copyReg = this->ClaimRegister(*args[arg]);
+                this->AddOp(OpCode::Store, copyReg, reg);
+                reg = copyReg;
+            }
+            argRegs.push_back(reg);
+        }
+
+        char resultReg = this->ClaimRegister(node);
+
+        // The body gets a scope of its own that can't see the caller's locals
+        this->PushScope();
+        size_t scopeFloor = _scopeFloor;
+        _scopeFloor = _scopeStack.size() - 1;
+        std::vector<std::string> sharedParams;
+        param = ++func.GetChildren().begin();
+        for (size_t arg = 0; arg < nArg; ++arg, ++param)
+        {
+            const char* ident = (*param)->GetToken()->GetString();
+            if (!this->IsLocalIdentAvailable(**param))
+            {
+                throw CreateEx(Err::BytecodeGen_DuplicateParameterName, (*param)->GetToken());
+            }
+
+            char reg = argRegs[arg];
+            if (reg >= 0 && !_lockedRegisters.test(reg))
+            {
+                // Released with the scope
+                _lockedRegisters.set(reg);
+            }
+            else
+            {
+                sharedParams.push_back(ident);
+            }
+            _scopeStack.back()[ident] = reg;
+        }
+
+        _inlineFrames.push_back(InlineFrame{ funcId, budget - size, resultReg, tail, std::vector<size_t>() });
+        for (AstNode* statement : block.GetChildren())
+        {
+            this->CompileStatement(*statement);
+        }
+
+        if (block.GetChildren().size() == 0 || block.GetLastChild().GetSym() != Symbol::Return)
+        {
+            this->AddOp(OpCode::LoadNull, resultReg);
+        }
+
+        for (size_t offset : _inlineFrames.back().exitJmps)
+        {
+            this->SetOpOperand(offset, 0, (unsigned int)_byteBuffer.size());
+        }
+        _inlineFrames.pop_back();
+
+        // Shared registers stay with the caller's locals
+        for (const std::string& ident : sharedParams)
+        {
+            _scopeStack.back().erase(ident);
+        }
+        this->PopScope();
+        _scopeFloor = scopeFloor;
+
+        ++_stats.inlinedCalls;
+        *outReg = resultReg;
+        return true;
+    }
+
     char BytecodeGen::CompileList(const AstNode& node)
     {
         Assert(node.GetSym() == Symbol::LSquare, "Unexpected node");
@@ -667,10 +1526,12 @@ namespace scrpt
             char reg = GetRegResult(this->CompileExpression(**child));
             this->AddOp(OpCode::Push, reg);
             this->ReleaseRegister(reg);
+            ++_stackDepth;
         }
 
         char reg = this->ClaimRegister(node);
         this->AddOp(OpCode::MakeList, reg, (unsigned int)children.size());
+        _stackDepth -= children.size();
         return reg;
     }
 
@@ -687,10 +1548,12 @@ namespace scrpt
             char reg = GetRegResult(this->CompileExpression(**child));
             this->AddOp(OpCode::Push, reg);
             this->ReleaseRegister(reg);
+            ++_stackDepth;
         }
 
         char reg = this->ClaimRegister(node);
         this->AddOp(OpCode::MakeMap, reg, (unsigned int)children.size());
+        _stackDepth -= children.size();
         return reg;
     }
 
@@ -727,6 +1590,21 @@ namespace scrpt
         return ret;
     }
 
+    size_t BytecodeGen::AddOp(OpCode op, char reg0, char reg1, unsigned int data)
+    {
+        size_t ret = this->AddOp(op, reg0, reg1);
+        this->AddData((unsigned char*)&data);
+        return ret;
+    }
+
+    size_t BytecodeGen::AddOp(OpCode op, char reg0, int data, char reg2)
+    {
+        size_t ret = this->AddOp(op, reg0);
+        this->AddData((unsigned char*)&data);
+        _byteBuffer.push_back(static_cast<unsigned char>(reg2));
+        return ret;
+    }
+
     size_t BytecodeGen::AddOp(OpCode op, char reg0, unsigned int data)
     {
         size_t ret = this->AddOp(op, reg0);
@@ -755,6 +1633,14 @@ namespace scrpt
         return ret;
     }
 
+    size_t BytecodeGen::AddOp(OpCode op, unsigned int data, char value, char reg)
+    {
+        size_t ret = this->AddOp(op, data);
+        _byteBuffer.push_back(static_cast<unsigned char>(value));
+        _byteBuffer.push_back(static_cast<unsigned char>(reg));
+        return ret;
+    }
+
     void BytecodeGen::AddData(unsigned char* data)
     {
         size_t ret = _byteBuffer.size();
@@ -828,6 +1714,199 @@ namespace scrpt
         }
     }
 
+    OpCode BytecodeGen::MapCompareBranchOp(Symbol sym) const
+    {
+        switch (sym)
+        {
+        case Symbol::LessThan: return OpCode::BrLT;
+        case Symbol::LessThanEq: return OpCode::BrLTE;
+        case Symbol::GreaterThan: return OpCode::BrGT;
+        case Symbol::GreaterThanEq: return OpCode::BrGTE;
+        default: return OpCode::Unknown;
+        }
+    }
+
+    BytecodeGen::OpRegisters BytecodeGen::GetOpRegisters(OpCode op)
+    {
+        switch (op)
+        {
+        case OpCode::LoadNull:
+        case OpCode::LoadTrue:
+        case OpCode::LoadFalse:
+        case OpCode::LoadInt:
+        case OpCode::LoadIntS:
+        case OpCode::LoadFloat:
+        case OpCode::LoadString:
+        case OpCode::LoadFunc:
+        case OpCode::MakeList:
+        case OpCode::MakeMap:
+            return OpRegisters{ { 0 }, 0, 1 };
+        case OpCode::Store:
+        case OpCode::StoreS:
+            return OpRegisters{ { 2 }, 1, 1 };
+        case OpCode::StoreIdx:
+            return OpRegisters{ { 1, 2, 3 }, 3, 0 };
+        case OpCode::Eq:
+        case OpCode::Or:
+        case OpCode::And:
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div:
+        case OpCode::Mod:
+        case OpCode::Concat:
+        case OpCode::LT:
+        case OpCode::GT:
+        case OpCode::LTE:
+        case OpCode::GTE:
+        case OpCode::Index:
+        case OpCode::AddS:
+        case OpCode::SubS:
+        case OpCode::MulS:
+            return OpRegisters{ { 1, 2 }, 2, 3 };
+        case OpCode::Inc:
+        case OpCode::Dec:
+        case OpCode::PostInc:
+        case OpCode::PostDec:
+            return OpRegisters{ { 1 }, 1, 1 };
+        case OpCode::Neg:
+            return OpRegisters{ { 1 }, 1, 2 };
+        case OpCode::Call:
+            return OpRegisters{ { 1 }, 1, 3 };
+        case OpCode::Ret:
+        case OpCode::Push:
+        case OpCode::BrT:
+        case OpCode::BrF:
+            return OpRegisters{ { 1 }, 1, 0 };
+        case OpCode::BrLT:
+        case OpCode::BrLTE:
+        case OpCode::BrGT:
+        case OpCode::BrGTE:
+            return OpRegisters{ { 1, 2 }, 2, 0 };
+        case OpCode::AddImm:
+        case OpCode::MulImm:
+        case OpCode::AddImmS:
+        case OpCode::MulImmS:
+            return OpRegisters{ { 1 }, 1, 6 };
+        case OpCode::CallDirect:
+            return OpRegisters{ { 0 }, 0, 6 };
+        case OpCode::Jmp:
+        case OpCode::PushN:
+        case OpCode::TailCall:
+            return OpRegisters{ { 0 }, 0, 0 };
+        default:
+            AssertFail("Op is never emitted by the compiler: " << OpCodeToString(op));
+        }
+
+        return OpRegisters{ { 0 }, 0, 0 };
+    }
+
+    BytecodeGen::OpRegisters BytecodeGen::GetRegisterOperands(size_t opOffset) const
+    {
+        OpRegisters regs = GetOpRegisters((OpCode)_byteBuffer[opOffset]);
+        if (_argSlotOperands.empty())
+        {
+            return regs;
+        }
+
+        size_t nReads = 0;
+        for (size_t read = 0; read < regs.nReads; ++read)
+        {
+            if (!this->IsArgSlotOperand(opOffset + regs.reads[read])) regs.reads[nReads++] = regs.reads[read];
+        }
+        regs.nReads = nReads;
+        if (regs.write != 0 && this->IsArgSlotOperand(opOffset + regs.write)) regs.write = 0;
+        return regs;
+    }
+
+    bool BytecodeGen::IsArgSlotOperand(size_t offset) const
+    {
+        return std::binary_search(_argSlotOperands.begin(), _argSlotOperands.end(), offset);
+    }
+
+    size_t BytecodeGen::CountNodes(const AstNode& node)
+    {
+        size_t count = 1;
+        for (const AstNode* child : node.GetChildren())
+        {
+            count += CountNodes(*child);
+        }
+        return count;
+    }
+
+    bool BytecodeGen::AssignsIdent(const AstNode& node, const char* ident)
+    {
+        if (node.IsEmpty())
+        {
+            return false;
+        }
+
+        switch (node.GetSym())
+        {
+        case Symbol::Assign:
+        case Symbol::PlusEq:
+        case Symbol::MinusEq:
+        case Symbol::MultEq:
+        case Symbol::DivEq:
+        case Symbol::ModuloEq:
+        case Symbol::ConcatEq:
+        case Symbol::PlusPlus:
+        case Symbol::MinusMinus:
+            {
+                const AstNode& target = node.GetFirstChild();
+                if (target.GetSym() == Symbol::Ident && (ident == nullptr || strcmp(target.GetToken()->GetString(), ident) == 0))
+                {
+                    return true;
+                }
+            }
+            break;
+        }
+
+        for (const AstNode* child : node.GetChildren())
+        {
+            if (AssignsIdent(*child, ident)) return true;
+        }
+        return false;
+    }
+
+    bool BytecodeGen::CanWriteOverOperand(OpCode op)
+    {
+        switch (op)
+        {
+        case OpCode::Eq:
+        case OpCode::Or:
+        case OpCode::And:
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div:
+        case OpCode::Mod:
+        case OpCode::Neg:
+        case OpCode::LT:
+        case OpCode::GT:
+        case OpCode::LTE:
+        case OpCode::GTE:
+        case OpCode::AddImm:
+        case OpCode::MulImm:
+            return true;
+        }
+
+        // Concat and Index may release the operand they read from when the result replaces it
+        return false;
+    }
+
+    size_t BytecodeGen::GetOpTargetPosition(OpCode op)
+    {
+        switch (GetOpLayout(op))
+        {
+        case OpLayout::RegTarget: return 2;
+        case OpLayout::RegRegTarget: return 3;
+        case OpLayout::Target: return 1;
+        }
+
+        return 0;
+    }
+
     void BytecodeGen::PushScope()
     {
         _scopeStack.push_back(std::map<std::string, char>());
@@ -840,6 +1919,14 @@ namespace scrpt
         for (auto& entry : scope)
         {
             this->ReleaseRegister(entry.second, true);
+            for (auto local = _localRanges.rbegin(); local != _localRanges.rend(); ++local)
+            {
+                if (local->reg == entry.second && local->end == SIZE_MAX)
+                {
+                    local->end = _byteBuffer.size();
+                    break;
+                }
+            }
         }
         _scopeStack.pop_back();
     }
@@ -917,6 +2004,7 @@ namespace scrpt
         const char* ident = node.GetToken()->GetString();
         _scopeStack.back()[ident] = reg;
         _fd->localLookup[reg] = ident;
+        _localRanges.push_back(LocalRange{ reg, ident, _byteBuffer.size(), SIZE_MAX });
 
         return reg;
     }
@@ -977,7 +2065,7 @@ namespace scrpt
                 *id = entry->second;
                 return true;
             }
-        } while (idx > 0);
+        } while (idx > _scopeFloor);
 
         return false;
     }
@@ -2,6 +2,15 @@
 
 namespace scrpt
 {
+    // Op counts over all compiled functions before and after the bytecode clean up passes, and the number of
+    // calls that were compiled inline
+    struct BytecodeGenStats
+    {
+        size_t opsBefore;
+        size_t opsAfter;
+        size_t inlinedCalls;
+    };
+
     class BytecodeGen
     {
     public:
@@ -10,35 +19,84 @@ namespace scrpt
         void AddExternFunc(const char* name, unsigned char nParam, const std::function<void(VM*)>& func);
         void Consume(const AstNode& ast);
         Bytecode GetBytecode();
+        const BytecodeGenStats& GetStats() const;
+        // Calls by name to a script function whose body has at most this many AST nodes are compiled inline,
+        // 0 turns inlining off
+        void SetInlineBudget(size_t nodes);
 
     private:
         void RecordFunction(const AstNode& node);
         void CompileFunction(const AstNode& node);
         void CompileStatement(const AstNode& node);
         std::tuple<bool, char> CompileExpression(const AstNode& node);
+        char CompileBinaryOp(OpCode op, const AstNode& lhs, const AstNode& rhs, const AstNode& node);
+        void CompileBranchTrue(const AstNode& checkExpr, unsigned int target);
         void CompileFor(const AstNode& node);
         void CompileWhile(const AstNode& node);
         void CompileDo(const AstNode& node);
         void CompileIf(const AstNode& node);
         void CompileReturn(const AstNode& node);
         void CompileDecl(const AstNode& node);
-        char CompileCall(const AstNode& node);
+        // Emits a TailCall instead when tailCall is given and the call can take over the frame, setting it true
+        char CompileCall(const AstNode& node, bool* tailCall = nullptr);
+        bool CompileInlineCall(const AstNode& node, unsigned int funcId, bool tail, char* outReg);
         char CompileList(const AstNode& node);
         char CompileMap(const AstNode& node);
+        void AddArgSlotStore(const AstNode& node, size_t slot, char reg);
+        // Ops of one function with their control flow and register liveness
+        struct FlowGraph
+        {
+            std::vector<size_t> offsets;
+            std::vector<size_t> opAtOffset; // Indexed by offset from the function start, ops count when not an op
+            std::vector< std::vector<size_t> > successors;
+            std::vector< std::bitset<128> > uses;
+            std::vector< std::bitset<128> > defs;
+            std::vector< std::bitset<128> > liveIn;
+            std::vector< std::bitset<128> > liveOut;
+        };
+        void BuildFlowGraph(size_t start, FlowGraph* flow) const;
+        void OptimizeOps(size_t start);
+        void AllocateRegisters(size_t start);
+        void RemoveOps(size_t start, const std::vector<size_t>& opOffsets);
+        void SpecializeScalarStores(size_t start);
         size_t AddOp(OpCode op);
         size_t AddOp(OpCode op, char reg0);
         size_t AddOp(OpCode op, char reg0, char reg1);
         size_t AddOp(OpCode op, char reg0, char reg1, char reg2);
+        size_t AddOp(OpCode op, char reg0, char reg1, unsigned int data);
+        size_t AddOp(OpCode op, char reg0, int data, char reg2);
         size_t AddOp(OpCode op, char reg0, unsigned int data);
         size_t AddOp(OpCode op, char reg0, float data);
         size_t AddOp(OpCode op, char reg0, int data);
         size_t AddOp(OpCode op, unsigned int data);
+        size_t AddOp(OpCode op, unsigned int data, char value, char reg);
         void AddData(unsigned char* data);
         void SetOpOperand(size_t opIdx, int offset, unsigned int p0);
         void SetOpOperand(size_t opIdx, int offset, unsigned char* p0);
         inline void Verify(const AstNode& node, Symbol sym) const;
         OpCode MapBinaryOp(Symbol sym) const;
         OpCode MapUnaryAssignOp(Symbol sym) const;
+        OpCode MapCompareBranchOp(Symbol sym) const;
+
+        // Byte positions of the registers an op reads and writes, relative to its opcode
+        struct OpRegisters
+        {
+            unsigned char reads[3];
+            size_t nReads;
+            unsigned char write; // 0 when the op writes no register
+        };
+        static OpRegisters GetOpRegisters(OpCode op);
+        // GetOpRegisters for the op at the offset without its argument slot operands
+        OpRegisters GetRegisterOperands(size_t opOffset) const;
+        bool IsArgSlotOperand(size_t offset) const;
+        void PatchArgSlots(const AstNode& node);
+        // Byte position of the jump target relative to the opcode, 0 when the op doesn't jump
+        static size_t GetOpTargetPosition(OpCode op);
+        // True when the op reads all of its operands before writing its result, so the result may overwrite one
+        static bool CanWriteOverOperand(OpCode op);
+        static size_t CountNodes(const AstNode& node);
+        // True when an assignment, increment or decrement in the node writes the ident, or any ident when null
+        static bool AssignsIdent(const AstNode& node, const char* ident);
 
         void PushScope();
         void PopScope();
@@ -54,13 +112,40 @@ namespace scrpt
 
         std::vector<unsigned char> _byteBuffer;
         std::vector<FunctionData> _functions;
+        std::vector<const AstNode*> _functionNodes; // Indexed by function id, null for externs
         std::map<std::string, unsigned int> _functionLookup;
         std::vector<std::string> _strings;
         std::map<std::string, unsigned int> _stringLookup;
         std::vector< std::map<std::string, char> > _scopeStack;
+        size_t _scopeFloor; // Lookups don't see scopes below this, which belong to the caller of an inlined body
+        // A function body being compiled inline, its returns store to the result and jump past its end
+        struct InlineFrame
+        {
+            unsigned int funcId;
+            size_t budget; // Left for calls inlined into this body
+            char resultReg;
+            bool tail; // Inlined by a return, so the body's own returns of calls are tail calls too
+            std::vector<size_t> exitJmps;
+        };
+        std::vector<InlineFrame> _inlineFrames;
+        size_t _inlineBudget;
+        // Bytecode span over which each local of the current function is in scope, for its debug name
+        struct LocalRange
+        {
+            char reg;
+            std::string name;
+            size_t start;
+            size_t end;
+        };
+        std::vector<LocalRange> _localRanges;
+        // Byte offsets of operands in the current function naming an argument slot, a depth above the frame's
+        // registers that is resolved to a register once the function's register count is final
+        std::vector<size_t> _argSlotOperands;
+        size_t _stackDepth; // Slots pushed above the frame's registers at the op being generated
         std::bitset<128> _registers;
         std::bitset<128> _lockedRegisters;
         int _paramOffset;
         FunctionData* _fd;
+        BytecodeGenStats _stats;
     };
 }
@@ -97,6 +97,9 @@ namespace scrpt
             ENUM_CASE_TO_STRING(Err::VM_BadParamRequest);
             ENUM_CASE_TO_STRING(Err::VM_NotImplemented);
             ENUM_CASE_TO_STRING(Err::VM_IncorrectArity);
+            ENUM_CASE_TO_STRING(Err::VM_InvalidBytecode);
+            ENUM_CASE_TO_STRING(Err::VM_InvalidImage);
+            ENUM_CASE_TO_STRING(Err::VM_ModifiedSharedObject);
 
         default:
             AssertFail("Missing case for Err");
@@ -36,6 +36,9 @@ namespace scrpt
         VM_BadParamRequest,
         VM_NotImplemented,
         VM_IncorrectArity,
+        VM_InvalidBytecode,
+        VM_InvalidImage,
+        VM_ModifiedSharedObject,
     };
     const char* ErrToString(Err err);
 
@@ -415,6 +415,25 @@ namespace scrpt
         AssertNotNull(_symLineStart);
     }
 
+    Token::Token(
+        const Token& location,
+        Symbol sym,
+        std::unique_ptr<const char[]>&& string,
+        int integer,
+        float fp)
+        : Token(
+            sym,
+            location._sourceData,
+            location._symLocation,
+            location._symLineStart,
+            location._lineNumber,
+            location._linePosition,
+            std::move(string),
+            integer,
+            fp)
+    {
+    }
+
     Symbol Token::GetSym() const { return _sym; }
     const char * Token::SymToString() const { return SymbolToString(_sym); }
     const char* Token::GetString() const { return _string.get(); }
@@ -77,6 +77,13 @@ namespace scrpt
             std::unique_ptr<const char[]>&& string,
             int integer,
             float fp);
+        // Token created by the compiler rather than the lexer, reported at the source location of another token
+        Token(
+            const Token& location,
+            Symbol sym,
+            std::unique_ptr<const char[]>&& string,
+            int integer,
+            float fp);
 
         Symbol GetSym() const;
         const char* SymToString() const;
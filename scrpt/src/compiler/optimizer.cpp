@@ -0,0 +1,333 @@
+#include "../scrpt.h"
+#include "optimizer.h"
+
+#define COMPONENTNAME "AstOptimizer"
+
+namespace scrpt
+{
+    static bool IsNumber(const AstNode& node)
+    {
+        return !node.IsEmpty() && (node.GetSym() == Symbol::Int || node.GetSym() == Symbol::Float);
+    }
+
+    static bool IsBoolean(const AstNode& node)
+    {
+        return !node.IsEmpty() && (node.GetSym() == Symbol::True || node.GetSym() == Symbol::False);
+    }
+
+    static bool IsLiteral(const AstNode& node)
+    {
+        return IsNumber(node) || IsBoolean(node) || (!node.IsEmpty() && node.GetSym() == Symbol::Terminal);
+    }
+
+    static float GetNumber(const AstNode& node)
+    {
+        return node.GetSym() == Symbol::Float ? node.GetToken()->GetFloat() : (float)node.GetToken()->GetInt();
+    }
+
+    static std::unique_ptr<const char[]> CopyString(const std::string& str)
+    {
+        char* string = new char[str.size() + 1];
+        memcpy(string, str.c_str(), str.size() + 1);
+        return std::unique_ptr<const char[]>(string);
+    }
+
+    AstOptimizer::AstOptimizer()
+        : _stats{ 0, 0, 0 }
+    {
+    }
+
+    void AstOptimizer::Optimize(AstNode* ast)
+    {
+        AssertNotNull(ast);
+
+        for (AstNode* node : ast->GetChildren())
+        {
+            this->OptimizeNode(node);
+        }
+    }
+
+    const AstOptimizerStats& AstOptimizer::GetStats() const
+    {
+        return _stats;
+    }
+
+    void AstOptimizer::OptimizeNode(AstNode* node)
+    {
+        AssertNotNull(node);
+
+        if (node->IsEmpty())
+        {
+            return;
+        }
+
+        // Operands first so that nested constant expressions fold bottom up
+        for (AstNode* child : node->GetChildren())
+        {
+            this->OptimizeNode(child);
+        }
+
+        switch (node->GetSym())
+        {
+        case Symbol::If:
+            this->PruneIf(node);
+            break;
+
+        case Symbol::LParen:
+            // Parentheses around a literal are no longer needed
+            if (!node->IsPostfix() && node->GetChildren().size() == 1 && IsLiteral(node->GetFirstChild()))
+            {
+                node->SetToken(node->GetFirstChild().GetToken());
+                node->RemoveChildren();
+            }
+            break;
+
+        case Symbol::Minus:
+            if (node->GetChildren().size() == 1)
+            {
+                this->FoldNegate(node);
+                break;
+            }
+            // !!! Intentionally leaks into the binary op handling below
+
+        case Symbol::Eq:
+        case Symbol::Or:
+        case Symbol::And:
+        case Symbol::Plus:
+        case Symbol::Div:
+        case Symbol::LessThan:
+        case Symbol::LessThanEq:
+        case Symbol::GreaterThan:
+        case Symbol::GreaterThanEq:
+            this->FoldBinaryOp(node);
+            break;
+
+        case Symbol::Mult:
+            if (!this->FoldBinaryOp(node))
+            {
+                this->ReduceMultiply(node);
+            }
+            break;
+
+        case Symbol::Concat:
+            this->FoldConcat(node);
+            break;
+        }
+    }
+
+    bool AstOptimizer::FoldNegate(AstNode* node)
+    {
+        const AstNode& operand = node->GetFirstChild();
+        if (!IsNumber(operand))
+        {
+            return false;
+        }
+
+        if (operand.GetSym() == Symbol::Int)
+        {
+            // Negate as unsigned so INT_MIN wraps the way it does at runtime
+            int value = (int)(0u - (unsigned int)operand.GetToken()->GetInt());
+            this->ReplaceWithLiteral(node, Symbol::Int, nullptr, value, 0.0f);
+        }
+        else
+        {
+            this->ReplaceWithLiteral(node, Symbol::Float, nullptr, 0, -operand.GetToken()->GetFloat());
+        }
+
+        return true;
+    }
+
+    bool AstOptimizer::FoldBinaryOp(AstNode* node)
+    {
+        Assert(node->GetChildren().size() == 2, "Unexpected number of children");
+
+        const AstNode& lhs = node->GetFirstChild();
+        const AstNode& rhs = node->GetSecondChild();
+        Symbol op = node->GetSym();
+        int compare = -1;
+
+        if (IsBoolean(lhs) && IsBoolean(rhs))
+        {
+            bool b1 = lhs.GetSym() == Symbol::True;
+            bool b2 = rhs.GetSym() == Symbol::True;
+            switch (op)
+            {
+            case Symbol::Eq: compare = b1 == b2; break;
+            case Symbol::And: compare = b1 && b2; break;
+            case Symbol::Or: compare = b1 || b2; break;
+            default: return false;
+            }
+        }
+        else if (lhs.GetSym() == Symbol::Int && rhs.GetSym() == Symbol::Int)
+        {
+            // Matches MATHOP and COMPOP for two Int operands. Arithmetic is done unsigned to wrap like the VM.
+            int i1 = lhs.GetToken()->GetInt();
+            int i2 = rhs.GetToken()->GetInt();
+            int result;
+            switch (op)
+            {
+            case Symbol::Plus: result = (int)((unsigned int)i1 + (unsigned int)i2); break;
+            case Symbol::Minus: result = (int)((unsigned int)i1 - (unsigned int)i2); break;
+            case Symbol::Mult: result = (int)((unsigned int)i1 * (unsigned int)i2); break;
+            case Symbol::Div:
+                // Leave the fault for the VM
+                if (i2 == 0 || (i1 == INT_MIN && i2 == -1)) return false;
+                result = i1 / i2;
+                break;
+            case Symbol::Eq: compare = i1 == i2; break;
+            case Symbol::LessThan: compare = i1 < i2; break;
+            case Symbol::LessThanEq: compare = i1 <= i2; break;
+            case Symbol::GreaterThan: compare = i1 > i2; break;
+            case Symbol::GreaterThanEq: compare = i1 >= i2; break;
+            default: return false;
+            }
+
+            if (compare == -1)
+            {
+                this->ReplaceWithLiteral(node, Symbol::Int, nullptr, result, 0.0f);
+                return true;
+            }
+        }
+        else if (IsNumber(lhs) && IsNumber(rhs))
+        {
+            // Mixed or Float operands are promoted to float like MATHOP and COMPOP
+            float fv1 = GetNumber(lhs);
+            float fv2 = GetNumber(rhs);
+            float result;
+            switch (op)
+            {
+            case Symbol::Plus: result = fv1 + fv2; break;
+            case Symbol::Minus: result = fv1 - fv2; break;
+            case Symbol::Mult: result = fv1 * fv2; break;
+            case Symbol::Div: result = fv1 / fv2; break;
+            case Symbol::Eq:
+                // Eq doesn't promote, an Int and a Float is an operand mismatch at runtime
+                if (lhs.GetSym() != rhs.GetSym()) return false;
+                compare = fv1 == fv2;
+                break;
+            case Symbol::LessThan: compare = fv1 < fv2; break;
+            case Symbol::LessThanEq: compare = fv1 <= fv2; break;
+            case Symbol::GreaterThan: compare = fv1 > fv2; break;
+            case Symbol::GreaterThanEq: compare = fv1 >= fv2; break;
+            default: return false;
+            }
+
+            if (compare == -1)
+            {
+                this->ReplaceWithLiteral(node, Symbol::Float, nullptr, 0, result);
+                return true;
+            }
+        }
+        else
+        {
+            return false;
+        }
+
+        this->ReplaceWithLiteral(node, compare ? Symbol::True : Symbol::False, nullptr, 0, 0.0f);
+        return true;
+    }
+
+    bool AstOptimizer::FoldConcat(AstNode* node)
+    {
+        Assert(node->GetChildren().size() == 2, "Unexpected number of children");
+
+        const AstNode& lhs = node->GetFirstChild();
+        const AstNode& rhs = node->GetSecondChild();
+        if (lhs.IsEmpty() || lhs.GetSym() != Symbol::Terminal || !IsLiteral(rhs))
+        {
+            return false;
+        }
+
+        // Formats the right hand side the same way as the VM's Concat
+        std::stringstream ss;
+        ss << lhs.GetToken()->GetString();
+        switch (rhs.GetSym())
+        {
+        case Symbol::Terminal: ss << rhs.GetToken()->GetString(); break;
+        case Symbol::Int: ss << rhs.GetToken()->GetInt(); break;
+        case Symbol::Float: ss << rhs.GetToken()->GetFloat(); break;
+        case Symbol::True: ss << "true"; break;
+        case Symbol::False: ss << "false"; break;
+        default: return false;
+        }
+
+        this->ReplaceWithLiteral(node, Symbol::Terminal, CopyString(ss.str()), 0, 0.0f);
+        return true;
+    }
+
+    bool AstOptimizer::ReduceMultiply(AstNode* node)
+    {
+        Assert(node->GetChildren().size() == 2, "Unexpected number of children");
+
+        // x * 2 becomes x + x. Only identifiers are duplicated since they are a register read without side
+        // effects, a Float literal 2 is left alone as it would change the result type of an Int.
+        AstNode* ident = nullptr;
+        AstNode* two = nullptr;
+        for (AstNode* child : node->GetChildren())
+        {
+            if (child->IsEmpty()) return false;
+            if (child->GetSym() == Symbol::Ident) ident = child;
+            else if (child->GetSym() == Symbol::Int && child->GetToken()->GetInt() == 2) two = child;
+        }
+
+        if (ident == nullptr || two == nullptr)
+        {
+            return false;
+        }
+
+        node->RemoveChild(two);
+        node->AddChild(ident->GetToken());
+        node->SetToken(std::make_shared<Token>(*node->GetToken(), Symbol::Plus, nullptr, 0, 0.0f));
+        ++_stats.reducedOps;
+        return true;
+    }
+
+    void AstOptimizer::PruneIf(AstNode* node)
+    {
+        // Children are check and block pairs followed by an optional else block
+        std::vector<AstNode*> children(node->GetChildren().begin(), node->GetChildren().end());
+        size_t nCheckBlocks = children.size() / 2;
+
+        for (size_t count = 0; count < nCheckBlocks; ++count)
+        {
+            AstNode* checkExpr = children[count * 2];
+            AstNode* blockStatement = children[count * 2 + 1];
+            if (checkExpr->GetSym() == Symbol::False)
+            {
+                node->RemoveChild(checkExpr);
+                node->RemoveChild(blockStatement);
+                ++_stats.prunedBranches;
+            }
+            else if (checkExpr->GetSym() == Symbol::True)
+            {
+                // Every later branch is unreachable and this block becomes the else
+                for (size_t later = count * 2 + 2; later < children.size(); later += 2)
+                {
+                    node->RemoveChild(children[later]);
+                    if (later + 1 < children.size()) node->RemoveChild(children[later + 1]);
+                    ++_stats.prunedBranches;
+                }
+                node->RemoveChild(checkExpr);
+                break;
+            }
+        }
+
+        // With no checks left the If is just its else block, kept as a block statement to preserve its scope
+        if (node->GetChildren().size() < 2)
+        {
+            AstNode* elseBlock = node->GetChildren().empty() ? nullptr : node->ReleaseChild(node->GetChildren().front());
+            node->SetToken(std::make_shared<Token>(*node->GetToken(), Symbol::LBracket, nullptr, 0, 0.0f));
+            if (elseBlock != nullptr)
+            {
+                node->AddChild(elseBlock);
+            }
+        }
+    }
+
+    void AstOptimizer::ReplaceWithLiteral(AstNode* node, Symbol sym, std::unique_ptr<const char[]>&& string, int integer, float fp)
+    {
+        node->SetToken(std::make_shared<Token>(*node->GetToken(), sym, std::move(string), integer, fp));
+        node->RemoveChildren();
+        ++_stats.foldedNodes;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+namespace scrpt
+{
+    struct AstOptimizerStats
+    {
+        unsigned int foldedNodes;
+        unsigned int reducedOps;
+        unsigned int prunedBranches;
+    };
+
+    // Rewrites the parser's AST before bytecode generation. Operators whose operands are all literals are
+    // replaced by the literal result, multiplications of an identifier by two become additions and branches
+    // of an If with a literal condition that can never run are removed. Anything whose outcome depends on
+    // runtime state, or that would raise an error when executed, is left for the VM.
+    class AstOptimizer
+    {
+    public:
+        AstOptimizer();
+
+        void Optimize(AstNode* ast);
+        const AstOptimizerStats& GetStats() const;
+
+    private:
+        void OptimizeNode(AstNode* node);
+        bool FoldNegate(AstNode* node);
+        bool FoldBinaryOp(AstNode* node);
+        bool FoldConcat(AstNode* node);
+        bool ReduceMultiply(AstNode* node);
+        void PruneIf(AstNode* node);
+        void ReplaceWithLiteral(AstNode* node, Symbol sym, std::unique_ptr<const char[]>&& string, int integer, float fp);
+
+        AstOptimizerStats _stats;
+    };
+}
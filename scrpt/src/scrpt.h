@@ -1,9 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <sstream>
 #include <filesystem>
 #include <list>
+#include <deque>
 #include <stdexcept>
 #include <vector>
 #include <map>
@@ -11,6 +15,15 @@
 #include <functional>
 #include <iomanip>
 #include <bitset>
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 namespace fs = std::experimental::filesystem;
 
 namespace scrpt { class VM; class Token; }
@@ -18,10 +31,17 @@ namespace scrpt { class VM; class Token; }
 #include "vm/stack.h"
 #include "util/trace.h"
 #include "util/fileio.h"
+#include "util/memory.h"
+#include "util/slab.h"
+#include "util/arena.h"
+#include "util/workerpool.h"
 #include "compiler/lexer.h"
 #include "compiler/ast.h"
 #include "compiler/parser.h"
+#include "compiler/optimizer.h"
 #include "vm/bytecode.h"
+#include "vm/program.h"
+#include "vm/jit.h"
 #include "compiler/bytecodegen.h"
 #include "vm/vm.h"
 #include "vm/stdlib.h"
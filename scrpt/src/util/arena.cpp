@@ -0,0 +1,64 @@
+#include "../scrpt.h"
+
+#define COMPONENTNAME "Arena"
+
+// Blocks in each chunk, a power of two so finding a block by index is a shift and a mask
+#define BLOCKSPERCHUNK 1024
+
+scrpt::Arena::Arena(size_t blockSize)
+    : _blockSize((blockSize + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t))
+    , _count(0)
+    , _next(nullptr)
+    , _end(nullptr)
+{
+}
+
+scrpt::Arena::~Arena()
+{
+    for (unsigned char* chunk : _chunks)
+    {
+        ::operator delete(chunk);
+    }
+}
+
+void* scrpt::Arena::Allocate()
+{
+    if (_next == _end)
+    {
+        size_t index = _count / BLOCKSPERCHUNK;
+        if (index == _chunks.size())
+        {
+            _chunks.push_back(static_cast<unsigned char*>(::operator new(_blockSize * BLOCKSPERCHUNK)));
+        }
+        _next = _chunks[index];
+        _end = _next + _blockSize * BLOCKSPERCHUNK;
+    }
+
+    void* block = _next;
+    _next += _blockSize;
+    ++_count;
+    return block;
+}
+
+void* scrpt::Arena::Get(size_t index) const
+{
+    Assert(index < _count, "Arena block index out of range");
+    return _chunks[index / BLOCKSPERCHUNK] + (index % BLOCKSPERCHUNK) * _blockSize;
+}
+
+void scrpt::Arena::Reset()
+{
+    while (_chunks.size() > 1)
+    {
+        ::operator delete(_chunks.back());
+        _chunks.pop_back();
+    }
+
+#ifdef _DEBUG
+    // Anything still pointing into the arena reads garbage rather than the objects it used to hold
+    if (!_chunks.empty()) memset(_chunks[0], 0xdd, _blockSize * BLOCKSPERCHUNK);
+#endif
+
+    _count = 0;
+    _next = _end = nullptr;
+}
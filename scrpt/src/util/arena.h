@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+namespace scrpt
+{
+    // Fixed size blocks bump allocated from chunks and released all at once. Blocks are numbered in the order they
+    // were handed out, so the owner can visit each one to tear it down before a reset.
+    class Arena
+    {
+    public:
+        explicit Arena(size_t blockSize);
+        ~Arena();
+
+        void* Allocate();
+        size_t GetCount() const { return _count; }
+        void* Get(size_t index) const;
+
+        // Forgets every block. The first chunk is kept for the next use and the rest go back to the heap.
+        void Reset();
+
+    private:
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        size_t _blockSize;
+        size_t _count;
+        std::vector<unsigned char*> _chunks;
+        unsigned char* _next;
+        unsigned char* _end;
+    };
+}
+
+#endif
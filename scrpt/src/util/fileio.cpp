@@ -1,5 +1,14 @@
 #include "..\scrpt.h"
 
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define COMPONENTNAME "FileIO"
 
 std::unique_ptr<char[]> scrpt::ReadFile(const fs::path& path)
@@ -52,3 +61,65 @@ void scrpt::WriteFile(const fs::path& path, const char* content, size_t nBytes)
         AssertFail("Failed to write total contents to file: " << path);
     }
 }
+
+scrpt::MappedFile::MappedFile(const fs::path& path)
+    : _data(nullptr)
+    , _size(0)
+#ifdef _WIN32
+    , _file(INVALID_HANDLE_VALUE)
+    , _mapping(nullptr)
+#endif
+{
+#ifdef _WIN32
+    _file = CreateFileA(path.string().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+    {
+        return;
+    }
+
+    _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (_mapping == nullptr)
+    {
+        return;
+    }
+
+    _data = (const unsigned char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+    _size = _data != nullptr ? (size_t)size.QuadPart : 0;
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    // The mapping keeps its own reference to the file
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            _data = (const unsigned char*)data;
+            _size = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+#endif
+}
+
+scrpt::MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    if (_data != nullptr) UnmapViewOfFile(_data);
+    if (_mapping != nullptr) CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+#else
+    if (_data != nullptr) munmap((void*)_data, _size);
+#endif
+}
@@ -6,6 +6,29 @@ namespace scrpt
     std::unique_ptr<char[]> ReadFile(const fs::path& path);
 
     void WriteFile(const fs::path& path, const char* content, size_t nBytes);
+
+    // Read only view of a whole file. The file is mapped rather than read so pages are only loaded as they are
+    // touched. GetData is null if the file could not be opened or is empty.
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const fs::path& path);
+        ~MappedFile();
+
+        const unsigned char* GetData() const { return _data; }
+        size_t GetSize() const { return _size; }
+
+    private:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const unsigned char* _data;
+        size_t _size;
+#ifdef _WIN32
+        void* _file;
+        void* _mapping;
+#endif
+    };
 }
 
 #endif
@@ -0,0 +1,39 @@
+#include "../scrpt.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define COMPONENTNAME "Memory"
+
+void* scrpt::ReserveMemory(size_t bytes)
+{
+#ifdef _WIN32
+    return VirtualAlloc(nullptr, bytes, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void* memory = mmap(nullptr, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return memory == MAP_FAILED ? nullptr : memory;
+#endif
+}
+
+bool scrpt::CommitMemory(void* memory, size_t bytes)
+{
+    AssertNotNull(memory);
+
+#ifdef _WIN32
+    return VirtualAlloc(memory, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(memory, bytes, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+void scrpt::ReleaseMemory(void* memory, size_t bytes)
+{
+#ifdef _WIN32
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, bytes);
+#endif
+}
@@ -0,0 +1,16 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+namespace scrpt
+{
+    // Address space set aside without backing it, so a buffer can grow in place up to the reserved size. Pages are
+    // committed as they are needed and read as zero once committed. Returns null if the space can't be reserved.
+    void* ReserveMemory(size_t bytes);
+
+    // Commits the pages covering the first bytes of a reservation, which may already be partly committed
+    bool CommitMemory(void* memory, size_t bytes);
+
+    void ReleaseMemory(void* memory, size_t bytes);
+}
+
+#endif
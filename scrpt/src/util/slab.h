@@ -0,0 +1,190 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+namespace scrpt
+{
+    struct SlabStats
+    {
+        long long live; // Blocks allocated and not yet freed, across every thread
+        long long peak; // Most blocks any one thread has had live at once
+        size_t slabs;   // Slabs taken from the heap, which are never given back
+    };
+
+    // Hands out fixed size blocks carved from large slabs. Each thread allocates from and frees to a free list of its
+    // own, so neither takes a lock or calls the heap until that list runs dry or grows past a limit, when a batch is
+    // moved from or to a list shared by every thread. A block can be freed on another thread than the one that
+    // allocated it, which is how objects returned by VMs on worker threads end up. When a thread exits its free
+    // blocks go back to the shared list.
+    template<size_t BlockSize>
+    class Slab
+    {
+    public:
+        static void* Allocate()
+        {
+            Cache& cache = t_cache;
+            if (cache.free == nullptr) Refill(cache);
+
+            Block* block = cache.free;
+            cache.free = block->next;
+            --cache.nFree;
+
+            long long live = cache.live.load(std::memory_order_relaxed) + 1;
+            cache.live.store(live, std::memory_order_relaxed);
+            if (live > cache.peak.load(std::memory_order_relaxed)) cache.peak.store(live, std::memory_order_relaxed);
+            return block;
+        }
+
+        static void Free(void* memory)
+        {
+            Cache& cache = t_cache;
+            Block* block = static_cast<Block*>(memory);
+            block->next = cache.free;
+            cache.free = block;
+            cache.live.store(cache.live.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+
+            // A thread that has never allocated starts with a limit of 0, so its first free registers it too
+            if (++cache.nFree > cache.limit) Spill(cache);
+        }
+
+        static SlabStats GetStats()
+        {
+            Shared& shared = GetShared();
+            std::lock_guard<std::mutex> guard(shared.lock);
+
+            SlabStats stats = { shared.retiredLive, shared.retiredPeak, shared.slabs };
+            for (Cache* cache : shared.caches)
+            {
+                stats.live += cache->live.load(std::memory_order_relaxed);
+                stats.peak = std::max(stats.peak, cache->peak.load(std::memory_order_relaxed));
+            }
+            return stats;
+        }
+
+    private:
+        static const size_t Alignment = alignof(std::max_align_t);
+        static const size_t SlabBytes = 64 * 1024;
+        static const size_t BlocksPerSlab = SlabBytes / ((BlockSize + Alignment - 1) / Alignment * Alignment);
+        // Blocks a thread keeps before handing a batch back, and moves to or from the shared list at once
+        static const size_t CacheLimit = 2 * BlocksPerSlab;
+        static const size_t BatchSize = BlocksPerSlab / 2;
+
+        union Block
+        {
+            Block* next;
+            typename std::aligned_storage<BlockSize, Alignment>::type storage;
+        };
+
+        // Plain data so it needs no guard on each access. The counts are atomic only so GetStats can read them from
+        // another thread, the owner updates them with plain loads and stores.
+        struct Cache
+        {
+            Block* free;
+            size_t nFree;
+            size_t limit;
+            std::atomic<long long> live;
+            std::atomic<long long> peak;
+        };
+
+        struct Shared
+        {
+            std::mutex lock;
+            Block* free;
+            size_t slabs;
+            std::vector<Cache*> caches;
+            long long retiredLive;
+            long long retiredPeak;
+        };
+
+        // Returns a thread's blocks and counts to the shared list when it exits
+        struct Retire
+        {
+            ~Retire()
+            {
+                Cache& cache = t_cache;
+                Shared& shared = GetShared();
+                std::lock_guard<std::mutex> guard(shared.lock);
+                Give(shared, cache, cache.nFree);
+                shared.caches.erase(std::find(shared.caches.begin(), shared.caches.end(), &cache));
+                shared.retiredLive += cache.live.load(std::memory_order_relaxed);
+                shared.retiredPeak = std::max(shared.retiredPeak, cache.peak.load(std::memory_order_relaxed));
+                cache.live.store(0, std::memory_order_relaxed);
+            }
+        };
+
+        // Never destroyed, as blocks may still be freed while statics are torn down
+        static Shared& GetShared()
+        {
+            static Shared* shared = new Shared();
+            return *shared;
+        }
+
+        static void Register(Shared& shared, Cache& cache)
+        {
+            if (cache.limit != 0) return;
+
+            static thread_local Retire retire;
+            (void)retire;
+            shared.caches.push_back(&cache);
+            cache.limit = CacheLimit;
+        }
+
+        static void Refill(Cache& cache)
+        {
+            Shared& shared = GetShared();
+            std::lock_guard<std::mutex> guard(shared.lock);
+            Register(shared, cache);
+
+            if (shared.free != nullptr)
+            {
+                while (shared.free != nullptr && cache.nFree < BatchSize)
+                {
+                    Block* block = shared.free;
+                    shared.free = block->next;
+                    block->next = cache.free;
+                    cache.free = block;
+                    ++cache.nFree;
+                }
+                return;
+            }
+
+            Block* slab = static_cast<Block*>(::operator new(BlocksPerSlab * sizeof(Block)));
+            for (size_t idx = BlocksPerSlab; idx-- > 0;)
+            {
+                slab[idx].next = cache.free;
+                cache.free = &slab[idx];
+            }
+            cache.nFree += BlocksPerSlab;
+            ++shared.slabs;
+        }
+
+        static void Spill(Cache& cache)
+        {
+            Shared& shared = GetShared();
+            std::lock_guard<std::mutex> guard(shared.lock);
+            Register(shared, cache);
+            if (cache.nFree > cache.limit)
+            {
+                Give(shared, cache, BatchSize);
+            }
+        }
+
+        static void Give(Shared& shared, Cache& cache, size_t count)
+        {
+            for (; count > 0 && cache.free != nullptr; --count)
+            {
+                Block* block = cache.free;
+                cache.free = block->next;
+                block->next = shared.free;
+                shared.free = block;
+                --cache.nFree;
+            }
+        }
+
+        static thread_local Cache t_cache;
+    };
+
+    template<size_t BlockSize>
+    thread_local typename Slab<BlockSize>::Cache Slab<BlockSize>::t_cache;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include "../scrpt.h"
+
+#define COMPONENTNAME "WorkerPool"
+
+// Chunks a job is split into for each thread that can run it, so threads that finish early have some left to steal
+#define CHUNKSPERTHREAD 4
+
+// The pool and worker index of the current thread, if it is a worker
+static thread_local const scrpt::WorkerPool* t_pool = nullptr;
+static thread_local unsigned int t_workerIndex = 0;
+
+scrpt::WorkerPool& scrpt::WorkerPool::Get()
+{
+    static WorkerPool pool(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+    return pool;
+}
+
+scrpt::WorkerPool::WorkerPool(unsigned int nWorkers)
+    : _queued(0)
+    , _shutdown(false)
+{
+    Assert(nWorkers > 0, "Pool needs at least one worker");
+
+    for (unsigned int index = 0; index < nWorkers; ++index)
+    {
+        _workers.emplace_back(new Worker());
+    }
+
+    // Started once every worker exists, as they steal from each other
+    for (unsigned int index = 0; index < nWorkers; ++index)
+    {
+        _workers[index]->thread = std::thread(&WorkerPool::WorkerMain, this, index);
+    }
+}
+
+scrpt::WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+        _shutdown = true;
+    }
+    _wake.notify_all();
+
+    for (std::unique_ptr<Worker>& worker : _workers)
+    {
+        worker->thread.join();
+    }
+}
+
+unsigned int scrpt::WorkerPool::GetParticipantCount() const
+{
+    return (unsigned int)_workers.size() + 1;
+}
+
+void scrpt::WorkerPool::Run(size_t count, const ChunkFunc& func)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    const unsigned int nWorkers = (unsigned int)_workers.size();
+    const unsigned int self = t_pool == this ? t_workerIndex : nWorkers;
+    const size_t nChunks = std::min(count, (size_t)this->GetParticipantCount() * CHUNKSPERTHREAD);
+
+    Job job;
+    job.func = &func;
+    job.remaining = nChunks;
+    job.failed = false;
+
+    // Counted before they are queued so a worker taking one never sees the count go below zero
+    {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+        _queued += nChunks;
+    }
+
+    // A worker keeps its job's chunks for the others to steal, an outside thread deals them out
+    for (size_t idx = 0; idx < nChunks; ++idx)
+    {
+        Worker& worker = *_workers[self < nWorkers ? self : idx % nWorkers];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        worker.chunks.push_back(Chunk{ &job, count * idx / nChunks, count * (idx + 1) / nChunks });
+    }
+    _wake.notify_all();
+
+    // Help with the job until none of its chunks are left to start, then wait on the ones still running
+    Chunk chunk;
+    while (this->TakeChunk(self, &job, &chunk))
+    {
+        this->RunChunk(chunk, self);
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(job.lock);
+        job.done.wait(guard, [&]() { return job.remaining == 0; });
+    }
+
+    if (job.error)
+    {
+        std::rethrow_exception(job.error);
+    }
+}
+
+void scrpt::WorkerPool::WorkerMain(unsigned int index)
+{
+    t_pool = this;
+    t_workerIndex = index;
+
+    Chunk chunk;
+    while (true)
+    {
+        if (this->TakeChunk(index, nullptr, &chunk))
+        {
+            this->RunChunk(chunk, index);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(_sleepLock);
+        _wake.wait(guard, [&]() { return _queued > 0 || _shutdown; });
+        if (_shutdown && _queued == 0)
+        {
+            return;
+        }
+    }
+}
+
+// Takes a thread's next chunk, newest first from its own deque and otherwise oldest first from the others'. Only
+// chunks of the given job are taken, or any chunk without one.
+bool scrpt::WorkerPool::TakeChunk(unsigned int index, const Job* job, Chunk* chunk)
+{
+    auto matches = [&](const Chunk& candidate) { return job == nullptr || candidate.job == job; };
+
+    const unsigned int nWorkers = (unsigned int)_workers.size();
+    for (unsigned int offset = 0; offset < nWorkers; ++offset)
+    {
+        unsigned int victim = (index + offset) % nWorkers;
+        Worker& worker = *_workers[victim];
+        std::lock_guard<std::mutex> guard(worker.lock);
+
+        if (victim == index)
+        {
+            auto found = std::find_if(worker.chunks.rbegin(), worker.chunks.rend(), matches);
+            if (found == worker.chunks.rend()) continue;
+            *chunk = *found;
+            worker.chunks.erase(std::next(found).base());
+        }
+        else
+        {
+            auto found = std::find_if(worker.chunks.begin(), worker.chunks.end(), matches);
+            if (found == worker.chunks.end()) continue;
+            *chunk = *found;
+            worker.chunks.erase(found);
+        }
+
+        --_queued;
+        return true;
+    }
+
+    return false;
+}
+
+void scrpt::WorkerPool::RunChunk(const Chunk& chunk, unsigned int participant)
+{
+    Job& job = *chunk.job;
+    if (!job.failed)
+    {
+        try
+        {
+            (*job.func)(chunk.begin, chunk.end, participant);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> guard(job.lock);
+            if (!job.error) job.error = std::current_exception();
+            job.failed = true;
+        }
+    }
+
+    // Under the lock so the submitter can't see the job finish and destroy it before the notify
+    std::lock_guard<std::mutex> guard(job.lock);
+    if (--job.remaining == 0)
+    {
+        job.done.notify_all();
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+namespace scrpt
+{
+    // Runs the chunks of parallel jobs on a fixed set of worker threads. Each worker has its own deque of chunks,
+    // taking from the back of its own and stealing from the front of the others' once it runs dry. The thread that
+    // submits a job works on that job's chunks until it is done, so a job submitted from inside a chunk completes
+    // even when every worker is busy.
+    class WorkerPool
+    {
+    public:
+        // Runs the indices [begin, end). Participant identifies the thread running the chunk within the job, from 0
+        // to GetParticipantCount() - 1, and is never used by two threads at once.
+        typedef std::function<void(size_t begin, size_t end, unsigned int participant)> ChunkFunc;
+
+        // Pool shared by the whole process, with a worker for each hardware thread after the first
+        static WorkerPool& Get();
+
+        explicit WorkerPool(unsigned int nWorkers);
+        ~WorkerPool();
+
+        // Threads that can run a job's chunks, the workers and the thread that submitted it
+        unsigned int GetParticipantCount() const;
+
+        // Splits [0, count) into chunks and returns once they have all run. If a chunk throws, the chunks that
+        // haven't started are skipped and the first exception is rethrown here.
+        void Run(size_t count, const ChunkFunc& func);
+
+    private:
+        struct Job
+        {
+            const ChunkFunc* func;
+            std::atomic<size_t> remaining;
+            std::atomic<bool> failed;
+            std::exception_ptr error;
+            std::mutex lock;
+            std::condition_variable done;
+        };
+
+        struct Chunk
+        {
+            Job* job;
+            size_t begin;
+            size_t end;
+        };
+
+        struct Worker
+        {
+            std::mutex lock;
+            std::deque<Chunk> chunks;
+            std::thread thread;
+        };
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        void WorkerMain(unsigned int index);
+        bool TakeChunk(unsigned int index, const Job* job, Chunk* chunk);
+        void RunChunk(const Chunk& chunk, unsigned int participant);
+
+        std::vector<std::unique_ptr<Worker>> _workers;
+        std::atomic<size_t> _queued;
+        bool _shutdown;
+        std::mutex _sleepLock;
+        std::condition_variable _wake;
+    };
+}
+
+#endif
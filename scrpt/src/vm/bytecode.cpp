@@ -35,8 +35,9 @@ const char* scrpt::OpCodeToString(OpCode code)
 		ENUM_CASE_TO_STRING(OpCode::LTE); 
 		ENUM_CASE_TO_STRING(OpCode::GTE); 
         ENUM_CASE_TO_STRING(OpCode::Call);
+        ENUM_CASE_TO_STRING(OpCode::CallDirect);
 		ENUM_CASE_TO_STRING(OpCode::Ret); 
-		ENUM_CASE_TO_STRING(OpCode::RestoreRet); 
+        ENUM_CASE_TO_STRING(OpCode::TailCall);
 		ENUM_CASE_TO_STRING(OpCode::BrT); 
 		ENUM_CASE_TO_STRING(OpCode::BrF); 
 		ENUM_CASE_TO_STRING(OpCode::Jmp); 
@@ -44,7 +45,40 @@ const char* scrpt::OpCodeToString(OpCode code)
         ENUM_CASE_TO_STRING(OpCode::MakeList);
         ENUM_CASE_TO_STRING(OpCode::MakeMap);
         ENUM_CASE_TO_STRING(OpCode::Push);
-        ENUM_CASE_TO_STRING(OpCode::PopN);
+        ENUM_CASE_TO_STRING(OpCode::PushN);
+        ENUM_CASE_TO_STRING(OpCode::BrLT);
+        ENUM_CASE_TO_STRING(OpCode::BrLTE);
+        ENUM_CASE_TO_STRING(OpCode::BrGT);
+        ENUM_CASE_TO_STRING(OpCode::BrGTE);
+        ENUM_CASE_TO_STRING(OpCode::AddImm);
+        ENUM_CASE_TO_STRING(OpCode::MulImm);
+        ENUM_CASE_TO_STRING(OpCode::LoadIntS);
+        ENUM_CASE_TO_STRING(OpCode::StoreS);
+        ENUM_CASE_TO_STRING(OpCode::AddS);
+        ENUM_CASE_TO_STRING(OpCode::SubS);
+        ENUM_CASE_TO_STRING(OpCode::MulS);
+        ENUM_CASE_TO_STRING(OpCode::AddImmS);
+        ENUM_CASE_TO_STRING(OpCode::MulImmS);
+        ENUM_CASE_TO_STRING(OpCode::AddII);
+        ENUM_CASE_TO_STRING(OpCode::SubII);
+        ENUM_CASE_TO_STRING(OpCode::MulII);
+        ENUM_CASE_TO_STRING(OpCode::LTII);
+        ENUM_CASE_TO_STRING(OpCode::GTII);
+        ENUM_CASE_TO_STRING(OpCode::LTEII);
+        ENUM_CASE_TO_STRING(OpCode::GTEII);
+        ENUM_CASE_TO_STRING(OpCode::IncI);
+        ENUM_CASE_TO_STRING(OpCode::DecI);
+        ENUM_CASE_TO_STRING(OpCode::BrLTII);
+        ENUM_CASE_TO_STRING(OpCode::BrLTEII);
+        ENUM_CASE_TO_STRING(OpCode::BrGTII);
+        ENUM_CASE_TO_STRING(OpCode::BrGTEII);
+        ENUM_CASE_TO_STRING(OpCode::AddImmI);
+        ENUM_CASE_TO_STRING(OpCode::MulImmI);
+        ENUM_CASE_TO_STRING(OpCode::AddIIS);
+        ENUM_CASE_TO_STRING(OpCode::SubIIS);
+        ENUM_CASE_TO_STRING(OpCode::MulIIS);
+        ENUM_CASE_TO_STRING(OpCode::AddImmIS);
+        ENUM_CASE_TO_STRING(OpCode::MulImmIS);
 
     default:
         AssertFail("Missing case for OpCode");
@@ -53,6 +87,115 @@ const char* scrpt::OpCodeToString(OpCode code)
     return nullptr;
 }
 
+scrpt::OpLayout scrpt::GetOpLayout(OpCode code)
+{
+    switch (code)
+    {
+    case OpCode::Unknown: return OpLayout::None;
+    case OpCode::LoadNull: return OpLayout::Reg;
+    case OpCode::LoadTrue: return OpLayout::Reg;
+    case OpCode::LoadFalse: return OpLayout::Reg;
+    case OpCode::LoadInt: return OpLayout::RegInt;
+    case OpCode::LoadFloat: return OpLayout::RegFloat;
+    case OpCode::LoadString: return OpLayout::RegUInt;
+    case OpCode::LoadFunc: return OpLayout::RegUInt;
+    case OpCode::Store: return OpLayout::RegReg;
+    case OpCode::StoreIdx: return OpLayout::RegRegReg;
+    case OpCode::Eq: return OpLayout::RegRegReg;
+    case OpCode::Or: return OpLayout::RegRegReg;
+    case OpCode::And: return OpLayout::RegRegReg;
+    case OpCode::Add: return OpLayout::RegRegReg;
+    case OpCode::Sub: return OpLayout::RegRegReg;
+    case OpCode::Mul: return OpLayout::RegRegReg;
+    case OpCode::Div: return OpLayout::RegRegReg;
+    case OpCode::Mod: return OpLayout::RegRegReg;
+    case OpCode::Concat: return OpLayout::RegRegReg;
+    case OpCode::Inc: return OpLayout::Reg;
+    case OpCode::Dec: return OpLayout::Reg;
+    case OpCode::PostInc: return OpLayout::Reg;
+    case OpCode::PostDec: return OpLayout::Reg;
+    case OpCode::Neg: return OpLayout::RegReg;
+    case OpCode::LT: return OpLayout::RegRegReg;
+    case OpCode::GT: return OpLayout::RegRegReg;
+    case OpCode::LTE: return OpLayout::RegRegReg;
+    case OpCode::GTE: return OpLayout::RegRegReg;
+    case OpCode::Call: return OpLayout::RegCharReg;
+    case OpCode::CallDirect: return OpLayout::UIntCharReg;
+    case OpCode::Ret: return OpLayout::Reg;
+    case OpCode::TailCall: return OpLayout::UIntCharChar;
+    case OpCode::BrT: return OpLayout::RegTarget;
+    case OpCode::BrF: return OpLayout::RegTarget;
+    case OpCode::Jmp: return OpLayout::Target;
+    case OpCode::Index: return OpLayout::RegRegReg;
+    case OpCode::MakeList: return OpLayout::RegUInt;
+    case OpCode::MakeMap: return OpLayout::RegUInt;
+    case OpCode::Push: return OpLayout::Reg;
+    case OpCode::PushN: return OpLayout::Char;
+    case OpCode::BrLT: return OpLayout::RegRegTarget;
+    case OpCode::BrLTE: return OpLayout::RegRegTarget;
+    case OpCode::BrGT: return OpLayout::RegRegTarget;
+    case OpCode::BrGTE: return OpLayout::RegRegTarget;
+    case OpCode::AddImm: return OpLayout::RegIntReg;
+    case OpCode::MulImm: return OpLayout::RegIntReg;
+    case OpCode::LoadIntS: return OpLayout::RegInt;
+    case OpCode::StoreS: return OpLayout::RegReg;
+    case OpCode::AddS: return OpLayout::RegRegReg;
+    case OpCode::SubS: return OpLayout::RegRegReg;
+    case OpCode::MulS: return OpLayout::RegRegReg;
+    case OpCode::AddImmS: return OpLayout::RegIntReg;
+    case OpCode::MulImmS: return OpLayout::RegIntReg;
+    case OpCode::AddII: return OpLayout::RegRegReg;
+    case OpCode::SubII: return OpLayout::RegRegReg;
+    case OpCode::MulII: return OpLayout::RegRegReg;
+    case OpCode::LTII: return OpLayout::RegRegReg;
+    case OpCode::GTII: return OpLayout::RegRegReg;
+    case OpCode::LTEII: return OpLayout::RegRegReg;
+    case OpCode::GTEII: return OpLayout::RegRegReg;
+    case OpCode::IncI: return OpLayout::Reg;
+    case OpCode::DecI: return OpLayout::Reg;
+    case OpCode::BrLTII: return OpLayout::RegRegTarget;
+    case OpCode::BrLTEII: return OpLayout::RegRegTarget;
+    case OpCode::BrGTII: return OpLayout::RegRegTarget;
+    case OpCode::BrGTEII: return OpLayout::RegRegTarget;
+    case OpCode::AddImmI: return OpLayout::RegIntReg;
+    case OpCode::MulImmI: return OpLayout::RegIntReg;
+    case OpCode::AddIIS: return OpLayout::RegRegReg;
+    case OpCode::SubIIS: return OpLayout::RegRegReg;
+    case OpCode::MulIIS: return OpLayout::RegRegReg;
+    case OpCode::AddImmIS: return OpLayout::RegIntReg;
+    case OpCode::MulImmIS: return OpLayout::RegIntReg;
+
+    default:
+        AssertFail("Missing layout for OpCode");
+    }
+
+    return OpLayout::None;
+}
+
+size_t scrpt::GetOpSize(OpCode code)
+{
+    switch (GetOpLayout(code))
+    {
+    case OpLayout::None: return 1;
+    case OpLayout::Reg: return 2;
+    case OpLayout::RegReg: return 3;
+    case OpLayout::RegRegReg: return 4;
+    case OpLayout::RegCharReg: return 4;
+    case OpLayout::RegInt: return 6;
+    case OpLayout::RegFloat: return 6;
+    case OpLayout::RegUInt: return 6;
+    case OpLayout::RegTarget: return 6;
+    case OpLayout::RegRegTarget: return 7;
+    case OpLayout::RegIntReg: return 7;
+    case OpLayout::Char: return 2;
+    case OpLayout::UIntCharReg: return 7;
+    case OpLayout::UIntCharChar: return 7;
+    case OpLayout::Target: return 5;
+    }
+
+    return 1;
+}
+
 std::string DisplayRegisterName(const scrpt::FunctionData& fd, char reg)
 {
     std::stringstream ss;
@@ -86,7 +229,7 @@ void scrpt::Decompile(const Bytecode& bytecode)
         if (func.external)
             std::cout << " external" << std::endl;
         else
-            std::cout << " entry: " << func.entry << std::endl;
+            std::cout << " entry: " << func.entry << " registers: " << func.nLocalRegisters << std::endl;
         functionEntryMap[func.entry] = idx;
     }
 
@@ -122,62 +265,221 @@ void scrpt::Decompile(const Bytecode& bytecode)
 
             const FunctionData& fd = bytecode.functions[currentFunction];
 
-#define DISPLAY_ONE_REG std::cout << " " << DisplayRegisterName(fd, reg0); idx += 1;
-#define DISPLAY_TWO_REG std::cout << " " << DisplayRegisterName(fd, reg0) << " " << DisplayRegisterName(fd, reg1); idx += 2;
-#define DISPLAY_THREE_REG std::cout << " " << DisplayRegisterName(fd, reg0) << " " << DisplayRegisterName(fd, reg1) << " " << DisplayRegisterName(fd, reg2); idx += 3;
-#define DISPLAY_ONE_REG_UINT std::cout << " " << DisplayRegisterName(fd, reg0) << " " << *(unsigned int *)(data + idx + 2); idx += 5;
-#define DISPLAY_ONE_REG_INT std::cout << " " << DisplayRegisterName(fd, reg0) << " " << *(int *)(data + idx + 2); idx += 5;
-#define DISPLAY_ONE_REG_FLOAT std::cout << " " << DisplayRegisterName(fd, reg0) << " " << *(float *)(data + idx + 2); idx += 5;
-#define DISPLAY_ONE_REG_CHAR std::cout << " " << DisplayRegisterName(fd, reg0) << " " << (int)*(char *)(data + idx + 2); idx += 2;
-#define DISPLAY_UINT std::cout << " " << *(unsigned int *)(data + idx + 1); idx += 4;
-#define DISPLAY_CHAR std::cout << " " << (int)reg0; idx += 1; 
-
-            switch (op)
+            switch (GetOpLayout(op))
             {
-            case OpCode::LoadNull: DISPLAY_ONE_REG; break;
-            case OpCode::LoadTrue: DISPLAY_ONE_REG; break;
-            case OpCode::LoadFalse: DISPLAY_ONE_REG; break;
-            case OpCode::LoadInt: DISPLAY_ONE_REG_INT; break;
-            case OpCode::LoadFloat: DISPLAY_ONE_REG_FLOAT; break;
-            case OpCode::LoadString: DISPLAY_ONE_REG_UINT; break;
-            case OpCode::LoadFunc: 
-                DISPLAY_ONE_REG_UINT;
-                std::cout << " ; " << bytecode.functions[*(unsigned int *)(data + idx - 3)].name;
+            case OpLayout::None:
+                break;
+            case OpLayout::Reg:
+                std::cout << " " << DisplayRegisterName(fd, reg0);
+                break;
+            case OpLayout::RegReg:
+                std::cout << " " << DisplayRegisterName(fd, reg0) << " " << DisplayRegisterName(fd, reg1);
+                break;
+            case OpLayout::RegRegReg:
+                std::cout << " " << DisplayRegisterName(fd, reg0) << " " << DisplayRegisterName(fd, reg1) << " " << DisplayRegisterName(fd, reg2);
+                break;
+            case OpLayout::RegCharReg:
+                std::cout << " " << DisplayRegisterName(fd, reg0) << " " << (int)reg1 << " " << DisplayRegisterName(fd, reg2);
+                break;
+            case OpLayout::RegInt:
+                std::cout << " " << DisplayRegisterName(fd, reg0) << " " << *(int *)(data + idx + 2);
+                break;
+            case OpLayout::RegFloat:
+                std::cout << " " << DisplayRegisterName(fd, reg0) << " " << *(float *)(data + idx + 2);
+                break;
+            case OpLayout::RegUInt:
+            case OpLayout::RegTarget:
+                std::cout << " " << DisplayRegisterName(fd, reg0) << " " << *(unsigned int *)(data + idx + 2);
+                break;
+            case OpLayout::RegRegTarget:
+                std::cout << " " << DisplayRegisterName(fd, reg0) << " " << DisplayRegisterName(fd, reg1) << " " << *(unsigned int *)(data + idx + 3);
+                break;
+            case OpLayout::RegIntReg:
+                std::cout << " " << DisplayRegisterName(fd, reg0) << " " << *(int *)(data + idx + 2) << " " << DisplayRegisterName(fd, *(char*)(data + idx + 6));
+                break;
+            case OpLayout::Char:
+                std::cout << " " << (int)reg0;
+                break;
+            case OpLayout::UIntCharReg:
+                std::cout << " " << *(unsigned int *)(data + idx + 1) << " " << (int)*(char*)(data + idx + 5) << " " << DisplayRegisterName(fd, *(char*)(data + idx + 6));
+                break;
+            case OpLayout::UIntCharChar:
+                std::cout << " " << *(unsigned int *)(data + idx + 1) << " " << (int)*(char*)(data + idx + 5) << " " << (int)*(char*)(data + idx + 6);
+                break;
+            case OpLayout::Target:
+                std::cout << " " << *(unsigned int *)(data + idx + 1);
                 break;
-            case OpCode::Store: DISPLAY_TWO_REG; break;
-            case OpCode::StoreIdx: DISPLAY_THREE_REG; break;
-            case OpCode::Eq: DISPLAY_THREE_REG; break;
-            case OpCode::Or: DISPLAY_THREE_REG; break;
-            case OpCode::And: DISPLAY_THREE_REG; break;
-            case OpCode::Add: DISPLAY_THREE_REG; break;
-            case OpCode::Sub: DISPLAY_THREE_REG; break;
-            case OpCode::Mul: DISPLAY_THREE_REG; break;
-            case OpCode::Div: DISPLAY_THREE_REG; break;
-            case OpCode::Mod: DISPLAY_THREE_REG; break;
-            case OpCode::Concat: DISPLAY_THREE_REG; break;
-            case OpCode::Inc: DISPLAY_ONE_REG; break;
-            case OpCode::Dec: DISPLAY_ONE_REG; break;
-            case OpCode::PostInc: DISPLAY_ONE_REG; break;
-            case OpCode::PostDec: DISPLAY_ONE_REG; break;
-            case OpCode::Neg: DISPLAY_TWO_REG; break;
-            case OpCode::LT: DISPLAY_THREE_REG; break;
-            case OpCode::GT: DISPLAY_THREE_REG; break;
-            case OpCode::LTE: DISPLAY_THREE_REG; break;
-            case OpCode::GTE: DISPLAY_THREE_REG; break;
-            case OpCode::Ret: DISPLAY_ONE_REG; break;
-            case OpCode::RestoreRet: DISPLAY_ONE_REG; break;
-            case OpCode::BrT: DISPLAY_ONE_REG_UINT; break;
-            case OpCode::BrF: DISPLAY_ONE_REG_UINT; break;
-            case OpCode::Jmp: DISPLAY_UINT; break;
-            case OpCode::Index: DISPLAY_THREE_REG; break;
-            case OpCode::MakeList: DISPLAY_ONE_REG_UINT; break;
-            case OpCode::MakeMap: DISPLAY_ONE_REG_UINT; break;
-            case OpCode::Call: DISPLAY_ONE_REG_CHAR; break;
-            case OpCode::Push: DISPLAY_ONE_REG; break;
-            case OpCode::PopN: DISPLAY_CHAR; break;
             }
 
+            if (op == OpCode::LoadFunc)
+            {
+                std::cout << " ; " << bytecode.functions[*(unsigned int *)(data + idx + 2)].name;
+            }
+            else if (op == OpCode::CallDirect)
+            {
+                std::cout << " ; " << bytecode.functions[*(unsigned int *)(data + idx + 1)].name;
+            }
+
+            idx += (unsigned int)GetOpSize(op) - 1;
             std::cout << std::endl;
         }
     }
 }
+
+// Image layout, all counts and offsets 32 bit:
+//   header  magic "SCRI", version, data offset, data size, string count, function count
+//   data    the packed bytecode
+//   strings per string: length, characters, null terminator
+//   funcs   per function: name, nParam, external, nLocalRegisters, entry, local count, per local: register, name
+// Names are written like strings so they can be read in place.
+static const char s_imageMagic[4] = { 'S', 'C', 'R', 'I' };
+
+static void AppendU32(std::vector<unsigned char>& image, unsigned int value)
+{
+    image.insert(image.end(), (const unsigned char*)&value, (const unsigned char*)&value + sizeof(unsigned int));
+}
+
+static void AppendString(std::vector<unsigned char>& image, const std::string& str)
+{
+    AppendU32(image, (unsigned int)str.size());
+    image.insert(image.end(), str.c_str(), str.c_str() + str.size() + 1);
+}
+
+std::vector<unsigned char> scrpt::WriteBytecodeImage(const Bytecode& bytecode)
+{
+    std::vector<unsigned char> image(s_imageMagic, s_imageMagic + sizeof(s_imageMagic));
+    AppendU32(image, BytecodeImageVersion);
+    AppendU32(image, (unsigned int)(image.size() + 4 * sizeof(unsigned int)));
+    AppendU32(image, (unsigned int)bytecode.data.size());
+    AppendU32(image, (unsigned int)bytecode.strings.size());
+    AppendU32(image, (unsigned int)bytecode.functions.size());
+    image.insert(image.end(), bytecode.data.begin(), bytecode.data.end());
+
+    for (const std::string& str : bytecode.strings)
+    {
+        AppendString(image, str);
+    }
+
+    for (const FunctionData& fd : bytecode.functions)
+    {
+        AppendString(image, fd.name);
+        image.push_back(fd.nParam);
+        image.push_back(fd.external ? 1 : 0);
+        AppendU32(image, (unsigned int)fd.nLocalRegisters);
+        AppendU32(image, fd.entry);
+        AppendU32(image, (unsigned int)fd.localLookup.size());
+        for (auto& local : fd.localLookup)
+        {
+            AppendU32(image, (unsigned int)local.first);
+            AppendString(image, local.second);
+        }
+    }
+
+    return image;
+}
+
+namespace
+{
+    // Bounds checked cursor over an image
+    class ImageReader
+    {
+    public:
+        ImageReader(const unsigned char* image, size_t size) : _pos(image), _end(image + size) {}
+
+        const unsigned char* Bytes(size_t count)
+        {
+            if ((size_t)(_end - _pos) < count)
+            {
+                throw scrpt::CreateEx("Truncated bytecode image", scrpt::Err::VM_InvalidImage);
+            }
+
+            const unsigned char* bytes = _pos;
+            _pos += count;
+            return bytes;
+        }
+
+        unsigned char U8() { return *this->Bytes(1); }
+
+        unsigned int U32()
+        {
+            unsigned int value;
+            memcpy(&value, this->Bytes(sizeof(unsigned int)), sizeof(unsigned int));
+            return value;
+        }
+
+        const char* String()
+        {
+            unsigned int length = this->U32();
+            const char* str = (const char*)this->Bytes((size_t)length + 1);
+            if (str[length] != '\0')
+            {
+                throw scrpt::CreateEx("Unterminated string in bytecode image", scrpt::Err::VM_InvalidImage);
+            }
+
+            return str;
+        }
+
+    private:
+        const unsigned char* _pos;
+        const unsigned char* _end;
+    };
+}
+
+scrpt::BytecodeImage scrpt::ReadBytecodeImage(const unsigned char* image, size_t size)
+{
+    AssertNotNull(image);
+
+    ImageReader reader(image, size);
+    if (memcmp(reader.Bytes(sizeof(s_imageMagic)), s_imageMagic, sizeof(s_imageMagic)) != 0)
+    {
+        throw CreateEx("Not a bytecode image", Err::VM_InvalidImage);
+    }
+
+    if (reader.U32() != BytecodeImageVersion)
+    {
+        throw CreateEx("Unsupported bytecode image version", Err::VM_InvalidImage);
+    }
+
+    unsigned int dataOffset = reader.U32();
+    unsigned int dataSize = reader.U32();
+    unsigned int nStrings = reader.U32();
+    unsigned int nFunctions = reader.U32();
+    if (dataOffset != sizeof(s_imageMagic) + 5 * sizeof(unsigned int))
+    {
+        throw CreateEx("Unexpected bytecode image header", Err::VM_InvalidImage);
+    }
+
+    BytecodeImage result;
+    result.data = reader.Bytes(dataSize);
+    result.dataSize = dataSize;
+
+    for (unsigned int idx = 0; idx < nStrings; ++idx)
+    {
+        result.strings.push_back(reader.String());
+    }
+
+    for (unsigned int idx = 0; idx < nFunctions; ++idx)
+    {
+        FunctionData fd;
+        fd.name = reader.String();
+        fd.nParam = reader.U8();
+        fd.external = reader.U8() != 0;
+        fd.nLocalRegisters = reader.U32();
+        fd.entry = reader.U32();
+        unsigned int nLocals = reader.U32();
+        for (unsigned int local = 0; local < nLocals; ++local)
+        {
+            int reg = (int)reader.U32();
+            fd.localLookup[reg] = reader.String();
+        }
+
+        if (!fd.external && fd.entry >= dataSize)
+        {
+            throw CreateEx("Function entry out of range in bytecode image", Err::VM_InvalidImage);
+        }
+
+        result.functions.push_back(std::move(fd));
+    }
+
+    return result;
+}
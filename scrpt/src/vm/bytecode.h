@@ -32,9 +32,10 @@ namespace scrpt
         GT, // reg0, reg1, reg2
         LTE, // reg0, reg1, reg2
         GTE, // reg0, reg1, reg2
-        Call, // reg0, char num params
-        Ret, // reg0
-        RestoreRet, // reg0
+        Call, // reg0, char num params, reg2 result
+        CallDirect, // unsigned int function id, char num params, reg result, for callees known when compiling
+        Ret, // reg0, moves into the result register of the call and releases its arguments
+        TailCall, // unsigned int function id, char num params, char num params of the returning function, reuses its frame
 		BrT, // reg0, unsigned int bytecode location
 		BrF, // reg0, unsigned int bytecode location
 		Jmp, // unsigned int bytecode location
@@ -42,11 +43,76 @@ namespace scrpt
         MakeList, // reg0, unsigned int number of items
         MakeMap, // reg0, unsigned int number of items
         Push, // reg0
-        PopN, // char number of pops
+        PushN, // char number of null argument slots for a call, which the caller then writes as registers
+
+        // Superinstructions fusing the most frequently executed op pairs (see VM::DumpOpPairProfile)
+        BrLT, // reg0, reg1, unsigned int bytecode location, branches when reg0 < reg1
+        BrLTE, // reg0, reg1, unsigned int bytecode location, branches when reg0 <= reg1
+        BrGT, // reg0, reg1, unsigned int bytecode location, branches when reg0 > reg1
+        BrGTE, // reg0, reg1, unsigned int bytecode location, branches when reg0 >= reg1
+        AddImm, // reg0, int, reg2
+        MulImm, // reg0, int, reg2
+
+        // Forms that BytecodeGen emits when the destination register can never hold a ref counted value,
+        // so the store skips the Deref of the previous value
+        LoadIntS, // LoadInt into a scalar only register
+        StoreS, // Store into a scalar only register
+        AddS, // Add into a scalar only register
+        SubS, // Sub into a scalar only register
+        MulS, // Mul into a scalar only register
+        AddImmS, // AddImm into a scalar only register
+        MulImmS, // MulImm into a scalar only register
+
+        // Int specialized forms that the VM quickens the generic ops into at runtime. They are never
+        // emitted by the compiler and are rejected when decoding bytecode.
+        AddII, // Add with Int operands
+        SubII, // Sub with Int operands
+        MulII, // Mul with Int operands
+        LTII, // LT with Int operands
+        GTII, // GT with Int operands
+        LTEII, // LTE with Int operands
+        GTEII, // GTE with Int operands
+        IncI, // Inc with Int operands
+        DecI, // Dec with Int operands
+        BrLTII, // BrLT with Int operands
+        BrLTEII, // BrLTE with Int operands
+        BrGTII, // BrGT with Int operands
+        BrGTEII, // BrGTE with Int operands
+        AddImmI, // AddImm with Int operands
+        MulImmI, // MulImm with Int operands
+        AddIIS, // AddS with Int operands
+        SubIIS, // SubS with Int operands
+        MulIIS, // MulS with Int operands
+        AddImmIS, // AddImmS with Int operands
+        MulImmIS, // MulImmS with Int operands
         __Num,
+        __FirstQuickened = AddII,
     };
     const char* OpCodeToString(OpCode code);
 
+    // Operand encoding that follows an opcode in the packed bytecode
+    enum class OpLayout
+    {
+        None,
+        Reg, // char reg0
+        RegReg, // char reg0, char reg1
+        RegRegReg, // char reg0, char reg1, char reg2
+        RegCharReg, // char reg0, char value, char reg2
+        RegInt, // char reg0, int value
+        RegFloat, // char reg0, float value
+        RegUInt, // char reg0, unsigned int value
+        RegTarget, // char reg0, unsigned int bytecode location
+        RegRegTarget, // char reg0, char reg1, unsigned int bytecode location
+        RegIntReg, // char reg0, int value, char reg2
+        Char, // char value
+        UIntCharReg, // unsigned int value, char value, char reg
+        UIntCharChar, // unsigned int value, char value, char value
+        Target, // unsigned int bytecode location
+    };
+    OpLayout GetOpLayout(OpCode code);
+    // Size in bytes of an instruction, including the opcode, in the packed bytecode
+    size_t GetOpSize(OpCode code);
+
     struct FunctionData
     {
         std::string name;
@@ -65,5 +131,42 @@ namespace scrpt
         std::vector<std::string> strings;
     };
 
+    // Bytecode serialized for loading without compiling. Images store values in the byte order and sizes of the
+    // machine that wrote them. Externs are stored by name and arity only and must be bound again on load.
+    // Bump the version whenever the layout or the opcode set changes.
+    const unsigned int BytecodeImageVersion = 4;
+    std::vector<unsigned char> WriteBytecodeImage(const Bytecode& bytecode);
+
+    // Bytecode read in place from an image. Code and string constants point into the image, which must outlive it.
+    struct BytecodeImage
+    {
+        const unsigned char* data;
+        size_t dataSize;
+        std::vector<FunctionData> functions;
+        std::vector<const char*> strings;
+    };
+    BytecodeImage ReadBytecodeImage(const unsigned char* image, size_t size);
+
+    // Fixed width form of an instruction that the VM executes. The packed Bytecode::data is decoded
+    // into these once at load time so the interpreter does a single aligned load per instruction, with
+    // registers already sign extended and jump targets and constants already resolved.
+    struct Instruction
+    {
+        // Quickening rewrites the op while other threads may be running the same instruction. Either op is correct
+        // for it, so relaxed loads and stores are enough as long as the op is read and written whole.
+        std::atomic<OpCode> op;
+        short reg0;
+        short reg1;
+        short reg2;
+        union
+        {
+            int integer;
+            float fp;
+            unsigned int id;
+            const char* string;
+            const Instruction* target;
+        };
+    };
+
     void Decompile(const Bytecode& bytecode);
 }
\ No newline at end of file
@@ -0,0 +1,1181 @@
+#include "../scrpt.h"
+
+#define COMPONENTNAME "Jit"
+
+#if SCRPT_JIT
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Taken backward branches before a loop is recorded, and the limits that keep traces to simple inner loops
+#define HOTLOOPCOUNT 64
+#define MAXTRACELENGTH 256
+#define MAXATTEMPTS 3
+#define MAXGUARDFAILURES 64
+
+// Calls before a function body is compiled
+#define HOTMETHODCOUNT 32
+
+using namespace scrpt;
+
+namespace
+{
+    // Semantics shared by the generic, scalar destination and quickened forms of each op
+    enum class TraceOp
+    {
+        Unsupported,
+        LoadInt,
+        LoadFloat,
+        LoadTrue,
+        LoadFalse,
+        Store,
+        Add,
+        Sub,
+        Mul,
+        AddImm,
+        MulImm,
+        Inc,
+        Dec,
+        Neg,
+        LT,
+        LTE,
+        GT,
+        GTE,
+        Eq,
+        And,
+        Or,
+        BrT,
+        BrF,
+        BrLT,
+        BrLTE,
+        BrGT,
+        BrGTE,
+        Jmp,
+    };
+
+    TraceOp GetTraceOp(OpCode op)
+    {
+        switch (op)
+        {
+        case OpCode::LoadInt: case OpCode::LoadIntS: return TraceOp::LoadInt;
+        case OpCode::LoadFloat: return TraceOp::LoadFloat;
+        case OpCode::LoadTrue: return TraceOp::LoadTrue;
+        case OpCode::LoadFalse: return TraceOp::LoadFalse;
+        case OpCode::Store: case OpCode::StoreS: return TraceOp::Store;
+        case OpCode::Add: case OpCode::AddS: case OpCode::AddII: case OpCode::AddIIS: return TraceOp::Add;
+        case OpCode::Sub: case OpCode::SubS: case OpCode::SubII: case OpCode::SubIIS: return TraceOp::Sub;
+        case OpCode::Mul: case OpCode::MulS: case OpCode::MulII: case OpCode::MulIIS: return TraceOp::Mul;
+        case OpCode::AddImm: case OpCode::AddImmS: case OpCode::AddImmI: case OpCode::AddImmIS: return TraceOp::AddImm;
+        case OpCode::MulImm: case OpCode::MulImmS: case OpCode::MulImmI: case OpCode::MulImmIS: return TraceOp::MulImm;
+        case OpCode::Inc: case OpCode::IncI: case OpCode::PostInc: return TraceOp::Inc;
+        case OpCode::Dec: case OpCode::DecI: case OpCode::PostDec: return TraceOp::Dec;
+        case OpCode::Neg: return TraceOp::Neg;
+        case OpCode::LT: case OpCode::LTII: return TraceOp::LT;
+        case OpCode::LTE: case OpCode::LTEII: return TraceOp::LTE;
+        case OpCode::GT: case OpCode::GTII: return TraceOp::GT;
+        case OpCode::GTE: case OpCode::GTEII: return TraceOp::GTE;
+        case OpCode::Eq: return TraceOp::Eq;
+        case OpCode::And: return TraceOp::And;
+        case OpCode::Or: return TraceOp::Or;
+        case OpCode::BrT: return TraceOp::BrT;
+        case OpCode::BrF: return TraceOp::BrF;
+        case OpCode::BrLT: case OpCode::BrLTII: return TraceOp::BrLT;
+        case OpCode::BrLTE: case OpCode::BrLTEII: return TraceOp::BrLTE;
+        case OpCode::BrGT: case OpCode::BrGTII: return TraceOp::BrGT;
+        case OpCode::BrGTE: case OpCode::BrGTEII: return TraceOp::BrGTE;
+        case OpCode::Jmp: return TraceOp::Jmp;
+        default: return TraceOp::Unsupported;
+        }
+    }
+
+    bool IsBranch(TraceOp op)
+    {
+        return op >= TraceOp::BrT && op <= TraceOp::Jmp;
+    }
+
+    // Which of reg0, reg1 and reg2 are register operands
+    void GetRegisterOperands(OpCode op, bool used[3])
+    {
+        used[0] = used[1] = used[2] = false;
+        switch (GetOpLayout(op))
+        {
+        case OpLayout::RegRegReg: used[2] = true; // fall through
+        case OpLayout::RegReg:
+        case OpLayout::RegRegTarget: used[1] = true; // fall through
+        case OpLayout::Reg:
+        case OpLayout::RegInt:
+        case OpLayout::RegFloat:
+        case OpLayout::RegUInt:
+        case OpLayout::RegTarget: used[0] = true; break;
+        case OpLayout::RegIntReg:
+        case OpLayout::RegCharReg: used[0] = used[2] = true; break;
+        case OpLayout::UIntCharReg: used[2] = true; break;
+        default: break;
+        }
+    }
+
+    bool IsNumeric(StackType t)
+    {
+        return t == StackType::Int || t == StackType::Float;
+    }
+
+    unsigned int FloatBits(float val)
+    {
+        unsigned int bits;
+        memcpy(&bits, &val, sizeof(float));
+        return bits;
+    }
+
+    // Condition codes as encoded in jcc and setcc
+    enum Cond : unsigned char
+    {
+        Below = 0x2,
+        AboveEq = 0x3,
+        Equal = 0x4,
+        NotEqual = 0x5,
+        BelowEq = 0x6,
+        Above = 0x7,
+        Less = 0xC,
+        GreaterEq = 0xD,
+        LessEq = 0xE,
+        Greater = 0xF,
+    };
+
+    Cond Invert(Cond cc)
+    {
+        return (Cond)(cc ^ 1);
+    }
+
+    // Minimal x86-64 encoder for the forms the compilers use. Values are addressed relative to a base register
+    // holding the frame pointer. Traces use r11 and only eax, ecx, xmm0 and xmm1 as scratch so nothing needs
+    // saving, compiled methods call back into the VM so they keep it in the callee saved rbx.
+    class Assembler
+    {
+    public:
+        static const int Eax = 0;
+        static const int Ecx = 1;
+        static const int Edx = 2;
+        static const int Ebx = 3;
+        static const int R11 = 11;
+#ifdef _WIN32
+        static const int Arg0 = 1;
+        static const int Arg1 = 2;
+        static const int Arg2 = 8;
+#else
+        static const int Arg0 = 7;
+        static const int Arg1 = 6;
+        static const int Arg2 = 2;
+#endif
+
+        // rsp and r12 need a SIB byte so are not supported as a base
+        explicit Assembler(int base) : _base(base) {}
+
+        size_t Size() const { return _code.size(); }
+        const std::vector<unsigned char>& GetCode() const { return _code; }
+
+        void Load(int reg, int disp) { this->MemOp({ 0x8B }, reg, disp); }
+        void Store(int disp, int reg) { this->MemOp({ 0x89 }, reg, disp); }
+        void StoreImm(int disp, unsigned int imm) { this->MemOp({ 0xC7 }, 0, disp); this->Dword(imm); }
+        void CmpImm(int disp, unsigned int imm) { this->MemOp({ 0x81 }, 7, disp); this->Dword(imm); }
+        void AddImm(int disp, int imm) { this->MemOp({ 0x81 }, 0, disp); this->Dword((unsigned int)imm); }
+        void Add(int reg, int disp) { this->MemOp({ 0x03 }, reg, disp); }
+        void Sub(int reg, int disp) { this->MemOp({ 0x2B }, reg, disp); }
+        void Imul(int reg, int disp) { this->MemOp({ 0x0F, 0xAF }, reg, disp); }
+        void Cmp(int reg, int disp) { this->MemOp({ 0x3B }, reg, disp); }
+
+        void AddRegImm(int reg, int imm) { this->Bytes({ 0x81, (unsigned char)(0xC0 | reg) }); this->Dword((unsigned int)imm); }
+        void ImulRegImm(int reg, int imm) { this->Bytes({ 0x69, (unsigned char)(0xC0 | (reg << 3) | reg) }); this->Dword((unsigned int)imm); }
+        void Neg(int reg) { this->Bytes({ 0xF7, (unsigned char)(0xD8 | reg) }); }
+        void XorEaxImm(unsigned int imm) { this->Byte(0x35); this->Dword(imm); }
+        void MovImm(int reg, unsigned int imm) { this->Byte((unsigned char)(0xB8 | reg)); this->Dword(imm); }
+        void Test(int reg) { this->Bytes({ 0x85, (unsigned char)(0xC0 | (reg << 3) | reg) }); }
+        void Setcc(Cond cc, int reg) { this->Bytes({ 0x0F, (unsigned char)(0x90 | cc), (unsigned char)(0xC0 | reg) }); }
+        void AndAlCl() { this->Bytes({ 0x20, 0xC8 }); }
+        void OrAlCl() { this->Bytes({ 0x08, 0xC8 }); }
+        void MovzxEaxAl() { this->Bytes({ 0x0F, 0xB6, 0xC0 }); }
+
+        void Movss(int xmm, int disp) { this->Byte(0xF3); this->MemOp({ 0x0F, 0x10 }, xmm, disp); }
+        void MovssStore(int disp, int xmm) { this->Byte(0xF3); this->MemOp({ 0x0F, 0x11 }, xmm, disp); }
+        void Cvtsi2ss(int xmm, int disp) { this->Byte(0xF3); this->MemOp({ 0x0F, 0x2A }, xmm, disp); }
+        void Movd(int xmm, int reg) { this->Bytes({ 0x66, 0x0F, 0x6E, (unsigned char)(0xC0 | (xmm << 3) | reg) }); }
+        void Addss(int x, int y) { this->Bytes({ 0xF3, 0x0F, 0x58, (unsigned char)(0xC0 | (x << 3) | y) }); }
+        void Subss(int x, int y) { this->Bytes({ 0xF3, 0x0F, 0x5C, (unsigned char)(0xC0 | (x << 3) | y) }); }
+        void Mulss(int x, int y) { this->Bytes({ 0xF3, 0x0F, 0x59, (unsigned char)(0xC0 | (x << 3) | y) }); }
+        void Ucomiss(int x, int y) { this->Bytes({ 0x0F, 0x2E, (unsigned char)(0xC0 | (x << 3) | y) }); }
+
+        // Jumps return the location of their rel32 for Patch
+        size_t Jcc(Cond cc) { this->Bytes({ 0x0F, (unsigned char)(0x80 | cc) }); this->Dword(0); return _code.size() - 4; }
+        size_t Jmp() { this->Byte(0xE9); this->Dword(0); return _code.size() - 4; }
+        void Ret() { this->Byte(0xC3); }
+
+        // 64 bit forms for pointers, whole values and calls
+        void Push(int reg) { this->Byte((unsigned char)(0x50 | reg)); }
+        void Pop(int reg) { this->Byte((unsigned char)(0x58 | reg)); }
+        void SubRsp(unsigned char imm) { this->Bytes({ 0x48, 0x83, 0xEC, imm }); }
+        void AddRsp(unsigned char imm) { this->Bytes({ 0x48, 0x83, 0xC4, imm }); }
+        void MovReg64(int dest, int src) { this->RegReg64(0x89, src, dest); }
+        void CmpReg64(int a, int b) { this->RegReg64(0x39, b, a); }
+        void MovImm64(int reg, uint64_t imm)
+        {
+            this->Bytes({ (unsigned char)(0x48 | (reg >= 8 ? 1 : 0)), (unsigned char)(0xB8 | (reg & 7)) });
+            this->Dword((unsigned int)imm);
+            this->Dword((unsigned int)(imm >> 32));
+        }
+        void MovImm64(int reg, const void* ptr) { this->MovImm64(reg, (uint64_t)(uintptr_t)ptr); }
+        void Load64(int reg, int base, int disp) { this->MemOp({ 0x8B }, reg, base, disp, true); }
+        void Store64(int base, int disp, int reg) { this->MemOp({ 0x89 }, reg, base, disp, true); }
+        void StoreImm64(int disp, int imm) { this->MemOp({ 0xC7 }, 0, _base, disp, true); this->Dword((unsigned int)imm); }
+        void AddImm64(int base, int disp, int imm) { this->MemOp({ 0x81 }, 0, base, disp, true); this->Dword((unsigned int)imm); }
+        void Lea(int reg, int disp) { this->MemOp({ 0x8D }, reg, _base, disp, true); }
+        void Lea64(int reg, int base, int disp) { this->MemOp({ 0x8D }, reg, base, disp, true); }
+        void CallAbs(const void* func) { this->MovImm64(Eax, func); this->Bytes({ 0xFF, 0xD0 }); }
+
+        void Patch(size_t rel32, size_t target)
+        {
+            int rel = (int)target - (int)(rel32 + 4);
+            memcpy(&_code[rel32], &rel, sizeof(int));
+        }
+
+    private:
+        void Byte(unsigned char b) { _code.push_back(b); }
+        void Bytes(std::initializer_list<unsigned char> bytes) { _code.insert(_code.end(), bytes); }
+        void Dword(unsigned int d) { for (int i = 0; i < 4; ++i) this->Byte((unsigned char)(d >> (i * 8))); }
+
+        void MemOp(std::initializer_list<unsigned char> opcode, int reg, int disp) { this->MemOp(opcode, reg, _base, disp, false); }
+
+        // Optional REX, opcode, then a ModRM of [base + disp32] with reg in the reg field
+        void MemOp(std::initializer_list<unsigned char> opcode, int reg, int base, int disp, bool wide)
+        {
+            unsigned char rex = (unsigned char)(0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0));
+            if (rex != 0x40) this->Byte(rex);
+            this->Bytes(opcode);
+            this->Byte((unsigned char)(0x80 | ((reg & 7) << 3) | (base & 7)));
+            this->Dword((unsigned int)disp);
+        }
+
+        void RegReg64(unsigned char opcode, int reg, int rm)
+        {
+            this->Bytes({ (unsigned char)(0x48 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0)), opcode, (unsigned char)(0xC0 | ((reg & 7) << 3) | (rm & 7)) });
+        }
+
+        int _base;
+        std::vector<unsigned char> _code;
+    };
+
+    // Copies code into its own pages, which are made executable and read only once written
+    void* AllocateExecutable(const std::vector<unsigned char>& code)
+    {
+#ifdef _WIN32
+        void* memory = VirtualAlloc(nullptr, code.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (memory == nullptr) return nullptr;
+        memcpy(memory, &code[0], code.size());
+        DWORD oldProtect;
+        VirtualProtect(memory, code.size(), PAGE_EXECUTE_READ, &oldProtect);
+#else
+        void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return nullptr;
+        memcpy(memory, &code[0], code.size());
+        mprotect(memory, code.size(), PROT_READ | PROT_EXEC);
+#endif
+        return memory;
+    }
+
+    void FreeExecutable(void* memory, size_t size)
+    {
+#ifdef _WIN32
+        VirtualFree(memory, 0, MEM_RELEASE);
+#else
+        munmap(memory, size);
+#endif
+    }
+}
+
+namespace scrpt
+{
+    Jit::Jit(const Instruction* code, size_t nInstructions)
+        : _code(code)
+        , _loops(nInstructions)
+        , _recordingHeader(nullptr)
+    {
+    }
+
+    Jit::~Jit()
+    {
+    }
+
+    Jit::Trace::~Trace()
+    {
+        FreeExecutable(memory, memorySize);
+    }
+
+    const Instruction* Jit::OnLoop(const Instruction* header, StackObj* framePointer, bool* record)
+    {
+        *record = false;
+
+        // Loops reached while recording are either the recorded loop closing or an inner loop that aborts it
+        if (_recordingHeader != nullptr)
+        {
+            return header;
+        }
+
+        LoopState& state = _loops[header - _code];
+        if (state.trace)
+        {
+            unsigned int exit = state.trace->func(framePointer);
+            const Instruction* resume = state.trace->exits[exit];
+
+            // Exit 0 is the entry guard, a trace that keeps failing it is dropped so the loop can be re-recorded
+            if (exit == 0 && ++state.guardFailures >= MAXGUARDFAILURES)
+            {
+                state.trace.reset();
+            }
+
+            return resume;
+        }
+
+        if (state.attempts < MAXATTEMPTS && ++state.count >= HOTLOOPCOUNT)
+        {
+            state.count = 0;
+            ++state.attempts;
+            _recordingHeader = header;
+            _recording.clear();
+            *record = true;
+        }
+
+        return header;
+    }
+
+    bool Jit::Record(const Instruction* ip, const StackObj* framePointer)
+    {
+        if (_recordingHeader == nullptr)
+        {
+            return false;
+        }
+
+        if (!_recording.empty())
+        {
+            const Instruction* last = _recording.back().ip;
+            if (ip == _recordingHeader && IsBranch(GetTraceOp(last->op)) && last->target == _recordingHeader)
+            {
+                this->StopRecording(true);
+                return false;
+            }
+
+            // Quickening re-dispatches the instruction it rewrote
+            if (ip == last)
+            {
+                return true;
+            }
+
+            // Any other backward branch is an inner loop
+            if (ip < last)
+            {
+                this->StopRecording(false);
+                return false;
+            }
+        }
+
+        if (GetTraceOp(ip->op) == TraceOp::Unsupported || _recording.size() >= MAXTRACELENGTH)
+        {
+            this->StopRecording(false);
+            return false;
+        }
+
+        RecordedOp op;
+        op.ip = ip;
+        bool used[3];
+        GetRegisterOperands(ip->op, used);
+        const short regs[3] = { ip->reg0, ip->reg1, ip->reg2 };
+        for (int idx = 0; idx < 3; ++idx)
+        {
+            op.types[idx] = used[idx] ? (framePointer + regs[idx])->v.GetType() : StackType::Null;
+        }
+        _recording.push_back(op);
+
+        return true;
+    }
+
+    void Jit::CancelRecording()
+    {
+        if (_recordingHeader != nullptr)
+        {
+            this->StopRecording(false);
+        }
+    }
+
+    void Jit::StopRecording(bool compile)
+    {
+        if (compile)
+        {
+            Trace* trace = this->Compile();
+            if (trace != nullptr)
+            {
+                LoopState& state = _loops[_recordingHeader - _code];
+                state.trace.reset(trace);
+                state.guardFailures = 0;
+            }
+        }
+
+        _recordingHeader = nullptr;
+        _recording.clear();
+    }
+
+    Jit::Trace* Jit::Compile() const
+    {
+        // Each register's type on entry is what the recording saw at its first use. Later uses must agree with
+        // the types propagated through the trace, and the loop must end with the types it started with.
+        std::map<int, StackType> entryTypes;
+        for (const RecordedOp& op : _recording)
+        {
+            bool used[3];
+            GetRegisterOperands(op.ip->op, used);
+            const short regs[3] = { op.ip->reg0, op.ip->reg1, op.ip->reg2 };
+            for (int idx = 0; idx < 3; ++idx)
+            {
+                if (used[idx] && entryTypes.find(regs[idx]) == entryTypes.end())
+                {
+                    entryTypes[regs[idx]] = op.types[idx];
+                }
+            }
+        }
+
+        std::map<int, StackType> types = entryTypes;
+        auto payload = [](int reg) { return reg * (int)sizeof(StackObj) + (int)StackVal::RawPayloadOffset; };
+        auto typeWord = [](int reg) { return reg * (int)sizeof(StackObj) + (int)StackVal::RawTypeOffset; };
+
+        Assembler a(Assembler::R11);
+        std::vector<const Instruction*> exits;
+        std::vector<std::pair<size_t, size_t>> exitJumps;
+        auto sideExit = [&](Cond cc, const Instruction* resume)
+        {
+            exitJumps.push_back(std::make_pair(a.Jcc(cc), exits.size()));
+            exits.push_back(resume);
+        };
+        auto setType = [&](int reg, StackType t)
+        {
+            if (types[reg] != t)
+            {
+                a.StoreImm(typeWord(reg), StackVal::RawTypeWord(t));
+                types[reg] = t;
+            }
+        };
+        auto loadFloat = [&](int xmm, int reg)
+        {
+            if (types[reg] == StackType::Int) a.Cvtsi2ss(xmm, payload(reg));
+            else a.Movss(xmm, payload(reg));
+        };
+
+        // Entry guards, which resume at the header with nothing executed
+        a.MovReg64(Assembler::R11, Assembler::Arg0);
+        exits.push_back(_recordingHeader);
+        for (auto& entry : entryTypes)
+        {
+            if (!IsNumeric(entry.second) && entry.second != StackType::Boolean)
+            {
+                return nullptr;
+            }
+
+            a.CmpImm(typeWord(entry.first), StackVal::RawTypeWord(entry.second));
+            exitJumps.push_back(std::make_pair(a.Jcc(Cond::NotEqual), (size_t)0));
+        }
+
+        size_t loopStart = a.Size();
+        std::vector<size_t> loopJumps;
+        for (size_t idx = 0; idx < _recording.size(); ++idx)
+        {
+            const RecordedOp& op = _recording[idx];
+            const Instruction* ip = op.ip;
+            const bool last = idx + 1 == _recording.size();
+            const Instruction* next = last ? _recordingHeader : _recording[idx + 1].ip;
+            const int r0 = ip->reg0;
+            const int r1 = ip->reg1;
+            const int r2 = ip->reg2;
+
+            bool used[3];
+            GetRegisterOperands(ip->op, used);
+            const int regs[3] = { r0, r1, r2 };
+            for (int operand = 0; operand < 3; ++operand)
+            {
+                if (used[operand] && types[regs[operand]] != op.types[operand])
+                {
+                    return nullptr;
+                }
+            }
+
+            TraceOp traceOp = GetTraceOp(ip->op);
+            if (IsBranch(traceOp))
+            {
+                if (next != ip->target && (last || next != ip + 1))
+                {
+                    return nullptr;
+                }
+            }
+            else if (last || next != ip + 1)
+            {
+                return nullptr;
+            }
+
+            // Condition under which a conditional branch is taken, once its comparison has been emitted
+            Cond taken = Cond::Equal;
+            switch (traceOp)
+            {
+            case TraceOp::LoadInt:
+                a.StoreImm(payload(r0), (unsigned int)ip->integer);
+                setType(r0, StackType::Int);
+                break;
+
+            case TraceOp::LoadFloat:
+                a.StoreImm(payload(r0), FloatBits(ip->fp));
+                setType(r0, StackType::Float);
+                break;
+
+            case TraceOp::LoadTrue:
+            case TraceOp::LoadFalse:
+                a.StoreImm(payload(r0), traceOp == TraceOp::LoadTrue ? 1 : 0);
+                setType(r0, StackType::Boolean);
+                break;
+
+            case TraceOp::Store:
+                a.Load(Assembler::Eax, payload(r1));
+                a.Store(payload(r0), Assembler::Eax);
+                setType(r0, types[r1]);
+                break;
+
+            case TraceOp::Add:
+            case TraceOp::Sub:
+            case TraceOp::Mul:
+                if (!IsNumeric(types[r0]) || !IsNumeric(types[r1]))
+                {
+                    return nullptr;
+                }
+
+                if (types[r0] == StackType::Int && types[r1] == StackType::Int)
+                {
+                    a.Load(Assembler::Eax, payload(r0));
+                    if (traceOp == TraceOp::Add) a.Add(Assembler::Eax, payload(r1));
+                    else if (traceOp == TraceOp::Sub) a.Sub(Assembler::Eax, payload(r1));
+                    else a.Imul(Assembler::Eax, payload(r1));
+                    a.Store(payload(r2), Assembler::Eax);
+                    setType(r2, StackType::Int);
+                }
+                else
+                {
+                    loadFloat(0, r0);
+                    loadFloat(1, r1);
+                    if (traceOp == TraceOp::Add) a.Addss(0, 1);
+                    else if (traceOp == TraceOp::Sub) a.Subss(0, 1);
+                    else a.Mulss(0, 1);
+                    a.MovssStore(payload(r2), 0);
+                    setType(r2, StackType::Float);
+                }
+                break;
+
+            case TraceOp::AddImm:
+            case TraceOp::MulImm:
+                if (types[r0] == StackType::Int)
+                {
+                    a.Load(Assembler::Eax, payload(r0));
+                    if (traceOp == TraceOp::AddImm) a.AddRegImm(Assembler::Eax, ip->integer);
+                    else a.ImulRegImm(Assembler::Eax, ip->integer);
+                    a.Store(payload(r2), Assembler::Eax);
+                    setType(r2, StackType::Int);
+                }
+                else if (types[r0] == StackType::Float)
+                {
+                    a.Movss(0, payload(r0));
+                    a.MovImm(Assembler::Eax, FloatBits((float)ip->integer));
+                    a.Movd(1, Assembler::Eax);
+                    if (traceOp == TraceOp::AddImm) a.Addss(0, 1);
+                    else a.Mulss(0, 1);
+                    a.MovssStore(payload(r2), 0);
+                    setType(r2, StackType::Float);
+                }
+                else
+                {
+                    return nullptr;
+                }
+                break;
+
+            case TraceOp::Inc:
+            case TraceOp::Dec:
+                if (types[r0] == StackType::Int)
+                {
+                    a.AddImm(payload(r0), traceOp == TraceOp::Inc ? 1 : -1);
+                }
+                else if (types[r0] == StackType::Float)
+                {
+                    a.Movss(0, payload(r0));
+                    a.MovImm(Assembler::Eax, FloatBits(1.0f));
+                    a.Movd(1, Assembler::Eax);
+                    if (traceOp == TraceOp::Inc) a.Addss(0, 1);
+                    else a.Subss(0, 1);
+                    a.MovssStore(payload(r0), 0);
+                }
+                else
+                {
+                    return nullptr;
+                }
+                break;
+
+            case TraceOp::Neg:
+                if (!IsNumeric(types[r0]))
+                {
+                    return nullptr;
+                }
+
+                a.Load(Assembler::Eax, payload(r0));
+                if (types[r0] == StackType::Int) a.Neg(Assembler::Eax);
+                else a.XorEaxImm(0x80000000);
+                a.Store(payload(r1), Assembler::Eax);
+                setType(r1, types[r0]);
+                break;
+
+            case TraceOp::LT:
+            case TraceOp::LTE:
+            case TraceOp::GT:
+            case TraceOp::GTE:
+            case TraceOp::BrLT:
+            case TraceOp::BrLTE:
+            case TraceOp::BrGT:
+            case TraceOp::BrGTE:
+                {
+                    if (!IsNumeric(types[r0]) || !IsNumeric(types[r1]))
+                    {
+                        return nullptr;
+                    }
+
+                    bool less = traceOp == TraceOp::LT || traceOp == TraceOp::LTE || traceOp == TraceOp::BrLT || traceOp == TraceOp::BrLTE;
+                    bool orEqual = traceOp == TraceOp::LTE || traceOp == TraceOp::GTE || traceOp == TraceOp::BrLTE || traceOp == TraceOp::BrGTE;
+                    if (types[r0] == StackType::Int && types[r1] == StackType::Int)
+                    {
+                        a.Load(Assembler::Eax, payload(r0));
+                        a.Cmp(Assembler::Eax, payload(r1));
+                        taken = less ? (orEqual ? Cond::LessEq : Cond::Less) : (orEqual ? Cond::GreaterEq : Cond::Greater);
+                    }
+                    else
+                    {
+                        // Unordered compares set CF so above and above or equal are false for NaN, as in C
+                        loadFloat(0, r0);
+                        loadFloat(1, r1);
+                        if (less) a.Ucomiss(1, 0);
+                        else a.Ucomiss(0, 1);
+                        taken = orEqual ? Cond::AboveEq : Cond::Above;
+                    }
+
+                    if (traceOp == TraceOp::LT || traceOp == TraceOp::LTE || traceOp == TraceOp::GT || traceOp == TraceOp::GTE)
+                    {
+                        a.Setcc(taken, Assembler::Eax);
+                        a.MovzxEaxAl();
+                        a.Store(payload(r2), Assembler::Eax);
+                        setType(r2, StackType::Boolean);
+                    }
+                }
+                break;
+
+            case TraceOp::Eq:
+                if (types[r0] != types[r1] || (types[r0] != StackType::Int && types[r0] != StackType::Boolean))
+                {
+                    return nullptr;
+                }
+
+                a.Load(Assembler::Eax, payload(r0));
+                a.Cmp(Assembler::Eax, payload(r1));
+                a.Setcc(Cond::Equal, Assembler::Eax);
+                a.MovzxEaxAl();
+                a.Store(payload(r2), Assembler::Eax);
+                setType(r2, StackType::Boolean);
+                break;
+
+            case TraceOp::And:
+            case TraceOp::Or:
+                if (types[r0] != StackType::Boolean || types[r1] != StackType::Boolean)
+                {
+                    return nullptr;
+                }
+
+                a.Load(Assembler::Eax, payload(r0));
+                a.Load(Assembler::Ecx, payload(r1));
+                a.Test(Assembler::Eax);
+                a.Setcc(Cond::NotEqual, Assembler::Eax);
+                a.Test(Assembler::Ecx);
+                a.Setcc(Cond::NotEqual, Assembler::Ecx);
+                if (traceOp == TraceOp::And) a.AndAlCl();
+                else a.OrAlCl();
+                a.MovzxEaxAl();
+                a.Store(payload(r2), Assembler::Eax);
+                setType(r2, StackType::Boolean);
+                break;
+
+            case TraceOp::BrT:
+            case TraceOp::BrF:
+                if (types[r0] != StackType::Boolean)
+                {
+                    return nullptr;
+                }
+
+                a.CmpImm(payload(r0), traceOp == TraceOp::BrT ? 1 : 0);
+                taken = Cond::Equal;
+                break;
+
+            case TraceOp::Jmp:
+                break;
+
+            default:
+                return nullptr;
+            }
+
+            // Branches follow the recorded direction and side exit on the other
+            if (IsBranch(traceOp))
+            {
+                bool conditional = traceOp != TraceOp::Jmp;
+                if (next == ip->target)
+                {
+                    if (conditional) sideExit(Invert(taken), ip + 1);
+                    if (last) loopJumps.push_back(a.Jmp());
+                }
+                else
+                {
+                    sideExit(taken, ip->target);
+                }
+            }
+        }
+
+        // A loop that changes the type of a register would invalidate its own entry guards
+        if (types != entryTypes)
+        {
+            return nullptr;
+        }
+
+        for (size_t jump : loopJumps)
+        {
+            a.Patch(jump, loopStart);
+        }
+
+        std::vector<size_t> exitStubs;
+        for (size_t exit = 0; exit < exits.size(); ++exit)
+        {
+            exitStubs.push_back(a.Size());
+            a.MovImm(Assembler::Eax, (unsigned int)exit);
+            a.Ret();
+        }
+
+        for (auto& jump : exitJumps)
+        {
+            a.Patch(jump.first, exitStubs[jump.second]);
+        }
+
+        void* memory = AllocateExecutable(a.GetCode());
+        if (memory == nullptr)
+        {
+            return nullptr;
+        }
+
+        Trace* trace = new Trace();
+        trace->func = reinterpret_cast<TraceFunc>(memory);
+        trace->memory = memory;
+        trace->memorySize = a.GetCode().size();
+        trace->exits = std::move(exits);
+        return trace;
+    }
+
+    MethodJit::MethodJit(VM* vm)
+        : _vm(vm)
+        , _methods(vm->_program->GetFunctionCount())
+    {
+    }
+
+    MethodJit::~MethodJit()
+    {
+        for (Method& method : _methods)
+        {
+            if (method.memory != nullptr)
+            {
+                FreeExecutable(method.memory, method.memorySize);
+            }
+        }
+    }
+
+    MethodJit::MethodFunc MethodJit::GetMethod(unsigned int funcId)
+    {
+        Method& method = _methods[funcId];
+        if (method.func == nullptr && !method.failed && ++method.calls >= HOTMETHODCOUNT)
+        {
+            method.failed = !this->Compile(funcId, &method);
+        }
+
+        return method.func;
+    }
+
+    bool MethodJit::Compile(unsigned int funcId, Method* method)
+    {
+        const Instruction* start = _vm->_functionEntries[funcId];
+        if (start == nullptr)
+        {
+            return false;
+        }
+
+        // A function's code runs up to the next function's entry
+        const Program& program = *_vm->_program;
+        const Instruction* end = program.GetInstructions() + program.GetInstructionCount() - 1;
+        for (const Instruction* entry : program.GetEntries())
+        {
+            if (entry != nullptr && entry > start && entry < end)
+            {
+                end = entry;
+            }
+        }
+
+        auto payload = [](int reg) { return reg * (int)sizeof(StackObj) + (int)StackVal::RawPayloadOffset; };
+        auto typeWord = [](int reg) { return reg * (int)sizeof(StackObj) + (int)StackVal::RawTypeOffset; };
+        auto slot = [](int reg) { return reg * (int)sizeof(StackObj); };
+
+        Assembler a(Assembler::Ebx);
+        std::vector<size_t> labels(end - start);
+        std::vector<std::pair<size_t, const Instruction*>> branches;
+        std::vector<std::pair<size_t, const Instruction*>> exits;
+        std::vector<size_t> epilogueJumps;
+
+        // Exits leave the instruction to the interpreter, none of its effects have happened yet
+        auto exitIf = [&](Cond cc, const Instruction* ip) { exits.push_back(std::make_pair(a.Jcc(cc), ip)); };
+        auto guardType = [&](int reg, StackType t, const Instruction* ip)
+        {
+            a.CmpImm(typeWord(reg), StackVal::RawTypeWord(t));
+            exitIf(Cond::NotEqual, ip);
+        };
+
+        // Ref counted types sort last so a single unsigned compare separates them in either value encoding
+        auto jumpIfRefCounted = [&](int reg) { a.CmpImm(typeWord(reg), StackVal::RawTypeWord(StackType::DynamicString)); return a.Jcc(Cond::AboveEq); };
+        auto guardScalar = [&](int reg, const Instruction* ip) { exits.push_back(std::make_pair(jumpIfRefCounted(reg), ip)); };
+        auto storeScalar = [&](int reg, unsigned int value, StackType t)
+        {
+            a.StoreImm(payload(reg), value);
+            a.StoreImm(typeWord(reg), StackVal::RawTypeWord(t));
+        };
+        auto storeEax = [&](int reg, StackType t)
+        {
+            a.Store(payload(reg), Assembler::Eax);
+            a.StoreImm(typeWord(reg), StackVal::RawTypeWord(t));
+        };
+        auto copyValue = [&](int srcBase, int srcDisp, int destBase, int destDisp)
+        {
+            for (int offset = 0; offset < (int)sizeof(StackVal); offset += 8)
+            {
+                a.Load64(Assembler::Edx, srcBase, srcDisp + offset);
+                a.Store64(destBase, destDisp + offset, Assembler::Edx);
+            }
+        };
+        auto callVM = [&](const void* func, int arg1)
+        {
+            a.MovImm64(Assembler::Arg0, _vm);
+            a.MovImm64(Assembler::Arg1, (uint64_t)(int64_t)arg1);
+            a.CallAbs(func);
+        };
+
+        // Keeps the frame pointer in rbx, with the call keeping rsp aligned and reserving the Windows shadow space
+        a.Push(Assembler::Ebx);
+        a.SubRsp(32);
+        a.MovReg64(Assembler::Ebx, Assembler::Arg0);
+
+        for (const Instruction* ip = start; ip < end; ++ip)
+        {
+            labels[ip - start] = a.Size();
+            const int r0 = ip->reg0;
+            const int r1 = ip->reg1;
+            const int r2 = ip->reg2;
+
+            switch (ip->op)
+            {
+            case OpCode::LoadNull:
+                guardScalar(r0, ip);
+                for (int offset = 0; offset < (int)sizeof(StackVal); offset += 8)
+                {
+                    a.StoreImm64(slot(r0) + offset, 0);
+                }
+                break;
+
+            case OpCode::LoadTrue:
+            case OpCode::LoadFalse:
+                guardScalar(r0, ip);
+                storeScalar(r0, ip->op == OpCode::LoadTrue ? 1 : 0, StackType::Boolean);
+                break;
+
+            case OpCode::LoadInt:
+                guardScalar(r0, ip);
+                // Intentional fall through
+            case OpCode::LoadIntS:
+                storeScalar(r0, (unsigned int)ip->integer, StackType::Int);
+                break;
+
+            case OpCode::LoadFloat:
+                guardScalar(r0, ip);
+                storeScalar(r0, FloatBits(ip->fp), StackType::Float);
+                break;
+
+            case OpCode::LoadFunc:
+                guardScalar(r0, ip);
+                storeScalar(r0, ip->id, StackType::Func);
+                break;
+
+            case OpCode::Store:
+                {
+                    size_t destRef = jumpIfRefCounted(r0);
+                    size_t srcRef = jumpIfRefCounted(r1);
+                    copyValue(Assembler::Ebx, slot(r1), Assembler::Ebx, slot(r0));
+                    size_t done = a.Jmp();
+                    a.Patch(destRef, a.Size());
+                    a.Patch(srcRef, a.Size());
+                    a.Lea(Assembler::Arg0, slot(r1));
+                    a.Lea(Assembler::Arg1, slot(r0));
+                    a.CallAbs((const void*)&VM::JitCopy);
+                    a.Patch(done, a.Size());
+                }
+                break;
+
+            case OpCode::StoreS:
+                copyValue(Assembler::Ebx, slot(r1), Assembler::Ebx, slot(r0));
+                break;
+
+            case OpCode::Add: case OpCode::AddII:
+            case OpCode::Sub: case OpCode::SubII:
+            case OpCode::Mul: case OpCode::MulII:
+            case OpCode::AddS: case OpCode::AddIIS:
+            case OpCode::SubS: case OpCode::SubIIS:
+            case OpCode::MulS: case OpCode::MulIIS:
+                {
+                    TraceOp op = GetTraceOp(ip->op);
+                    guardType(r0, StackType::Int, ip);
+                    guardType(r1, StackType::Int, ip);
+                    if (ip->op == OpCode::Add || ip->op == OpCode::AddII || ip->op == OpCode::Sub || ip->op == OpCode::SubII || ip->op == OpCode::Mul || ip->op == OpCode::MulII)
+                    {
+                        guardScalar(r2, ip);
+                    }
+
+                    a.Load(Assembler::Eax, payload(r0));
+                    if (op == TraceOp::Add) a.Add(Assembler::Eax, payload(r1));
+                    else if (op == TraceOp::Sub) a.Sub(Assembler::Eax, payload(r1));
+                    else a.Imul(Assembler::Eax, payload(r1));
+                    storeEax(r2, StackType::Int);
+                }
+                break;
+
+            case OpCode::AddImm: case OpCode::AddImmI:
+            case OpCode::MulImm: case OpCode::MulImmI:
+            case OpCode::AddImmS: case OpCode::AddImmIS:
+            case OpCode::MulImmS: case OpCode::MulImmIS:
+                guardType(r0, StackType::Int, ip);
+                if (ip->op == OpCode::AddImm || ip->op == OpCode::AddImmI || ip->op == OpCode::MulImm || ip->op == OpCode::MulImmI)
+                {
+                    guardScalar(r2, ip);
+                }
+
+                a.Load(Assembler::Eax, payload(r0));
+                if (GetTraceOp(ip->op) == TraceOp::AddImm) a.AddRegImm(Assembler::Eax, ip->integer);
+                else a.ImulRegImm(Assembler::Eax, ip->integer);
+                storeEax(r2, StackType::Int);
+                break;
+
+            case OpCode::Inc: case OpCode::IncI: case OpCode::PostInc:
+            case OpCode::Dec: case OpCode::DecI: case OpCode::PostDec:
+                guardType(r0, StackType::Int, ip);
+                a.AddImm(payload(r0), GetTraceOp(ip->op) == TraceOp::Inc ? 1 : -1);
+                break;
+
+            case OpCode::Neg:
+                guardType(r0, StackType::Int, ip);
+                guardScalar(r1, ip);
+                a.Load(Assembler::Eax, payload(r0));
+                a.Neg(Assembler::Eax);
+                storeEax(r1, StackType::Int);
+                break;
+
+            case OpCode::Eq:
+            case OpCode::LT: case OpCode::LTII:
+            case OpCode::LTE: case OpCode::LTEII:
+            case OpCode::GT: case OpCode::GTII:
+            case OpCode::GTE: case OpCode::GTEII:
+                {
+                    TraceOp op = GetTraceOp(ip->op);
+                    guardType(r0, StackType::Int, ip);
+                    guardType(r1, StackType::Int, ip);
+                    guardScalar(r2, ip);
+                    a.Load(Assembler::Eax, payload(r0));
+                    a.Cmp(Assembler::Eax, payload(r1));
+                    a.Setcc(op == TraceOp::Eq ? Cond::Equal : op == TraceOp::LT ? Cond::Less : op == TraceOp::LTE ? Cond::LessEq : op == TraceOp::GT ? Cond::Greater : Cond::GreaterEq, Assembler::Eax);
+                    a.MovzxEaxAl();
+                    storeEax(r2, StackType::Boolean);
+                }
+                break;
+
+            case OpCode::BrT:
+            case OpCode::BrF:
+                guardType(r0, StackType::Boolean, ip);
+                a.CmpImm(payload(r0), ip->op == OpCode::BrT ? 1 : 0);
+                branches.push_back(std::make_pair(a.Jcc(Cond::Equal), ip->target));
+                break;
+
+            case OpCode::BrLT: case OpCode::BrLTII:
+            case OpCode::BrLTE: case OpCode::BrLTEII:
+            case OpCode::BrGT: case OpCode::BrGTII:
+            case OpCode::BrGTE: case OpCode::BrGTEII:
+                {
+                    TraceOp op = GetTraceOp(ip->op);
+                    guardType(r0, StackType::Int, ip);
+                    guardType(r1, StackType::Int, ip);
+                    a.Load(Assembler::Eax, payload(r0));
+                    a.Cmp(Assembler::Eax, payload(r1));
+                    Cond cc = op == TraceOp::BrLT ? Cond::Less : op == TraceOp::BrLTE ? Cond::LessEq : op == TraceOp::BrGT ? Cond::Greater : Cond::GreaterEq;
+                    branches.push_back(std::make_pair(a.Jcc(cc), ip->target));
+                }
+                break;
+
+            case OpCode::Jmp:
+                branches.push_back(std::make_pair(a.Jmp(), ip->target));
+                break;
+
+            case OpCode::Push:
+                {
+                    // The interpreter grows the stack or raises the overflow
+                    a.MovImm64(Assembler::Ecx, &_vm->_stackPointer);
+                    a.Load64(Assembler::Eax, Assembler::Ecx, 0);
+                    a.MovImm64(Assembler::Edx, &_vm->_stackLimit);
+                    a.Load64(Assembler::Edx, Assembler::Edx, 0);
+                    a.CmpReg64(Assembler::Eax, Assembler::Edx);
+                    exitIf(Cond::AboveEq, ip);
+
+                    size_t ref = jumpIfRefCounted(r0);
+                    copyValue(Assembler::Ebx, slot(r0), Assembler::Eax, 0);
+                    size_t done = a.Jmp();
+                    a.Patch(ref, a.Size());
+                    a.Lea(Assembler::Arg0, slot(r0));
+                    a.MovReg64(Assembler::Arg1, Assembler::Eax);
+                    a.CallAbs((const void*)&VM::JitBlindCopy);
+                    a.Patch(done, a.Size());
+                    a.MovImm64(Assembler::Ecx, &_vm->_stackPointer);
+                    a.AddImm64(Assembler::Ecx, 0, (int)sizeof(StackObj));
+                }
+                break;
+
+            case OpCode::PushN:
+                {
+                    // The interpreter grows the stack or raises the overflow
+                    a.MovImm64(Assembler::Ecx, &_vm->_stackPointer);
+                    a.Load64(Assembler::Eax, Assembler::Ecx, 0);
+                    a.MovImm64(Assembler::Edx, &_vm->_stackLimit);
+                    a.Load64(Assembler::Edx, Assembler::Edx, 0);
+                    a.Lea64(Assembler::Edx, Assembler::Edx, -r0 * (int)sizeof(StackObj));
+                    a.CmpReg64(Assembler::Eax, Assembler::Edx);
+                    exitIf(Cond::Above, ip);
+
+                    a.MovImm64(Assembler::Edx, (uint64_t)0);
+                    for (int arg = 0; arg < r0; ++arg)
+                    {
+                        for (int offset = 0; offset < (int)sizeof(StackVal); offset += 8)
+                        {
+                            a.Store64(Assembler::Eax, arg * (int)sizeof(StackObj) + offset, Assembler::Edx);
+                        }
+                    }
+                    a.AddImm64(Assembler::Ecx, 0, r0 * (int)sizeof(StackObj));
+                }
+                break;
+
+            case OpCode::Call:
+                // Callees that are not compiled, externals and errors are left to the interpreter. A callee that
+                // returns anywhere but the next instruction exited to the interpreter, so this call does too.
+                guardType(r0, StackType::Func, ip);
+                a.MovImm64(Assembler::Arg0, _vm);
+                a.Load(Assembler::Arg1, payload(r0));
+                a.MovImm64(Assembler::Arg2, ip);
+                a.CallAbs((const void*)&VM::JitCall);
+                a.MovImm64(Assembler::Edx, ip + 1);
+                a.CmpReg64(Assembler::Eax, Assembler::Edx);
+                epilogueJumps.push_back(a.Jcc(Cond::NotEqual));
+                break;
+
+            case OpCode::CallDirect:
+                a.MovImm64(Assembler::Arg0, _vm);
+                a.MovImm64(Assembler::Arg1, (uint64_t)ip->id);
+                a.MovImm64(Assembler::Arg2, ip);
+                a.CallAbs((const void*)&VM::JitCall);
+                a.MovImm64(Assembler::Edx, ip + 1);
+                a.CmpReg64(Assembler::Eax, Assembler::Edx);
+                epilogueJumps.push_back(a.Jcc(Cond::NotEqual));
+                break;
+
+            case OpCode::Ret:
+                callVM((const void*)&VM::JitRet, r0);
+                epilogueJumps.push_back(a.Jmp());
+                break;
+
+            case OpCode::TailCall:
+                // Recursion in tail position loops back to the start in the same frame, other callees are
+                // left to the interpreter
+                if (ip->id != funcId)
+                {
+                    exits.push_back(std::make_pair(a.Jmp(), ip));
+                    break;
+                }
+                a.MovImm64(Assembler::Arg0, _vm);
+                a.MovImm64(Assembler::Arg1, ip);
+                a.CallAbs((const void*)&VM::JitTailCall);
+                branches.push_back(std::make_pair(a.Jmp(), start));
+                break;
+
+            default:
+                exits.push_back(std::make_pair(a.Jmp(), ip));
+                break;
+            }
+        }
+
+        // Falling off the end is left to the interpreter too
+        exits.push_back(std::make_pair(a.Jmp(), end));
+
+        for (auto& branch : branches)
+        {
+            if (branch.second < start || branch.second >= end)
+            {
+                return false;
+            }
+
+            a.Patch(branch.first, labels[branch.second - start]);
+        }
+
+        std::map<const Instruction*, size_t> exitStubs;
+        for (auto& exit : exits)
+        {
+            auto stub = exitStubs.find(exit.second);
+            if (stub == exitStubs.end())
+            {
+                stub = exitStubs.insert(std::make_pair(exit.second, a.Size())).first;
+                a.MovImm64(Assembler::Eax, exit.second);
+                epilogueJumps.push_back(a.Jmp());
+            }
+
+            a.Patch(exit.first, stub->second);
+        }
+
+        for (size_t jump : epilogueJumps)
+        {
+            a.Patch(jump, a.Size());
+        }
+
+        a.AddRsp(32);
+        a.Pop(Assembler::Ebx);
+        a.Ret();
+
+        void* memory = AllocateExecutable(a.GetCode());
+        if (memory == nullptr)
+        {
+            return false;
+        }
+
+        method->func = reinterpret_cast<MethodFunc>(memory);
+        method->memory = memory;
+        method->memorySize = a.GetCode().size();
+        return true;
+    }
+}
+
+#endif
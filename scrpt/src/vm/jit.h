@@ -0,0 +1,102 @@
+#pragma once
+
+#if SCRPT_JIT
+#if !(defined(_M_X64) || defined(__x86_64__))
+#error "SCRPT_JIT requires an x86-64 target"
+#endif
+
+namespace scrpt
+{
+    // Tracing JIT for hot loops. The VM reports every taken backward branch. Once a loop header is hot the
+    // next iteration is recorded instruction by instruction along with the register types it observed. If the
+    // iteration only used numeric ops on type stable registers it is compiled to x86-64 and run natively
+    // whenever the loop branches back to that header, leaving through a side exit wherever the types or
+    // branch directions no longer match the recording. The interpreter remains the reference semantics.
+    class Jit
+    {
+    public:
+        Jit(const Instruction* code, size_t nInstructions);
+        ~Jit();
+
+        // Called for each taken backward branch. Runs the loop's trace when one is compiled and returns the
+        // instruction the interpreter resumes at, otherwise returns the header. Sets record when the loop has
+        // just become hot and the interpreter should start calling Record.
+        const Instruction* OnLoop(const Instruction* header, StackObj* framePointer, bool* record);
+
+        // Called before each instruction executes while recording. Returns false once recording is over.
+        bool Record(const Instruction* ip, const StackObj* framePointer);
+
+        // Drops a recording left unfinished, e.g. when the recorded code threw
+        void CancelRecording();
+
+    private:
+        typedef unsigned int(*TraceFunc)(StackObj* framePointer);
+
+        struct Trace
+        {
+            ~Trace();
+
+            TraceFunc func;
+            void* memory;
+            size_t memorySize;
+            std::vector<const Instruction*> exits;
+        };
+
+        struct LoopState
+        {
+            unsigned int count;
+            unsigned int attempts;
+            unsigned int guardFailures;
+            std::unique_ptr<Trace> trace;
+        };
+
+        struct RecordedOp
+        {
+            const Instruction* ip;
+            StackType types[3];
+        };
+
+        void StopRecording(bool compile);
+        Trace* Compile() const;
+
+        const Instruction* _code;
+        std::vector<LoopState> _loops;
+        const Instruction* _recordingHeader;
+        std::vector<RecordedOp> _recording;
+    };
+
+    // Baseline method JIT. Once a function has been called enough times its whole body is compiled by stitching
+    // together a machine code template for each instruction. Compiled code keeps values in the same registers and
+    // stack frames as the interpreter so either can call or return into the other. Templates only handle the
+    // scalar and Int cases inline, anything else exits to the interpreter at that instruction, which then runs
+    // the rest of the call.
+    class MethodJit
+    {
+    public:
+        // Runs a compiled function in the frame Call pushed for it. Returns the instruction the interpreter
+        // continues at, or null when the entry frame returned.
+        typedef const Instruction* (*MethodFunc)(StackObj* framePointer);
+
+        MethodJit(VM* vm);
+        ~MethodJit();
+
+        // Counts a call to a scripted function, compiling it once hot. Returns null while it is interpreted.
+        MethodFunc GetMethod(unsigned int funcId);
+
+    private:
+        struct Method
+        {
+            unsigned int calls;
+            bool failed;
+            MethodFunc func;
+            void* memory;
+            size_t memorySize;
+        };
+
+        bool Compile(unsigned int funcId, Method* method);
+
+        VM* _vm;
+        std::vector<Method> _methods;
+    };
+}
+#endif
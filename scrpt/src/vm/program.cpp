@@ -0,0 +1,276 @@
+#include "../scrpt.h"
+
+#define COMPONENTNAME "Program"
+
+namespace scrpt
+{
+    Program::Program(Bytecode&& bytecode)
+        : _bytecode(std::move(bytecode))
+        , _bytecodeData(_bytecode.data.data())
+        , _bytecodeSize(_bytecode.data.size())
+    {
+        for (const std::string& str : _bytecode.strings)
+        {
+            _bytecodeStrings.push_back(str.c_str());
+        }
+
+        this->Prepare();
+    }
+
+    Program::Program(BytecodeImage&& image, std::unique_ptr<MappedFile>&& file)
+        : _image(std::move(file))
+        , _bytecodeData(image.data)
+        , _bytecodeSize(image.dataSize)
+        , _bytecodeStrings(std::move(image.strings))
+    {
+        AssertNotNull(_image.get());
+
+        _bytecode.functions = std::move(image.functions);
+        this->Prepare();
+    }
+
+    Bytecode Program::GetBytecode() const
+    {
+        if (_image.get() == nullptr)
+        {
+            return _bytecode;
+        }
+
+        Bytecode bytecode = _bytecode;
+        bytecode.data.assign(_bytecodeData, _bytecodeData + _bytecodeSize);
+        bytecode.strings.assign(_bytecodeStrings.begin(), _bytecodeStrings.end());
+        return bytecode;
+    }
+
+    bool Program::FindFunction(const char* name, unsigned int* id) const
+    {
+        AssertNotNull(name);
+        AssertNotNull(id);
+
+        auto funcIter = _functionMap.find(name);
+        if (funcIter == _functionMap.end())
+        {
+            return false;
+        }
+
+        *id = funcIter->second;
+        return true;
+    }
+
+    const FunctionData& Program::GetFunction(unsigned int id) const
+    {
+        return _bytecode.functions[id];
+    }
+
+    const FunctionData* Program::GetFunctions() const
+    {
+        return _bytecode.functions.data();
+    }
+
+    size_t Program::GetFunctionCount() const
+    {
+        return _bytecode.functions.size();
+    }
+
+    const FunctionData& Program::LookupFunction(unsigned int offset) const
+    {
+        Assert(_bytecode.functions.size() > 0, "Cannot perform lookup with no functions");
+
+        for (size_t idx = 0; idx < _bytecode.functions.size() - 1; ++idx)
+        {
+            if (_bytecode.functions[idx].entry <= offset && _bytecode.functions[idx + 1].entry > offset)
+            {
+                return _bytecode.functions[idx];
+            }
+        }
+
+        return _bytecode.functions.back();
+    }
+
+    const Instruction* Program::GetInstructions() const
+    {
+        return &_instructions[0];
+    }
+
+    size_t Program::GetInstructionCount() const
+    {
+        return _instructions.size();
+    }
+
+    const std::vector<const Instruction*>& Program::GetEntries() const
+    {
+        return _functionEntries;
+    }
+
+    unsigned int Program::GetBytecodeOffset(const Instruction* ip) const
+    {
+        AssertNotNull(ip);
+        return _instructionOffsets[ip - &_instructions[0]];
+    }
+
+    // Builds the function lookup and the decoded instructions that execution works from
+    void Program::Prepare()
+    {
+        for (unsigned int id = 0; id < _bytecode.functions.size(); ++id)
+        {
+            _functionMap[_bytecode.functions[id].name] = id;
+        }
+
+        this->Decode();
+    }
+
+    void Program::Decode()
+    {
+        const unsigned char* data = _bytecodeData;
+        const size_t nBytes = _bytecodeSize;
+
+        // First pass validates the packed stream and maps each instruction's bytecode location to its index
+        std::vector<unsigned int> offsetToIndex(nBytes + 1, 0xFFFFFFFF);
+        _instructionOffsets.clear();
+        for (size_t offset = 0; offset < nBytes; )
+        {
+            if (data[offset] >= (unsigned char)OpCode::__FirstQuickened)
+            {
+                throw CreateEx("Invalid opcode in bytecode", Err::VM_InvalidBytecode);
+            }
+
+            size_t size = GetOpSize((OpCode)data[offset]);
+            if (offset + size > nBytes)
+            {
+                throw CreateEx("Truncated instruction in bytecode", Err::VM_InvalidBytecode);
+            }
+
+            offsetToIndex[offset] = (unsigned int)_instructionOffsets.size();
+            _instructionOffsets.push_back((unsigned int)offset);
+            offset += size;
+        }
+
+        // Execution falling off the end, or a jump to the very end, lands on an Unknown op and errors out
+        offsetToIndex[nBytes] = (unsigned int)_instructionOffsets.size();
+        _instructionOffsets.push_back((unsigned int)nBytes);
+
+        // Second pass decodes operands. Sized up front as jump targets point into the array.
+        // Value initialized, so the trailing instruction is an Unknown op with zero operands
+        _instructions = std::vector<Instruction>(_instructionOffsets.size());
+        auto resolveTarget = [&](unsigned int target) -> const Instruction*
+        {
+            if (target > nBytes || offsetToIndex[target] == 0xFFFFFFFF)
+            {
+                throw CreateEx("Jump target is not an instruction", Err::VM_InvalidBytecode);
+            }
+
+            return &_instructions[offsetToIndex[target]];
+        };
+
+        for (size_t index = 0; index + 1 < _instructions.size(); ++index)
+        {
+            const unsigned char* raw = &data[_instructionOffsets[index]];
+            Instruction& inst = _instructions[index];
+            inst.op = (OpCode)raw[0];
+            inst.target = nullptr;
+
+            switch (GetOpLayout(inst.op))
+            {
+            case OpLayout::None:
+                break;
+            case OpLayout::RegRegReg:
+            case OpLayout::RegCharReg:
+                inst.reg2 = *(const char*)(raw + 3);
+                // Intentional fall through
+            case OpLayout::RegReg:
+                inst.reg1 = *(const char*)(raw + 2);
+                // Intentional fall through
+            case OpLayout::Reg:
+                inst.reg0 = *(const char*)(raw + 1);
+                break;
+            case OpLayout::RegInt:
+                inst.reg0 = *(const char*)(raw + 1);
+                memcpy(&inst.integer, raw + 2, sizeof(int));
+                break;
+            case OpLayout::RegFloat:
+                inst.reg0 = *(const char*)(raw + 1);
+                memcpy(&inst.fp, raw + 2, sizeof(float));
+                break;
+            case OpLayout::RegUInt:
+                inst.reg0 = *(const char*)(raw + 1);
+                memcpy(&inst.id, raw + 2, sizeof(unsigned int));
+                break;
+            case OpLayout::RegTarget:
+                {
+                    unsigned int target;
+                    memcpy(&target, raw + 2, sizeof(unsigned int));
+                    inst.reg0 = *(const char*)(raw + 1);
+                    inst.target = resolveTarget(target);
+                }
+                break;
+            case OpLayout::RegRegTarget:
+                {
+                    unsigned int target;
+                    memcpy(&target, raw + 3, sizeof(unsigned int));
+                    inst.reg0 = *(const char*)(raw + 1);
+                    inst.reg1 = *(const char*)(raw + 2);
+                    inst.target = resolveTarget(target);
+                }
+                break;
+            case OpLayout::RegIntReg:
+                inst.reg0 = *(const char*)(raw + 1);
+                memcpy(&inst.integer, raw + 2, sizeof(int));
+                inst.reg2 = *(const char*)(raw + 6);
+                break;
+            case OpLayout::Char:
+                inst.reg0 = *(const char*)(raw + 1);
+                break;
+            case OpLayout::UIntCharReg:
+            case OpLayout::UIntCharChar:
+                memcpy(&inst.id, raw + 1, sizeof(unsigned int));
+                inst.reg1 = *(const char*)(raw + 5);
+                inst.reg2 = *(const char*)(raw + 6);
+                break;
+            case OpLayout::Target:
+                {
+                    unsigned int target;
+                    memcpy(&target, raw + 1, sizeof(unsigned int));
+                    inst.target = resolveTarget(target);
+                }
+                break;
+            }
+
+            // Resolve table lookups up front
+            if (inst.op == OpCode::LoadString)
+            {
+                if (inst.id >= _bytecodeStrings.size())
+                {
+                    throw CreateEx("String id out of range", Err::VM_InvalidBytecode);
+                }
+                inst.string = _bytecodeStrings[inst.id];
+            }
+            else if (inst.op == OpCode::LoadFunc && inst.id >= _bytecode.functions.size())
+            {
+                throw CreateEx("Function id out of range", Err::VM_InvalidBytecode);
+            }
+            else if (inst.op == OpCode::CallDirect || inst.op == OpCode::TailCall)
+            {
+                // The compiler checked the arity, an image has to match too. The callee's register count rides
+                // in reg0 so the call doesn't go to the function table. A tail call's arguments have to fit in
+                // the slots of the frame it reuses.
+                if (inst.id >= _bytecode.functions.size())
+                {
+                    throw CreateEx("Function id out of range", Err::VM_InvalidBytecode);
+                }
+                const FunctionData& fd = _bytecode.functions[inst.id];
+                if (fd.nParam != inst.reg1 || fd.nLocalRegisters > 256 ||
+                    (inst.op == OpCode::TailCall && (fd.external || inst.reg1 > inst.reg2)))
+                {
+                    throw CreateEx("Direct call doesn't match its function", Err::VM_InvalidBytecode);
+                }
+                inst.reg0 = (short)fd.nLocalRegisters;
+            }
+        }
+
+        _functionEntries.clear();
+        for (const FunctionData& fd : _bytecode.functions)
+        {
+            _functionEntries.push_back(fd.external ? nullptr : resolveTarget(fd.entry));
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+namespace scrpt
+{
+    // Compiled or loaded bytecode together with everything decoded from it up front, the function table and the
+    // instructions the interpreter runs. A program is immutable once built and is shared between VMs, so running
+    // a script in another VM only costs that VM's stack, and VMs on different threads can run it at once. The one
+    // exception is quickening, which rewrites opcodes in place to their type specialized form. Every quickened op
+    // checks its operands and falls back to the generic form, so a rewrite made by one VM is always safe for another.
+    class Program
+    {
+    public:
+        explicit Program(Bytecode&& bytecode);
+        // Runs from a mapped image without copying it out. Its externs must already be bound.
+        Program(BytecodeImage&& image, std::unique_ptr<MappedFile>&& file);
+
+        // Copy of the bytecode for the tools that take one, expanded out of the image when loaded from one
+        Bytecode GetBytecode() const;
+
+        bool FindFunction(const char* name, unsigned int* id) const;
+        const FunctionData& GetFunction(unsigned int id) const;
+        const FunctionData* GetFunctions() const;
+        size_t GetFunctionCount() const;
+        const FunctionData& LookupFunction(unsigned int offset) const;
+
+        const Instruction* GetInstructions() const;
+        size_t GetInstructionCount() const;
+        // Instruction each function starts at, null for externs
+        const std::vector<const Instruction*>& GetEntries() const;
+        unsigned int GetBytecodeOffset(const Instruction* ip) const;
+
+    private:
+        Program(const Program&) = delete;
+        Program& operator=(const Program&) = delete;
+
+        void Prepare();
+        void Decode();
+
+        Bytecode _bytecode;
+        // Packed code and string constants, either in _bytecode or left in place in a loaded image
+        std::unique_ptr<MappedFile> _image;
+        const unsigned char* _bytecodeData;
+        size_t _bytecodeSize;
+        std::vector<const char*> _bytecodeStrings;
+        std::map<std::string, unsigned int> _functionMap;
+        std::vector<Instruction> _instructions;
+        std::vector<unsigned int> _instructionOffsets;
+        std::vector<const Instruction*> _functionEntries;
+    };
+}
@@ -23,7 +23,26 @@ namespace scrpt
 
     struct StackRef
     {
-        unsigned int refCount;
+        explicit StackRef(void* value) : refCount(1), value(value), shared(false), arena(false), color(0), buffered(false) {}
+
+        // Counts a reference. Only the thread running the VM that made an unshared object ever touches it, so its
+        // count is updated with plain loads and stores and only shared objects pay for an atomic.
+        void AddRef()
+        {
+            if (shared) refCount.fetch_add(1, std::memory_order_relaxed);
+            else refCount.store(refCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        // Drops a reference, returning true when it was the last
+        bool RemoveRef()
+        {
+            if (shared) return refCount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+            unsigned int count = refCount.load(std::memory_order_relaxed) - 1;
+            refCount.store(count, std::memory_order_relaxed);
+            return count == 0;
+        }
+
+        std::atomic<unsigned int> refCount;
         union
         {
             void* value;
@@ -31,13 +50,92 @@ namespace scrpt
             List* list;
             Map* map;
         };
+        // Set by ShareValue before any other thread can see the object and never cleared
+        bool shared;
+        // Made during an Execute with the arena on, and freed with the rest of the arena rather than by its count
+        bool arena;
+        // Cycle collector state, see VM::CollectCycles. Buffered is set while the object is a candidate root.
+        unsigned char color;
+        bool buffered;
     };
 
+    // Values are read and written through accessors so the encoding can be swapped at build time.
+    // Defining SCRPT_PACKED_STACKVAL stores the type tag in the top byte of a single 64 bit word with
+    // the pointer or 32 bit scalar payload below it, halving the size of the stack and of list storage.
+#if SCRPT_PACKED_STACKVAL
+    struct StackVal
+    {
+        StackVal() : bits(0) {}
+        StackVal(StackType t, StackRef* r) { this->SetRef(t, r); }
+
+        StackType GetType() const { return static_cast<StackType>(bits >> TagShift); }
+        StackRef* GetRef() const { return reinterpret_cast<StackRef*>(bits & PayloadMask); }
+        const char* GetStaticString() const { return reinterpret_cast<const char*>(bits & PayloadMask); }
+        unsigned int GetId() const { return static_cast<unsigned int>(bits); }
+        int GetInt() const { return static_cast<int>(static_cast<unsigned int>(bits)); }
+        float GetFloat() const
+        {
+            unsigned int raw = static_cast<unsigned int>(bits);
+            float val;
+            memcpy(&val, &raw, sizeof(float));
+            return val;
+        }
+
+        void SetNull() { bits = 0; }
+        void SetRef(StackType t, StackRef* r) { this->SetPayload(t, reinterpret_cast<uintptr_t>(r)); }
+        void SetStaticString(const char* str) { this->SetPayload(StackType::StaticString, reinterpret_cast<uintptr_t>(str)); }
+        void SetInt(StackType t, int val) { this->SetPayload(t, static_cast<unsigned int>(val)); }
+        void SetFloat(float val)
+        {
+            unsigned int raw;
+            memcpy(&raw, &val, sizeof(float));
+            this->SetPayload(StackType::Float, raw);
+        }
+
+        // Raw layout for code that accesses values directly, such as the JIT. Scalars occupy the low 32 bits of
+        // the payload and the type is identified by a single 32 bit word.
+        static const size_t RawPayloadOffset = 0;
+        static const size_t RawTypeOffset = 4;
+        static unsigned int RawTypeWord(StackType t) { return static_cast<unsigned int>(t) << (TagShift - 32); }
+
+    private:
+        static const int TagShift = 56;
+        static const uint64_t PayloadMask = (uint64_t(1) << TagShift) - 1;
+
+        void SetPayload(StackType t, uint64_t payload)
+        {
+            bits = (static_cast<uint64_t>(t) << TagShift) | payload;
+        }
+
+        uint64_t bits;
+    };
+    static_assert(sizeof(StackVal) == 8, "Packed StackVal must fit in a single word");
+#else
     struct StackVal
     {
         StackVal() : type(StackType::Null), ref(nullptr) {}
         StackVal(StackType t, StackRef* r) : type(t), ref(r) {}
 
+        StackType GetType() const { return type; }
+        StackRef* GetRef() const { return ref; }
+        const char* GetStaticString() const { return staticString; }
+        unsigned int GetId() const { return id; }
+        int GetInt() const { return integer; }
+        float GetFloat() const { return fp; }
+
+        void SetNull() { type = StackType::Null; ref = nullptr; }
+        void SetRef(StackType t, StackRef* r) { type = t; ref = r; }
+        void SetStaticString(const char* str) { type = StackType::StaticString; staticString = str; }
+        void SetInt(StackType t, int val) { type = t; integer = val; }
+        void SetFloat(float val) { type = StackType::Float; fp = val; }
+
+        // Raw layout for code that accesses values directly, such as the JIT. Scalars occupy the low 32 bits of
+        // the payload and the type is identified by a single 32 bit word.
+        static const size_t RawPayloadOffset = sizeof(void*);
+        static const size_t RawTypeOffset = 0;
+        static unsigned int RawTypeWord(StackType t) { return static_cast<unsigned int>(t); }
+
+    private:
         StackType type;
         union
         {
@@ -48,6 +146,7 @@ namespace scrpt
             float fp;
         };
     };
+#endif
 
     struct StackFrame
     {
@@ -63,4 +162,8 @@ namespace scrpt
         StackVal v;
         StackFrame frame;
     };
+
+    // Makes a value safe to hand to VMs on other threads. Its object and everything reachable from it switch to atomic
+    // reference counts and can no longer be changed. Must be called before any other thread can see the value.
+    void ShareValue(StackVal* val);
 }
@@ -6,23 +6,23 @@ void ToString(scrpt::VM* vm, scrpt::StackVal* val, std::stringstream& ss)
 {
     AssertNotNull(val);
 
-    switch (val->type)
+    switch (val->GetType())
     {
     case scrpt::StackType::Null: ss << "<NULL>"; break;
-    case scrpt::StackType::Boolean: ss << (val->integer == 0 ? "false" : "true"); break;
-    case scrpt::StackType::Int: ss << val->integer; break;
-    case scrpt::StackType::Float: ss << val->fp; break;
+    case scrpt::StackType::Boolean: ss << (val->GetInt() == 0 ? "false" : "true"); break;
+    case scrpt::StackType::Int: ss << val->GetInt(); break;
+    case scrpt::StackType::Float: ss << val->GetFloat(); break;
     case scrpt::StackType::Func:
         {
-            auto& fd = vm->GetFunction(val->id);
+            auto& fd = vm->GetFunction(val->GetId());
             ss << "<" << fd.name << "/" << (int)fd.nParam << ">";
         }
         break;
-    case scrpt::StackType::DynamicString: ss << *val->ref->string; break;
-    case scrpt::StackType::StaticString: ss << val->staticString; break;
+    case scrpt::StackType::DynamicString: ss << *val->GetRef()->string; break;
+    case scrpt::StackType::StaticString: ss << val->GetStaticString(); break;
     case scrpt::StackType::List:
         {
-            scrpt::List* list = val->ref->list;
+            scrpt::List* list = val->GetRef()->list;
             ss << "[";
             bool showComma = false;
             for (auto item = list->begin(); item != list->end(); ++item)
@@ -37,7 +37,7 @@ void ToString(scrpt::VM* vm, scrpt::StackVal* val, std::stringstream& ss)
         break;
     case scrpt::StackType::Map:
         {
-            scrpt::Map* map = val->ref->map;
+            scrpt::Map* map = val->GetRef()->map;
             ss << "{";
             bool showComma = false;
             for (auto& entry : *map)
@@ -57,6 +57,38 @@ void ToString(scrpt::VM* vm, scrpt::StackVal* val, std::stringstream& ss)
     }
 }
 
+// Calls a script function of one argument for each of count indices on the worker pool. Each thread runs its calls
+// in a VM of its own made from the caller's program, and is handed each result along with its index.
+static void ParallelCall(scrpt::VM* vm, scrpt::StackVal* func, size_t count, const std::function<scrpt::StackVal(size_t)>& getArg,
+    const std::function<void(size_t, scrpt::VM*)>& useResult)
+{
+    if (func->GetType() != scrpt::StackType::Func)
+    {
+        throw scrpt::CreateEx("Expected a function", scrpt::Err::VM_UnexpectedParamType);
+    }
+
+    std::shared_ptr<const scrpt::Program> program = vm->GetProgram();
+    unsigned int funcId = func->GetId();
+
+    scrpt::WorkerPool& pool = scrpt::WorkerPool::Get();
+    std::vector<std::unique_ptr<scrpt::VM>> contexts(pool.GetParticipantCount());
+    pool.Run(count, [&](size_t begin, size_t end, unsigned int participant)
+    {
+        std::unique_ptr<scrpt::VM>& context = contexts[participant];
+        if (context.get() == nullptr)
+        {
+            context.reset(new scrpt::VM(program));
+        }
+
+        for (size_t idx = begin; idx < end; ++idx)
+        {
+            scrpt::StackVal arg = getArg(idx);
+            context->Execute(funcId, &arg, 1);
+            useResult(idx, context.get());
+        }
+    });
+}
+
 void scrpt::RegisterStdLib(VM& vm)
 {
     vm.AddExternFunc("print", 1, [](VM* vm) 
@@ -80,4 +112,41 @@ void scrpt::RegisterStdLib(VM& vm)
         List* list = vm->GetParam<List*>(scrpt::ParamId::_0);
         vm->SetExternResult(StackType::Int, (int)list->size());
     });
+
+    // A new list of func(item) for each item of a list, with the calls spread over every core. Items are copied into
+    // the VM that calls func for them, so func can't change the original list, except for shared ones that can't
+    // change anyway.
+    vm.AddExternFunc("parallel_map", 2, [](VM* vm)
+    {
+        const List* list = vm->GetParam<List*>(scrpt::ParamId::_0);
+        StackVal* func = vm->GetParam<StackVal*>(scrpt::ParamId::_1);
+
+        // Owned by the result before any call runs, so a failed call still frees the results gathered so far. Each
+        // call writes only its own item, so gathering needs no lock.
+        List* results = vm->SetExternListResult(list->size());
+        ParallelCall(vm, func, list->size(),
+            [&](size_t idx) { return (*list)[idx].v; },
+            [&](size_t idx, VM* context) { (*results)[idx].v = context->TakeResult(); });
+    });
+
+    // Shares a list or map, and everything in it, with the calls parallel_map and parallel_for make. They reference it
+    // rather than getting a copy, so it can be large. It can no longer be changed.
+    vm.AddExternFunc("share", 1, [](VM* vm)
+    {
+        ShareValue(vm->GetParam<StackVal*>(scrpt::ParamId::_0));
+        vm->SetExternResult(StackType::Null, 0);
+    });
+
+    // Calls func(index) for every index from 0 up to count, spread over every core, for calls made for their side
+    // effects through externs
+    vm.AddExternFunc("parallel_for", 2, [](VM* vm)
+    {
+        int count = vm->GetParam<int>(scrpt::ParamId::_0);
+        StackVal* func = vm->GetParam<StackVal*>(scrpt::ParamId::_1);
+
+        ParallelCall(vm, func, count > 0 ? (size_t)count : 0,
+            [](size_t idx) { StackVal arg; arg.SetInt(StackType::Int, (int)idx); return arg; },
+            [](size_t, VM*) {});
+        vm->SetExternResult(StackType::Null, 0);
+    });
 }
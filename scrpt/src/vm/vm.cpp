@@ -1,7 +1,30 @@
 #include "../scrpt.h"
 
 #define COMPONENTNAME "VM"
-#define STACKSIZE 10000
+// Stack slots committed up front and the default ceiling the stack grows to on demand
+#define INITIALSTACKSIZE 256
+#define MAXSTACKSIZE (1024 * 1024)
+
+// Compiled methods calling compiled methods nest on the native stack, deeper calls go back through the interpreter
+#define MAXJITCALLDEPTH 512
+
+// Lists and maps made between cycle collections in the middle of an Execute, unless set with SetCycleBudget
+#define CYCLEBUDGET 10000
+
+// Counts of each executed (previous op, op) pair across all VMs, used to pick superinstructions
+#if SCRPT_PROFILE_OPS
+static unsigned long long s_opPairCounts[(int)scrpt::OpCode::__Num][(int)scrpt::OpCode::__Num];
+#endif
+
+// Threaded dispatch jumps straight from one opcode handler to the next through a table of label
+// addresses instead of funneling every instruction through the single indirect branch of a switch.
+// It relies on the labels-as-values extension so MSVC builds, or any build defining
+// SCRPT_NO_THREADED_DISPATCH, use the switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(SCRPT_NO_THREADED_DISPATCH)
+#define SCRPT_THREADED_DISPATCH 1
+#else
+#define SCRPT_THREADED_DISPATCH 0
+#endif
 
 using namespace scrpt;
 
@@ -10,39 +33,514 @@ __forceinline bool IsRefCounted(StackType t)
 	return (t == StackType::DynamicString || t == StackType::List || t == StackType::Map);
 }
 
+static void Release(StackVal* val);
+static void PossibleRoot(StackVal* val);
+
+// A ref counted object's header and payload share one slab block, so making one costs no heap call
+struct RefBlock
+{
+    StackRef ref;
+    std::aligned_union<0, std::string, List, Map>::type payload;
+};
+typedef Slab<sizeof(RefBlock)> RefSlab;
+
+// Arena objects carry their type, as the arena tears them down without a value to read it from. Null until the
+// payload is built.
+struct ArenaBlock
+{
+    RefBlock block;
+    StackType type;
+};
+
+template<typename T> struct RefType;
+template<> struct RefType<std::string> { static const StackType type = StackType::DynamicString; };
+template<> struct RefType<List> { static const StackType type = StackType::List; };
+template<> struct RefType<Map> { static const StackType type = StackType::Map; };
+
+// Makes an object in the arena if there is one, otherwise in the slab
+template<typename T, typename... Args>
+static StackRef* NewRef(Arena* arena, Args&&... args)
+{
+    ArenaBlock* arenaBlock = nullptr;
+    RefBlock* block;
+    if (arena != nullptr)
+    {
+        arenaBlock = static_cast<ArenaBlock*>(arena->Allocate());
+        arenaBlock->type = StackType::Null;
+        block = &arenaBlock->block;
+    }
+    else
+    {
+        block = static_cast<RefBlock*>(RefSlab::Allocate());
+    }
+
+    T* payload;
+    try
+    {
+        payload = new (&block->payload) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        if (arenaBlock == nullptr) RefSlab::Free(block);
+        throw;
+    }
+
+    StackRef* ref = new (&block->ref) StackRef(payload);
+    if (arenaBlock != nullptr)
+    {
+        ref->arena = true;
+        arenaBlock->type = RefType<T>::type;
+    }
+    return ref;
+}
+
+template<typename T>
+static void Destroy(T* payload)
+{
+    payload->~T();
+}
+
+// The common non ref counted case stays a single inlined type check, keeping the recursive release out of line.
+// A list or map that is still referenced may now only be referenced from a cycle, so it becomes a candidate root for
+// the cycle collector.
 __forceinline void Deref(StackVal* val)
 {
 	AssertNotNull(val);
-	StackType type = val->type;
-	if (IsRefCounted(type))
+	if (IsRefCounted(val->GetType()))
 	{
-		StackRef* ref = val->ref;
-		ref->refCount -= 1;
-		if (ref->refCount == 0)
+        StackRef* ref = val->GetRef();
+		if (ref->RemoveRef())
 		{
-			switch (type)
-			{
-			case StackType::DynamicString: 
-                delete ref->string; 
-                break;
-			case StackType::List: 
-                for (auto& entry : *ref->list) Deref(&entry.v);
-                delete ref->list; 
-                break;
-            case StackType::Map:
-                for (auto& entry : *ref->map) Deref(&entry.second.v);
-                delete ref->map;
-                break;
-            default:
-                AssertFail("Unhandled ref type");
-			}
-			delete ref;
-			val->ref = nullptr;
-			val->type = StackType::Null;
+			Release(val);
 		}
+        else if (val->GetType() != StackType::DynamicString && !ref->buffered)
+        {
+            PossibleRoot(val);
+        }
 	}
 }
 
+// Colors of Bacon and Rajan's trial deletion, see VM::CollectCycles
+enum class CycleColor : unsigned char
+{
+    Black,  // In use, or not being looked at
+    Gray,   // Reachable from a candidate root, with the references from inside the candidates' graph taken off its count
+    White,  // Garbage, only referenced from inside the graph
+    Purple, // Candidate root
+};
+
+__forceinline CycleColor GetColor(const StackRef* ref)
+{
+    return static_cast<CycleColor>(ref->color);
+}
+
+__forceinline void SetColor(StackRef* ref, CycleColor color)
+{
+    ref->color = static_cast<unsigned char>(color);
+}
+
+// Root buffer of the VM running on this thread, null outside Execute
+static thread_local std::vector<StackVal>* t_cycleRoots = nullptr;
+
+// Free queue of the VM running on this thread, null outside Execute or when it frees synchronously
+static thread_local std::vector<StackVal>* t_freeQueue = nullptr;
+
+// Shared objects are left out as other threads use their counts, and arena objects as the arena frees them anyway
+static void PossibleRoot(StackVal* val)
+{
+    StackRef* ref = val->GetRef();
+    if (t_cycleRoots == nullptr || ref->shared || ref->arena)
+    {
+        return;
+    }
+
+    SetColor(ref, CycleColor::Purple);
+    ref->buffered = true;
+    t_cycleRoots->push_back(*val);
+}
+
+__forceinline bool IsCollectable(const StackVal& val)
+{
+    return (val.GetType() == StackType::List || val.GetType() == StackType::Map) && !val.GetRef()->shared && !val.GetRef()->arena;
+}
+
+// Calls func for each list and map in a container that can be part of a collectable cycle
+template<typename Func>
+static void ForEachCollectable(const StackVal& val, Func func)
+{
+    if (val.GetType() == StackType::List)
+    {
+        for (StackObj& entry : *val.GetRef()->list)
+        {
+            if (IsCollectable(entry.v)) func(entry.v);
+        }
+    }
+    else
+    {
+        for (auto& entry : *val.GetRef()->map)
+        {
+            if (IsCollectable(entry.second.v)) func(entry.second.v);
+        }
+    }
+}
+
+// The graph walks use a work list rather than recursion, so a deep structure can't overflow the native stack
+static void MarkGray(const StackVal& root, std::vector<StackVal>& work)
+{
+    if (GetColor(root.GetRef()) == CycleColor::Gray)
+    {
+        return;
+    }
+
+    SetColor(root.GetRef(), CycleColor::Gray);
+    work.push_back(root);
+    while (!work.empty())
+    {
+        StackVal val = work.back();
+        work.pop_back();
+        ForEachCollectable(val, [&](const StackVal& child)
+        {
+            child.GetRef()->RemoveRef();
+            if (GetColor(child.GetRef()) != CycleColor::Gray)
+            {
+                SetColor(child.GetRef(), CycleColor::Gray);
+                work.push_back(child);
+            }
+        });
+    }
+}
+
+static void ScanBlack(const StackVal& root, std::vector<StackVal>& work)
+{
+    SetColor(root.GetRef(), CycleColor::Black);
+    work.push_back(root);
+    while (!work.empty())
+    {
+        StackVal val = work.back();
+        work.pop_back();
+        ForEachCollectable(val, [&](const StackVal& child)
+        {
+            child.GetRef()->AddRef();
+            if (GetColor(child.GetRef()) != CycleColor::Black)
+            {
+                SetColor(child.GetRef(), CycleColor::Black);
+                work.push_back(child);
+            }
+        });
+    }
+}
+
+static void Scan(const StackVal& root, std::vector<StackVal>& work, std::vector<StackVal>& blackWork)
+{
+    work.push_back(root);
+    while (!work.empty())
+    {
+        StackVal val = work.back();
+        work.pop_back();
+        if (GetColor(val.GetRef()) != CycleColor::Gray)
+        {
+            continue;
+        }
+
+        // Still referenced from outside the graph, so it and everything it reaches is live
+        if (val.GetRef()->refCount.load(std::memory_order_relaxed) > 0)
+        {
+            ScanBlack(val, blackWork);
+            continue;
+        }
+
+        SetColor(val.GetRef(), CycleColor::White);
+        ForEachCollectable(val, [&](const StackVal& child) { work.push_back(child); });
+    }
+}
+
+static void CollectWhite(const StackVal& root, std::vector<StackVal>& garbage, std::vector<StackVal>& work)
+{
+    if (GetColor(root.GetRef()) != CycleColor::White || root.GetRef()->buffered)
+    {
+        return;
+    }
+
+    SetColor(root.GetRef(), CycleColor::Black);
+    work.push_back(root);
+    while (!work.empty())
+    {
+        StackVal val = work.back();
+        work.pop_back();
+        garbage.push_back(val);
+        ForEachCollectable(val, [&](const StackVal& child)
+        {
+            if (GetColor(child.GetRef()) == CycleColor::White && !child.GetRef()->buffered)
+            {
+                SetColor(child.GetRef(), CycleColor::Black);
+                work.push_back(child);
+            }
+        });
+    }
+}
+
+// Frees a member of a garbage cycle. Its references to other lists and maps were already taken off their counts by
+// the trial deletion, so only the references to everything else are dropped.
+static void FreeGarbage(StackVal* val)
+{
+    StackRef* ref = val->GetRef();
+    auto drop = [](StackVal* child) { if (!IsCollectable(*child)) Deref(child); };
+    if (val->GetType() == StackType::List)
+    {
+        for (StackObj& entry : *ref->list) drop(&entry.v);
+        Destroy(ref->list);
+    }
+    else
+    {
+        for (auto& entry : *ref->map) drop(&entry.second.v);
+        Destroy(ref->map);
+    }
+
+    ref->~StackRef();
+    RefSlab::Free(ref);
+}
+
+// Gives back the block of an object whose payload is gone
+static void FreeRef(StackRef* ref)
+{
+    // A candidate root stays in the root buffer until the collector gets to it and frees it there
+    if (ref->buffered)
+    {
+        SetColor(ref, CycleColor::Black);
+    }
+    else
+    {
+        // The header starts its block
+        ref->~StackRef();
+        RefSlab::Free(ref);
+    }
+}
+
+// Frees the payload of a ref counted value whose count has reached zero. While a VM defers freeing, a list or map
+// that still holds anything goes on its free queue instead, see DrainFreeQueue.
+static void Release(StackVal* val)
+{
+	StackType type = val->GetType();
+	StackRef* ref = val->GetRef();
+    if (ref->arena)
+    {
+        val->SetNull();
+        return;
+    }
+
+	switch (type)
+	{
+	case StackType::DynamicString: 
+        Destroy(ref->string);
+        break;
+	case StackType::List: 
+        if (t_freeQueue != nullptr && !ref->list->empty())
+        {
+            t_freeQueue->push_back(*val);
+            val->SetNull();
+            return;
+        }
+        for (auto& entry : *ref->list) Deref(&entry.v);
+        Destroy(ref->list);
+        break;
+    case StackType::Map:
+        if (t_freeQueue != nullptr && !ref->map->empty())
+        {
+            t_freeQueue->push_back(*val);
+            val->SetNull();
+            return;
+        }
+        for (auto& entry : *ref->map) Deref(&entry.second.v);
+        Destroy(ref->map);
+        break;
+    default:
+        AssertFail("Unhandled ref type");
+	}
+
+    FreeRef(ref);
+	val->SetNull();
+}
+
+// Frees queued objects until budget entries and objects have been dropped or the queue is empty. The newest object
+// is taken apart first, one entry at a time from the back of a list or the front of a map, and its block is given
+// back once it is empty. A dropped entry that dies goes on top of the queue, so a structure is freed depth first from
+// the heap rather than the native stack, and however big or deep it is each call only does a bounded amount of work.
+static void DrainFreeQueue(std::vector<StackVal>& queue, size_t budget)
+{
+    while (budget > 0 && !queue.empty())
+    {
+        --budget;
+        StackVal val = queue.back();
+        StackRef* ref = val.GetRef();
+        if (val.GetType() == StackType::List)
+        {
+            if (!ref->list->empty())
+            {
+                StackVal entry = ref->list->back().v;
+                ref->list->pop_back();
+                Deref(&entry);
+                continue;
+            }
+            Destroy(ref->list);
+        }
+        else
+        {
+            if (!ref->map->empty())
+            {
+                StackVal entry = ref->map->begin()->second.v;
+                ref->map->erase(ref->map->begin());
+                Deref(&entry);
+                continue;
+            }
+            Destroy(ref->map);
+        }
+
+        queue.pop_back();
+        FreeRef(ref);
+    }
+}
+
+// Deep copies a value owned outside the VM. An object reached more than once, including through a cycle, is copied
+// once and the copy shared the same way. Shared objects can't change and are referenced rather than copied.
+static void CloneValue(const StackVal& src, StackVal* dest, Arena* arena, std::unordered_map<StackRef*, StackRef*>& clones)
+{
+    AssertNotNull(dest);
+
+    if (!IsRefCounted(src.GetType()))
+    {
+        *dest = src;
+        return;
+    }
+
+    if (src.GetRef()->shared)
+    {
+        src.GetRef()->AddRef();
+        *dest = src;
+        return;
+    }
+
+    auto clone = clones.find(src.GetRef());
+    if (clone != clones.end())
+    {
+        clone->second->AddRef();
+        dest->SetRef(src.GetType(), clone->second);
+        return;
+    }
+
+    StackRef* ref;
+    switch (src.GetType())
+    {
+    case StackType::DynamicString:
+        ref = NewRef<std::string>(arena, *src.GetRef()->string);
+        break;
+    case StackType::List:
+        ref = NewRef<List>(arena, src.GetRef()->list->size());
+        break;
+    case StackType::Map:
+        ref = NewRef<Map>(arena);
+        break;
+    default:
+        AssertFail("Unhandled ref type");
+        return;
+    }
+
+    clones[src.GetRef()] = ref;
+    dest->SetRef(src.GetType(), ref);
+    switch (src.GetType())
+    {
+    case StackType::List:
+        {
+            const List& list = *src.GetRef()->list;
+            for (size_t idx = 0; idx < list.size(); ++idx)
+            {
+                CloneValue(list[idx].v, &(*ref->list)[idx].v, arena, clones);
+            }
+        }
+        break;
+    case StackType::Map:
+        for (auto& entry : *src.GetRef()->map)
+        {
+            CloneValue(entry.second.v, &(*ref->map)[entry.first].v, arena, clones);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Moves the arena objects reachable from a value out to the slab, so they outlive the arena. An object reached more
+// than once is moved once and the moved object shared the same way. Objects outside the arena stay where they are,
+// but a script can store arena objects in them, so their contents are promoted in place.
+static void Promote(StackVal* val, std::unordered_map<StackRef*, StackRef*>& promoted)
+{
+    AssertNotNull(val);
+
+    if (!IsRefCounted(val->GetType()))
+    {
+        return;
+    }
+
+    StackRef* ref = val->GetRef();
+    auto found = promoted.find(ref);
+    if (found != promoted.end())
+    {
+        if (found->second != ref)
+        {
+            found->second->AddRef();
+            val->SetRef(val->GetType(), found->second);
+        }
+        return;
+    }
+
+    // The payload is moved rather than copied, the arena object is about to be torn down
+    StackRef* target = ref;
+    if (ref->arena)
+    {
+        switch (val->GetType())
+        {
+        case StackType::DynamicString:
+            target = NewRef<std::string>(nullptr, std::move(*ref->string));
+            break;
+        case StackType::List:
+            target = NewRef<List>(nullptr, std::move(*ref->list));
+            break;
+        case StackType::Map:
+            target = NewRef<Map>(nullptr, std::move(*ref->map));
+            break;
+        default:
+            AssertFail("Unhandled ref type");
+        }
+        target->shared = ref->shared;
+        val->SetRef(val->GetType(), target);
+    }
+    promoted[ref] = target;
+
+    switch (val->GetType())
+    {
+    case StackType::List:
+        for (auto& entry : *target->list) Promote(&entry.v, promoted);
+        break;
+    case StackType::Map:
+        for (auto& entry : *target->map) Promote(&entry.second.v, promoted);
+        break;
+    default:
+        break;
+    }
+}
+
+// Drops a reference held by an arena object as the arena is torn down. References to other arena objects are skipped,
+// every one of them is torn down anyway.
+__forceinline void DerefOutsideArena(StackVal* val)
+{
+    if (IsRefCounted(val->GetType()) && !val->GetRef()->arena)
+    {
+        Deref(val);
+    }
+}
+
+// Debug check that a register BytecodeGen marked as scalar only never holds a ref counted value
+#define VERIFYSCALAR(Val) Assert(!IsRefCounted((Val).GetType()), "Scalar only register holds a ref counted value")
+
 // Does not dereference the destination location
 __forceinline void BlindCopy(StackObj* src, StackObj* dest)
 {
@@ -51,11 +549,10 @@ __forceinline void BlindCopy(StackObj* src, StackObj* dest)
 
 	StackVal& destVal = dest->v;
 	StackVal& srcVal = src->v;
-	destVal.type = srcVal.type;
-	destVal.ref = srcVal.ref;
-	if (IsRefCounted(destVal.type))
+	destVal = srcVal;
+	if (IsRefCounted(destVal.GetType()))
 	{
-		++destVal.ref->refCount;
+		destVal.GetRef()->AddRef();
 	}
 }
 
@@ -68,11 +565,10 @@ __forceinline void Copy(StackObj* src, StackObj* dest)
 	StackVal& destVal = dest->v;
 	StackVal& srcVal = src->v;
 	Deref(&destVal);
-	destVal.type = srcVal.type;
-	destVal.ref = srcVal.ref;
-	if (IsRefCounted(destVal.type))
+	destVal = srcVal;
+	if (IsRefCounted(destVal.GetType()))
 	{
-		++destVal.ref->refCount;
+		destVal.GetRef()->AddRef();
 	}
 }
 
@@ -81,10 +577,8 @@ __forceinline void BlindMove(StackObj* src, StackObj* dest)
     AssertNotNull(src);
     AssertNotNull(dest);
 
-    dest->v.type = src->v.type;
-    dest->v.ref = src->v.ref;
-    src->v.type = StackType::Null;
-    src->v.ref = nullptr;
+    dest->v = src->v;
+    src->v.SetNull();
 }
 
 __forceinline void Move(StackObj* src, StackObj* dest)
@@ -93,10 +587,8 @@ __forceinline void Move(StackObj* src, StackObj* dest)
 	AssertNotNull(dest);
 
 	Deref(&dest->v);
-	dest->v.type = src->v.type;
-	dest->v.ref = src->v.ref;
-	src->v.type = StackType::Null;
-	src->v.ref = nullptr;
+	dest->v = src->v;
+	src->v.SetNull();
 }
 
 #define POP1 \
@@ -107,12 +599,18 @@ __forceinline void Move(StackObj* src, StackObj* dest)
 	} \
 	_stackPointer -= 1; \
 	Deref(&_stackPointer->v); \
-	_stackPointer->v.type = StackType::Null; \
-	_stackPointer->v.ref = nullptr; \
+	_stackPointer->v.SetNull(); \
 }
 
 #define POP2 POP1 POP1
 
+// Stack frame slots do not hold values so they are cleared without a deref
+#define POPFRAME \
+{ \
+	_stackPointer -= 1; \
+	_stackPointer->v.SetNull(); \
+}
+
 #define POPN(N) \
 { \
 	int num = (N); \
@@ -122,30 +620,103 @@ __forceinline void Move(StackObj* src, StackObj* dest)
 	} \
 }
 
-#define REG0 *((char*)(data + _ip + 1))
-#define REG1 *((char*)(data + _ip + 2))
-#define REG2 *((char*)(data + _ip + 3))
+#define OPCODE (_ip->op.load(std::memory_order_relaxed))
+#define REG0 (_ip->reg0)
+#define REG1 (_ip->reg1)
+#define REG2 (_ip->reg2)
 
-#define CHECKSTACK if (_stackPointer - &_stack[0] >= STACKSIZE) this->ThrowErr(Err::VM_StackOverflow);
+#define CHECKSTACK if (_stackPointer >= _stackLimit) this->GrowStack(1);
 
 namespace scrpt
 {
+    // Sends the candidate roots found on this thread to a VM's root buffer, and with deferred freeing the objects that
+    // die to its free queue, while it runs. Once it stops the queue is drained and the roots collected, so no object
+    // is a candidate root or half freed by the time a value can leave the VM for another thread.
+    struct ExecuteScope
+    {
+        explicit ExecuteScope(VM* vm)
+            : vm(vm)
+            , outerRoots(t_cycleRoots)
+            , outerQueue(t_freeQueue)
+        {
+            t_cycleRoots = &vm->_cycleRoots;
+            t_freeQueue = vm->_freeSlice != 0 ? &vm->_freeQueue : nullptr;
+        }
+
+        ~ExecuteScope()
+        {
+            // The collector frees garbage synchronously, but what it drops may still be queued
+            DrainFreeQueue(vm->_freeQueue, SIZE_MAX);
+            vm->CollectCycles();
+            DrainFreeQueue(vm->_freeQueue, SIZE_MAX);
+            t_cycleRoots = outerRoots;
+            t_freeQueue = outerQueue;
+        }
+
+        VM* vm;
+        std::vector<StackVal>* outerRoots;
+        std::vector<StackVal>* outerQueue;
+    };
+
     VM::VM()
         : _parser(new Parser())
         , _compiler(new BytecodeGen())
-        , _ip(0)
-        , _stack(STACKSIZE)
+        , _astOptimization(true)
+        , _astOptimizerStats{ 0, 0, 0 }
+        , _bytecodeGenStats{ 0, 0 }
+        , _code(nullptr)
+        , _functions(nullptr)
+        , _functionEntries(nullptr)
+        , _ip(nullptr)
 		, _stackRoot(nullptr)
+        , _stackLimit(nullptr)
+        , _maxStackSize(0)
+        , _stackPointer(nullptr)
+        , _framePointer(nullptr)
+        , _currentExternArgN(0)
+        , _currentArena(nullptr)
+        , _cycleBudget(CYCLEBUDGET)
+        , _cycleAllocations(0)
+        , _cycleStats{ 0, 0, 0.0, 0.0 }
+        , _freeSlice(0)
+    {
+        this->ReserveStack(MAXSTACKSIZE);
+    }
+
+    VM::VM(std::shared_ptr<const Program> program)
+        : _astOptimization(false)
+        , _astOptimizerStats{ 0, 0, 0 }
+        , _bytecodeGenStats{ 0, 0 }
+        , _code(nullptr)
+        , _functions(nullptr)
+        , _functionEntries(nullptr)
+        , _ip(nullptr)
+        , _stackRoot(nullptr)
+        , _stackLimit(nullptr)
+        , _maxStackSize(0)
         , _stackPointer(nullptr)
         , _framePointer(nullptr)
         , _currentExternArgN(0)
+        , _currentArena(nullptr)
+        , _cycleBudget(CYCLEBUDGET)
+        , _cycleAllocations(0)
+        , _cycleStats{ 0, 0, 0.0, 0.0 }
+        , _freeSlice(0)
     {
-		_stackRoot = &_stack[0];
+        AssertNotNull(program.get());
+
+        this->ReserveStack(MAXSTACKSIZE);
+        this->AttachProgram(std::move(program));
     }
 
     VM::~VM()
     {
-		Deref(&_returnValue.v);
+        {
+            ExecuteScope scope(this);
+            Deref(&_returnValue.v);
+            if (_arena.get() != nullptr) this->ReleaseArena();
+        }
+        this->ReleaseStack();
     }
 
     void VM::AddExternFunc(const char* name, unsigned char nParam, const std::function<void(VM*)>& func)
@@ -169,20 +740,252 @@ namespace scrpt
 	{
 		AssertNotNull(_parser.get());
 
+        if (_astOptimization)
+        {
+            AstOptimizer optimizer;
+            optimizer.Optimize(_parser.get()->GetAst());
+            _astOptimizerStats = optimizer.GetStats();
+        }
+
 		_compiler.get()->Consume(*(_parser.get()->GetAst()));
-		_bytecode = _compiler.get()->GetBytecode();
+        std::shared_ptr<const Program> program = std::make_shared<Program>(_compiler.get()->GetBytecode());
+        _bytecodeGenStats = _compiler.get()->GetStats();
 		_parser.reset(nullptr);
         _compiler.reset(nullptr);
 
-		for (unsigned int id = 0; id < _bytecode.functions.size(); ++id)
-		{
-			_functionMap[_bytecode.functions[id].name] = id;
-		}
+        this->AttachProgram(std::move(program));
 	}
 
+    void VM::SetAstOptimization(bool enabled)
+    {
+        AssertNotNull(_parser.get());
+        _astOptimization = enabled;
+    }
+
+    void VM::SetInlineBudget(size_t nodes)
+    {
+        AssertNotNull(_compiler.get());
+        _compiler.get()->SetInlineBudget(nodes);
+    }
+
+    void VM::SetExecuteArena(bool enabled)
+    {
+        Assert(_currentArena == nullptr, "Arena can't be changed while executing");
+
+        if (!enabled && _arena.get() != nullptr)
+        {
+            this->ReleaseArena();
+        }
+        _arena.reset(enabled ? new Arena(sizeof(ArenaBlock)) : nullptr);
+    }
+
+    void VM::SetCycleBudget(size_t allocations)
+    {
+        _cycleBudget = allocations;
+    }
+
+    void VM::SetDeferredFree(size_t slice)
+    {
+        _freeSlice = slice;
+    }
+
+    const CycleCollectorStats& VM::GetCycleCollectorStats() const
+    {
+        return _cycleStats;
+    }
+
+    // Bacon and Rajan's synchronous trial deletion. The references from inside the graph reachable from the candidate
+    // roots are taken off the counts of the objects in it. Whatever is left with a count is referenced from outside,
+    // so it and everything it reaches get their counts back, and the rest can only be reached from itself and is
+    // freed. Only runs where every live reference is counted, between instructions.
+    void VM::CollectCycles()
+    {
+        _cycleAllocations = 0;
+        if (_cycleRoots.empty())
+        {
+            return;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<StackVal> work;
+        std::vector<StackVal> blackWork;
+
+        // Roots that were released or already reached from an earlier root are dropped
+        size_t nRoots = 0;
+        for (StackVal& root : _cycleRoots)
+        {
+            StackRef* ref = root.GetRef();
+            unsigned int count = ref->refCount.load(std::memory_order_relaxed);
+            if (GetColor(ref) == CycleColor::Purple && count > 0)
+            {
+                MarkGray(root, work);
+                _cycleRoots[nRoots++] = root;
+                continue;
+            }
+
+            ref->buffered = false;
+            if (GetColor(ref) == CycleColor::Black && count == 0)
+            {
+                // Its payload went when it was released
+                ref->~StackRef();
+                RefSlab::Free(ref);
+            }
+        }
+        _cycleRoots.resize(nRoots);
+
+        for (StackVal& root : _cycleRoots)
+        {
+            Scan(root, work, blackWork);
+        }
+
+        std::vector<StackVal> garbage;
+        for (StackVal& root : _cycleRoots)
+        {
+            root.GetRef()->buffered = false;
+            CollectWhite(root, garbage, work);
+        }
+        _cycleRoots.clear();
+
+        for (StackVal& val : garbage)
+        {
+            FreeGarbage(&val);
+        }
+
+        double pauseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        ++_cycleStats.collections;
+        _cycleStats.freedObjects += garbage.size();
+        _cycleStats.totalPauseMs += pauseMs;
+        _cycleStats.maxPauseMs = std::max(_cycleStats.maxPauseMs, pauseMs);
+    }
+
+    // Tears down everything made in the arena. Nothing outside it can reach an arena object any more, so each one is
+    // destroyed where it lies and only the references they hold to objects outside the arena are dropped, without
+    // walking from one arena object to the next.
+    void VM::ReleaseArena()
+    {
+        AssertNotNull(_arena.get());
+
+        for (size_t idx = 0; idx < _arena->GetCount(); ++idx)
+        {
+            ArenaBlock* block = static_cast<ArenaBlock*>(_arena->Get(idx));
+            StackRef* ref = &block->block.ref;
+            switch (block->type)
+            {
+            case StackType::DynamicString:
+                Destroy(ref->string);
+                break;
+            case StackType::List:
+                for (auto& entry : *ref->list) DerefOutsideArena(&entry.v);
+                Destroy(ref->list);
+                break;
+            case StackType::Map:
+                for (auto& entry : *ref->map) DerefOutsideArena(&entry.second.v);
+                Destroy(ref->map);
+                break;
+            default:
+                break;
+            }
+        }
+
+        _arena->Reset();
+        _currentArena = nullptr;
+    }
+
+    void VM::SetMaxStackSize(size_t slots)
+    {
+        Assert(slots > 0, "Stack must have room for the entry frame");
+        Assert(_stackPointer == nullptr || _stackPointer == _stackRoot, "Stack can't be resized while executing");
+
+        this->ReleaseStack();
+        this->ReserveStack(slots);
+    }
+
+    const AstOptimizerStats& VM::GetAstOptimizerStats() const
+    {
+        return _astOptimizerStats;
+    }
+
+    const BytecodeGenStats& VM::GetBytecodeGenStats() const
+    {
+        return _bytecodeGenStats;
+    }
+
+    void VM::LoadImage(const char* path)
+    {
+        AssertNotNull(path);
+        AssertNotNull(_compiler.get());
+
+        std::unique_ptr<MappedFile> image(new MappedFile(path));
+        if (image->GetData() == nullptr)
+        {
+            throw CreateEx(path, Err::VM_InvalidImage);
+        }
+
+        BytecodeImage loaded = ReadBytecodeImage(image->GetData(), image->GetSize());
+
+        // Externs were added to the compiler, bind them by name to the image's functions
+        Bytecode externs = _compiler.get()->GetBytecode();
+        for (FunctionData& fd : loaded.functions)
+        {
+            if (!fd.external) continue;
+
+            auto registered = std::find_if(externs.functions.begin(), externs.functions.end(), [&](const FunctionData& candidate) { return candidate.name == fd.name; });
+            if (registered == externs.functions.end() || registered->nParam != fd.nParam)
+            {
+                throw CreateEx(fd.name, Err::VM_FailedFunctionLookup);
+            }
+            fd.func = registered->func;
+        }
+
+        std::shared_ptr<const Program> program = std::make_shared<Program>(std::move(loaded), std::move(image));
+        _parser.reset(nullptr);
+        _compiler.reset(nullptr);
+
+        this->AttachProgram(std::move(program));
+    }
+
+    void VM::SaveImage(const char* path)
+    {
+        AssertNotNull(path);
+
+        if (_parser.get() != nullptr)
+        {
+            this->Finalize();
+        }
+
+        std::vector<unsigned char> image = WriteBytecodeImage(_program->GetBytecode());
+        WriteFile(path, (const char*)image.data(), image.size());
+    }
+
+    // Caches what the dispatch loop reads from the program and sets up a JIT of its own, as compiled code embeds the
+    // addresses of this VM's state
+    void VM::AttachProgram(std::shared_ptr<const Program> program)
+    {
+        _program = std::move(program);
+        _code = _program->GetInstructions();
+        _functions = _program->GetFunctions();
+        _functionEntries = _program->GetEntries().data();
+#if SCRPT_JIT
+        _jit.reset(new Jit(_code, _program->GetInstructionCount()));
+        _methodJit.reset(new MethodJit(this));
+        _jitCallDepth = 0;
+#endif
+    }
+
     void VM::Decompile()
     {
-        scrpt::Decompile(_bytecode);
+        AssertNotNull(_program.get());
+        scrpt::Decompile(_program->GetBytecode());
+    }
+
+    std::shared_ptr<const Program> VM::GetProgram()
+    {
+        if (_parser.get() != nullptr)
+        {
+            this->Finalize();
+        }
+
+        return _program;
     }
 
 	StackVal* VM::Execute(const char* funcName)
@@ -194,219 +997,501 @@ namespace scrpt
 			this->Finalize();
 		}
 
+        unsigned int funcId;
+        if (!_program->FindFunction(funcName, &funcId))
+        {
+			throw CreateEx(funcName, Err::VM_FailedFunctionLookup);
+        }
+
+        return this->Execute(funcId, nullptr, 0);
+    }
+
+    StackVal* VM::Execute(unsigned int funcId, const StackVal* args, unsigned char nArgs)
+    {
+        AssertNotNull(_program.get());
+        Assert(funcId < _program->GetFunctionCount(), "Function id out of range");
+        Assert(nArgs == 0 || args != nullptr, "Missing arguments");
+
+        const FunctionData& fd = _functions[funcId];
+        if (fd.external) this->ThrowErr(Err::VM_FailedFunctionLookup);
+        if (fd.nParam != nArgs) this->ThrowErr(Err::VM_IncorrectArity);
+
+        ExecuteScope scope(this);
+
         // Clear out any previous return value
 		Deref(&_returnValue.v);
 
-        auto funcIter = _functionMap.find(funcName);
-        if (funcIter != _functionMap.end())
+        // Arguments go in the slots below the entry frame that the function's params are read from
+        _currentArena = _arena.get();
+        _stackPointer = _stackRoot;
+        std::unordered_map<StackRef*, StackRef*> clones;
+        for (unsigned char arg = 0; arg < nArgs; ++arg)
         {
-            const FunctionData& fd = _bytecode.functions[funcIter->second];
-            size_t nLocals = fd.localLookup.size();
-
-            _stackPointer = &_stack[0];
-            _ip = fd.entry;
-            // TODO: Push params
-            this->PushStackFrame(0, 0);
-            _framePointer = _stackPointer;
-            this->PushNull(fd.nLocalRegisters);
-            try
+            CHECKSTACK
+            CloneValue(args[arg], &_stackPointer->v, _currentArena, clones);
+            ++_stackPointer;
+        }
+
+        _ip = _functionEntries[funcId];
+        this->PushStackFrame(0, 0);
+        _framePointer = _stackPointer;
+        this->PushNull(fd.nLocalRegisters);
+        try
+        {
+            this->Run();
+            POPN(nArgs);
+        }
+        catch (Exception& cex)
+        {
+            std::string callstack = this->CreateCallstack(_ip);
+
+            // Unwinding stops at the entry frame, release it and the arguments for the next call
+            if (_stackPointer == _framePointer && _framePointer == _stackRoot + nArgs + 1)
             {
-                this->Run();
-                // TODO: Pop params
+                POPFRAME
+                POPN(nArgs);
             }
-            catch (Exception& cex)
+
+            // Nothing the failed call made is reachable any more
+            if (_currentArena != nullptr)
             {
-                throw CreateEx(this->CreateCallstack(_ip), cex.GetErr());
+                Deref(&_returnValue.v);
+                _returnValue.v.SetNull();
+                DrainFreeQueue(_freeQueue, SIZE_MAX);
+                this->ReleaseArena();
             }
 
-            Assert(_stackPointer == &_stack[0], "Stack must be empty after executing");
-            return &_returnValue.v;
+            throw CreateEx(callstack, cex.GetErr());
         }
-        else
+
+        if (_currentArena != nullptr)
         {
-			throw CreateEx(funcName, Err::VM_FailedFunctionLookup);
+            std::unordered_map<StackRef*, StackRef*> promoted;
+            Promote(&_returnValue.v, promoted);
+
+            // Queued objects outside the arena can still hold arena objects, which must be dropped first
+            DrainFreeQueue(_freeQueue, SIZE_MAX);
+            this->ReleaseArena();
         }
+
+        Assert(_stackPointer == _stackRoot, "Stack must be empty after executing");
+        return &_returnValue.v;
+    }
+
+    StackVal VM::TakeResult()
+    {
+        StackVal result = _returnValue.v;
+        _returnValue.v.SetNull();
+        return result;
     }
 
     void VM::SetExternResult(StackType type, int val)
     {
         Deref(&_returnValue.v);
-        _returnValue.v.type = type;
-        _returnValue.v.integer = val;
+        _returnValue.v.SetInt(type, val);
+    }
+
+    List* VM::SetExternListResult(size_t size)
+    {
+        StackRef* ref = NewRef<List>(_currentArena, size);
+        Deref(&_returnValue.v);
+        _returnValue.v.SetRef(StackType::List, ref);
+        return ref->list;
     }
 
-    #define INCREMENTOP(IntOp, FloatOp) \
+    #define INCREMENTOP(Op) \
     { \
         StackObj* obj = _framePointer + REG0; \
-        StackType t = obj->v.type; \
+        StackType t = obj->v.GetType(); \
         if (t == StackType::Int) \
-            this->LoadInt(REG0, StackType::Int, IntOp); \
+            obj->v.SetInt(StackType::Int, obj->v.GetInt() Op 1); \
         else if (t == StackType::Float) \
-            this->LoadFloat(REG0, FloatOp); \
+            obj->v.SetFloat(obj->v.GetFloat() Op 1.0f); \
         else \
 			this->ThrowErr(Err::VM_UnsupportedOperandType); \
-        ++_ip; \
     } 
 
-    #define MATHOP(Op) \
+    #define MATHOP(Op, IntStore, FloatStore) \
     { \
         StackObj* v1 = _framePointer + REG0; \
         StackObj* v2 = _framePointer + REG1; \
-        StackType t1 = v1->v.type; \
-        StackType t2 = v2->v.type; \
+        StackType t1 = v1->v.GetType(); \
+        StackType t2 = v2->v.GetType(); \
         if (t1 != StackType::Int && t1 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
         if (t2 != StackType::Int && t2 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
         if (t1 == StackType::Int && t2 == StackType::Int) \
         { \
-			int result = v1->v.integer Op v2->v.integer; \
-            this->LoadInt(REG2, StackType::Int, result); \
+			int result = v1->v.GetInt() Op v2->v.GetInt(); \
+            this->IntStore(REG2, StackType::Int, result); \
         } \
         else \
         { \
-            float fv1 = t1 == StackType::Float ? v1->v.fp : (float)v1->v.integer; \
-            float fv2 = t2 == StackType::Float ? v2->v.fp : (float)v2->v.integer; \
-            this->LoadFloat(REG2, fv1 Op fv2); \
+            float fv1 = t1 == StackType::Float ? v1->v.GetFloat() : (float)v1->v.GetInt(); \
+            float fv2 = t2 == StackType::Float ? v2->v.GetFloat() : (float)v2->v.GetInt(); \
+            this->FloatStore(REG2, fv1 Op fv2); \
         } \
-        _ip += 3;\
     }
 
     #define ASSIGNMATHOP(Op) \
     {\
         StackObj* target = _framePointer + REG0;\
         StackObj* value = _framePointer + REG1;\
-        StackType t1 = target->v.type;\
-        StackType t2 = value->v.type;\
+        StackType t1 = target->v.GetType();\
+        StackType t2 = value->v.GetType();\
         if (t1 != StackType::Int && t1 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
         if (t2 != StackType::Int && t2 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
         if (t1 == StackType::Float)\
         {\
-            target->v.fp Op (t2 == StackType::Float ? value->v.fp : (float)value->v.integer);\
+            target->v.SetFloat(target->v.GetFloat() Op (t2 == StackType::Float ? value->v.GetFloat() : (float)value->v.GetInt()));\
         }\
         else\
         {\
-            target->v.integer Op (t2 == StackType::Int ? value->v.integer : (int)value->v.fp);\
+            target->v.SetInt(StackType::Int, target->v.GetInt() Op (t2 == StackType::Int ? value->v.GetInt() : (int)value->v.GetFloat()));\
         }\
-        _ip += 2;\
     }
 
-    #define COMPOP(Op)  \
+    #define COMPOP(Op)  \
+    { \
+        bool result; \
+        StackObj* v1 = _framePointer + REG0; \
+        StackObj* v2 = _framePointer + REG1; \
+        StackType t1 = v1->v.GetType(); \
+        StackType t2 = v2->v.GetType(); \
+        if (t1 != StackType::Int && t1 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
+        if (t2 != StackType::Int && t2 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
+        if (t1 == StackType::Int && t2 == StackType::Int) \
+        { \
+            result = v1->v.GetInt() Op v2->v.GetInt(); \
+        } \
+        else \
+        { \
+            float fv1 = t1 == StackType::Float ? v1->v.GetFloat() : (float)v1->v.GetInt(); \
+            float fv2 = t2 == StackType::Float ? v2->v.GetFloat() : (float)v2->v.GetInt(); \
+            result = fv1 Op fv2; \
+        } \
+        this->LoadInt(REG2, StackType::Boolean, result); \
+    }
+
+    // Taken backward branches let the JIT count loop iterations, run the loop's compiled trace or start recording
+#if SCRPT_JIT
+    #define LOOPJUMP(Target) \
+    { \
+        const Instruction* loopTarget = (Target); \
+        if (loopTarget <= _ip) \
+        { \
+            bool record; \
+            loopTarget = _jit->OnLoop(loopTarget, _framePointer, &record); \
+            if (record) STARTRECORDING; \
+        } \
+        JUMP(loopTarget); \
+    }
+#else
+    #define LOOPJUMP(Target) JUMP(Target)
+#endif
+
+    #define COMPBRANCHOP(Op) \
     { \
         bool result; \
         StackObj* v1 = _framePointer + REG0; \
         StackObj* v2 = _framePointer + REG1; \
-        StackType t1 = v1->v.type; \
-        StackType t2 = v2->v.type; \
-        if (t1 != StackType::Int && t1 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
-        if (t2 != StackType::Int && t2 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
+        StackType t1 = v1->v.GetType(); \
+        StackType t2 = v2->v.GetType(); \
         if (t1 == StackType::Int && t2 == StackType::Int) \
         { \
-            result = v1->v.integer Op v2->v.integer; \
+            result = v1->v.GetInt() Op v2->v.GetInt(); \
         } \
         else \
         { \
-            float fv1 = t1 == StackType::Float ? v1->v.fp : (float)v1->v.integer; \
-            float fv2 = t2 == StackType::Float ? v2->v.fp : (float)v2->v.integer; \
+            if (t1 != StackType::Int && t1 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
+            if (t2 != StackType::Int && t2 != StackType::Float) this->ThrowErr(Err::VM_UnsupportedOperandType); \
+            float fv1 = t1 == StackType::Float ? v1->v.GetFloat() : (float)v1->v.GetInt(); \
+            float fv2 = t2 == StackType::Float ? v2->v.GetFloat() : (float)v2->v.GetInt(); \
             result = fv1 Op fv2; \
         } \
-        this->LoadInt(REG2, StackType::Boolean, result); \
-        _ip += 3;\
+        if (result) LOOPJUMP(_ip->target); \
+    }
+
+    #define MATHIMMOP(Op, IntStore, FloatStore) \
+    { \
+        StackObj* v1 = _framePointer + REG0; \
+        StackType t1 = v1->v.GetType(); \
+        if (t1 == StackType::Int) \
+            this->IntStore(REG2, StackType::Int, v1->v.GetInt() Op _ip->integer); \
+        else if (t1 == StackType::Float) \
+            this->FloatStore(REG2, v1->v.GetFloat() Op (float)_ip->integer); \
+        else \
+            this->ThrowErr(Err::VM_UnsupportedOperandType); \
+    }
+
+    // Quickening rewrites a generic instruction in place into its Int specialized form once it sees Int
+    // operands, then re-dispatches the same instruction. The specialized handlers skip the type dispatch
+    // and rewrite themselves back to the generic op as soon as an operand has any other type.
+    #define QUICKEN(NewOp) \
+    { \
+        const_cast<Instruction*>(_ip)->op.store(OpCode::NewOp, std::memory_order_relaxed); \
+        JUMP(_ip); \
+    }
+
+    #define QUICKENINT1(QuickOp) \
+        if ((_framePointer + REG0)->v.GetType() == StackType::Int) QUICKEN(QuickOp)
+
+    #define QUICKENINT2(QuickOp) \
+        if ((_framePointer + REG0)->v.GetType() == StackType::Int && (_framePointer + REG1)->v.GetType() == StackType::Int) QUICKEN(QuickOp)
+
+    #define MATHOPII(Op, ResultType, GenericOp, IntStore) \
+    { \
+        StackObj* v1 = _framePointer + REG0; \
+        StackObj* v2 = _framePointer + REG1; \
+        if (v1->v.GetType() != StackType::Int || v2->v.GetType() != StackType::Int) QUICKEN(GenericOp); \
+        this->IntStore(REG2, ResultType, v1->v.GetInt() Op v2->v.GetInt()); \
+    }
+
+    #define COMPBRANCHOPII(Op, GenericOp) \
+    { \
+        StackObj* v1 = _framePointer + REG0; \
+        StackObj* v2 = _framePointer + REG1; \
+        if (v1->v.GetType() != StackType::Int || v2->v.GetType() != StackType::Int) QUICKEN(GenericOp); \
+        if (v1->v.GetInt() Op v2->v.GetInt()) LOOPJUMP(_ip->target); \
+    }
+
+    #define MATHIMMOPI(Op, GenericOp, IntStore) \
+    { \
+        StackObj* v1 = _framePointer + REG0; \
+        if (v1->v.GetType() != StackType::Int) QUICKEN(GenericOp); \
+        this->IntStore(REG2, StackType::Int, v1->v.GetInt() Op _ip->integer); \
+    }
+
+    #define INCREMENTOPI(Op, GenericOp) \
+    { \
+        StackObj* obj = _framePointer + REG0; \
+        if (obj->v.GetType() != StackType::Int) QUICKEN(GenericOp); \
+        obj->v.SetInt(StackType::Int, obj->v.GetInt() Op 1); \
     }
 
     #define BOOLOP(Op) \
     { \
         StackObj* v1 = _framePointer + REG0; \
         StackObj* v2 = _framePointer + REG1; \
-        StackType t1 = v1->v.type; \
-        StackType t2 = v2->v.type; \
+        StackType t1 = v1->v.GetType(); \
+        StackType t2 = v2->v.GetType(); \
         if (t1 != StackType::Boolean && t2 != StackType::Boolean) this->ThrowErr(Err::VM_UnsupportedOperandType); \
-		int result = v1->v.integer Op v2->v.integer; \
+		int result = v1->v.GetInt() Op v2->v.GetInt(); \
         this->LoadInt(REG2, StackType::Boolean, result); \
-        _ip += 3;\
+    }
+
+    #define BRANCHOP(Test) \
+    { \
+        StackObj* cond = _framePointer + REG0; \
+        if (cond->v.GetType() != StackType::Boolean) this->ThrowErr(Err::VM_UnsupportedOperandType); \
+        if (cond->v.GetInt() == (Test)) LOOPJUMP(_ip->target); \
     }
 
     void VM::Run()
     {
-        const unsigned char* data = &(_bytecode.data[0]);
+        const Instruction* code = _code;
+
+#if SCRPT_JIT
+        _jit->CancelRecording();
+#endif
+
+#if SCRPT_PROFILE_OPS
+        OpCode previousOp = OpCode::Unknown;
+        #define PROFILEOP { ++s_opPairCounts[(int)previousOp][(int)OPCODE]; previousOp = OPCODE; }
+#else
+        #define PROFILEOP
+#endif
+
+#if SCRPT_THREADED_DISPATCH
+        // Must stay in OpCode order
+        static const void* dispatchTable[] =
+        {
+            &&Label_Unknown,
+            &&Label_LoadNull,
+            &&Label_LoadTrue,
+            &&Label_LoadFalse,
+            &&Label_LoadInt,
+            &&Label_LoadFloat,
+            &&Label_LoadString,
+            &&Label_LoadFunc,
+            &&Label_Store,
+            &&Label_StoreIdx,
+            &&Label_Eq,
+            &&Label_Or,
+            &&Label_And,
+            &&Label_Add,
+            &&Label_Sub,
+            &&Label_Mul,
+            &&Label_Div,
+            &&Label_Mod,
+            &&Label_Concat,
+            &&Label_Inc,
+            &&Label_Dec,
+            &&Label_PostInc,
+            &&Label_PostDec,
+            &&Label_Neg,
+            &&Label_LT,
+            &&Label_GT,
+            &&Label_LTE,
+            &&Label_GTE,
+            &&Label_Call,
+            &&Label_CallDirect,
+            &&Label_Ret,
+            &&Label_TailCall,
+            &&Label_BrT,
+            &&Label_BrF,
+            &&Label_Jmp,
+            &&Label_Index,
+            &&Label_MakeList,
+            &&Label_MakeMap,
+            &&Label_Push,
+            &&Label_PushN,
+            &&Label_BrLT,
+            &&Label_BrLTE,
+            &&Label_BrGT,
+            &&Label_BrGTE,
+            &&Label_AddImm,
+            &&Label_MulImm,
+            &&Label_LoadIntS,
+            &&Label_StoreS,
+            &&Label_AddS,
+            &&Label_SubS,
+            &&Label_MulS,
+            &&Label_AddImmS,
+            &&Label_MulImmS,
+            &&Label_AddII,
+            &&Label_SubII,
+            &&Label_MulII,
+            &&Label_LTII,
+            &&Label_GTII,
+            &&Label_LTEII,
+            &&Label_GTEII,
+            &&Label_IncI,
+            &&Label_DecI,
+            &&Label_BrLTII,
+            &&Label_BrLTEII,
+            &&Label_BrGTII,
+            &&Label_BrGTEII,
+            &&Label_AddImmI,
+            &&Label_MulImmI,
+            &&Label_AddIIS,
+            &&Label_SubIIS,
+            &&Label_MulIIS,
+            &&Label_AddImmIS,
+            &&Label_MulImmIS,
+        };
+        static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == (size_t)OpCode::__Num, "Dispatch table is missing opcodes");
+
+        #define OPCASE(Op) Label_##Op
+        #define NEXT { ++_ip; DISPATCH; }
+        #define JUMP(Target) { _ip = (Target); DISPATCH; }
+
+#if SCRPT_JIT
+        // While the JIT records a loop every opcode routes through Label_Record before its handler
+        static const void* recordTable[(int)OpCode::__Num];
+        if (recordTable[0] == nullptr)
+        {
+            for (const void*& label : recordTable) label = &&Label_Record;
+        }
 
-        bool running = true;
-        while (running)
+        const void* const* activeTable = dispatchTable;
+        #define DISPATCH { PROFILEOP; goto *activeTable[(int)OPCODE]; }
+        #define STARTRECORDING { activeTable = recordTable; }
+#else
+        #define DISPATCH { PROFILEOP; goto *dispatchTable[(int)OPCODE]; }
+#endif
+
+        DISPATCH;
+#else
+        #define OPCASE(Op) case OpCode::Op
+        #define NEXT break
+        #define JUMP(Target) { _ip = (Target); continue; }
+
+#if SCRPT_JIT
+        bool recording = false;
+        #define STARTRECORDING { recording = true; }
+#endif
+
+        while (true)
         {
-            #define GetOperand(Type) *((Type*)(data + _ip + 2))
-            switch ((const OpCode)(data[_ip]))
+            PROFILEOP;
+#if SCRPT_JIT
+            if (recording)
+            {
+                recording = _jit->Record(_ip, _framePointer);
+            }
+#endif
+            switch (OPCODE)
             {
-            case OpCode::Unknown: this->ThrowErr(Err::VM_NotImplemented); break;
+#endif
+            OPCASE(Unknown): this->ThrowErr(Err::VM_NotImplemented); NEXT;
 
             /// 
             /// Load Null
             ///
-            case OpCode::LoadNull: this->LoadNull(REG0); ++_ip; break;
+            OPCASE(LoadNull): this->LoadNull(REG0); NEXT;
 
             /// 
             /// Load True
             ///
-            case OpCode::LoadTrue: this->LoadInt(REG0, StackType::Boolean, 1); ++_ip; break;
+            OPCASE(LoadTrue): this->LoadInt(REG0, StackType::Boolean, 1); NEXT;
 
             /// 
             /// Load False
             ///
-            case OpCode::LoadFalse: this->LoadInt(REG0, StackType::Boolean, 0); ++_ip; break;
+            OPCASE(LoadFalse): this->LoadInt(REG0, StackType::Boolean, 0); NEXT;
 
             /// 
             /// Load Integer
             ///
-            case OpCode::LoadInt:
-                this->LoadInt(REG0, StackType::Int, GetOperand(int));
-                _ip += 5;
-                break;
+            OPCASE(LoadInt):
+                this->LoadInt(REG0, StackType::Int, _ip->integer);
+                NEXT;
 
             /// 
             /// Load Float
             ///
-            case OpCode::LoadFloat:
-                this->LoadFloat(REG0, GetOperand(float));
-                _ip += 5;
-                break;
+            OPCASE(LoadFloat):
+                this->LoadFloat(REG0, _ip->fp);
+                NEXT;
 
             /// 
             /// Load String
             ///
-            case OpCode::LoadString:
-                this->LoadString(REG0, GetOperand(unsigned int));
-                _ip += 5;
-                break;
+            OPCASE(LoadString):
+                this->LoadStaticString(REG0, _ip->string);
+                NEXT;
 
             ///
             /// Load Function
             ///
-            case OpCode::LoadFunc:
-                this->LoadInt(REG0, StackType::Func, GetOperand(unsigned int));
-                _ip += 5;
-                break;
+            OPCASE(LoadFunc):
+                this->LoadInt(REG0, StackType::Func, _ip->id);
+                NEXT;
 
             /// 
             /// Identifier Assign
             ///
-            case OpCode::Store:
+            OPCASE(Store):
                 Copy(_framePointer + REG1, _framePointer + REG0);
-                _ip += 2;
-                break;
+                NEXT;
 
             ///
             /// Indexed Identifier Assignment
             ///
-            case OpCode::StoreIdx:
+            OPCASE(StoreIdx):
             {
                 StackObj* target = _framePointer + REG0;
                 StackObj* indexObj = _framePointer + REG1;
                 StackObj* value = _framePointer + REG2;
-                StackType targetType = target->v.type;
-                StackType indexType = indexObj->v.type;
+                StackType targetType = target->v.GetType();
+                StackType indexType = indexObj->v.GetType();
                 if (targetType == StackType::List)
                 {
                     if (indexType != StackType::Int) this->ThrowErr(Err::VM_UnsupportedOperandType);
-                    int index = indexObj->v.integer;
+                    int index = indexObj->v.GetInt();
 
-                    List* list = target->v.ref->list;
+                    if (target->v.GetRef()->shared) this->ThrowErr(Err::VM_ModifiedSharedObject);
+                    List* list = target->v.GetRef()->list;
                     if (index < 0)
                     {
                         this->ThrowErr(Err::VM_NotImplemented);
@@ -422,14 +1507,15 @@ namespace scrpt
                 }
                 else if (targetType == StackType::Map)
                 {
-                    Map* map = target->v.ref->map;
+                    if (target->v.GetRef()->shared) this->ThrowErr(Err::VM_ModifiedSharedObject);
+                    Map* map = target->v.GetRef()->map;
                     if (indexType == StackType::StaticString)
                     {
-                        Copy(value, &(*map)[indexObj->v.staticString]);
+                        Copy(value, &(*map)[indexObj->v.GetStaticString()]);
                     }
                     else if (indexType == StackType::DynamicString)
                     {
-                        Copy(value, &(*map)[*indexObj->v.ref->string]);
+                        Copy(value, &(*map)[*indexObj->v.GetRef()->string]);
                     }
                     else
                     {
@@ -441,20 +1527,19 @@ namespace scrpt
                     this->ThrowErr(Err::VM_UnsupportedOperandType);
                 }
 
-                _ip += 3;
             }
-            break;
+            NEXT;
 
             /// 
             /// Equals
             ///
-            case OpCode::Eq:
+            OPCASE(Eq):
             {
                 bool result;
                 StackObj* v1 = (_framePointer + REG0);
                 StackObj* v2 = (_framePointer + REG1);
-                StackType t1 = v1->v.type;
-                StackType t2 = v2->v.type;
+                StackType t1 = v1->v.GetType();
+                StackType t2 = v2->v.GetType();
 
                 if (t1 == t2)
                 {
@@ -462,10 +1547,10 @@ namespace scrpt
                     {
                     case StackType::Boolean:
                     case StackType::Int:
-                        result = v1->v.integer == v2->v.integer;
+                        result = v1->v.GetInt() == v2->v.GetInt();
                         break;
                     case StackType::Float:
-                        result = v1->v.fp == v2->v.fp;
+                        result = v1->v.GetFloat() == v2->v.GetFloat();
                         break;
                     default:
                         this->ThrowErr(Err::VM_UnsupportedOperandType);
@@ -478,84 +1563,104 @@ namespace scrpt
                 }
 
                 this->LoadInt(REG2, StackType::Boolean, result);
-                _ip += 3;
             }
-            break;
+            NEXT;
 
             /// 
             /// Or
             ///
-            case OpCode::Or:
+            OPCASE(Or):
                 BOOLOP(||);
-                break;
+                NEXT;
 
             /// 
             /// And
             ///
-            case OpCode::And:
+            OPCASE(And):
                 BOOLOP(&&);
-                break;
+                NEXT;
 
             /// 
             /// Add
             ///
-            case OpCode::Add:
-                MATHOP(+);
-                break;
+            OPCASE(Add):
+                QUICKENINT2(AddII);
+                MATHOP(+, LoadInt, LoadFloat);
+                NEXT;
 
             /// 
             /// Subtract
             ///
-            case OpCode::Sub:
-                MATHOP(-);
-                break;
+            OPCASE(Sub):
+                QUICKENINT2(SubII);
+                MATHOP(-, LoadInt, LoadFloat);
+                NEXT;
 
             /// 
             /// Multiply
             ///
-            case OpCode::Mul:
-                MATHOP(*);
-                break;
+            OPCASE(Mul):
+                QUICKENINT2(MulII);
+                MATHOP(*, LoadInt, LoadFloat);
+                NEXT;
 
             /// 
             /// Divide
             ///
-            case OpCode::Div:
-                MATHOP(/);
-                break;
+            OPCASE(Div):
+                MATHOP(/, LoadInt, LoadFloat);
+                NEXT;
 
             /// 
             /// Modulo
             ///
-            case OpCode::Mod: this->ThrowErr(Err::VM_NotImplemented); break;
+            OPCASE(Mod): this->ThrowErr(Err::VM_NotImplemented); NEXT;
 
             ///
             /// Concat
             ///
-            case OpCode::Concat:
+            OPCASE(Concat):
             {
                 StackObj* v1 = _framePointer + REG0; 
                 StackObj* v2 = _framePointer + REG1;
-                StackType t1 = v1->v.type; 
-                StackType t2 = v2->v.type; 
+                StackType t1 = v1->v.GetType(); 
+                StackType t2 = v2->v.GetType(); 
                 if (t1 == StackType::DynamicString || t1 == StackType::StaticString)
                 {
-                    std::stringstream ss(
-                        t1 == StackType::StaticString ? v1->v.staticString : v1->v.ref->string->c_str(),
-                        std::ios_base::ate | std::ios_base::out);
+                    // Formatted straight into the new string, whose block comes from the slab, so short results
+                    // make no heap call at all
+                    const char* prefix;
+                    size_t prefixLength;
+                    if (t1 == StackType::StaticString)
+                    {
+                        prefix = v1->v.GetStaticString();
+                        prefixLength = strlen(prefix);
+                    }
+                    else
+                    {
+                        prefix = v1->v.GetRef()->string->c_str();
+                        prefixLength = v1->v.GetRef()->string->size();
+                    }
+
+                    char number[32];
+                    const char* suffix = number;
+                    size_t suffixLength;
                     switch (t2)
                     {
                     case StackType::Boolean:
-                        ss << (v2->v.integer == 0 ? "false" : "true");
+                        suffix = v2->v.GetInt() == 0 ? "false" : "true";
+                        suffixLength = strlen(suffix);
                         break;
                     case StackType::DynamicString:
-                        ss << *v2->v.ref->string;
+                        suffix = v2->v.GetRef()->string->c_str();
+                        suffixLength = v2->v.GetRef()->string->size();
                         break;
                     case StackType::Float:
-                        ss << v2->v.fp;
+                        // Same as streaming the float
+                        suffixLength = snprintf(number, sizeof(number), "%g", (double)v2->v.GetFloat());
                         break;
                     case StackType::Int:
-                        ss << v2->v.integer;
+                        suffixLength = snprintf(number, sizeof(number), "%d", v2->v.GetInt());
                         break;
                     case StackType::List:
                         this->ThrowErr(Err::VM_NotImplemented);
@@ -564,123 +1669,144 @@ namespace scrpt
                         this->ThrowErr(Err::VM_NotImplemented);
                         break;
                     case StackType::Null:
-                        ss << "null";
+                        suffix = "null";
+                        suffixLength = 4;
                         break;
                     case StackType::StaticString:
-                        ss << v2->v.staticString;
+                        suffix = v2->v.GetStaticString();
+                        suffixLength = strlen(suffix);
                         break;
                     default:
                         ThrowErr(Err::VM_NotImplemented);
                     }
-                    this->LoadString(REG2, ss.str().c_str());
+
+                    std::string result;
+                    result.reserve(prefixLength + suffixLength);
+                    result.append(prefix, prefixLength).append(suffix, suffixLength);
+                    this->LoadString(REG2, std::move(result));
                 }
                 else if (t1 == StackType::List)
                 {
                     // TODO: This doesn't properly concat lists, rather it would append the list as a unit
+                    if (v1->v.GetRef()->shared) this->ThrowErr(Err::VM_ModifiedSharedObject);
                     StackObj* target = _framePointer + REG2;
                     StackObj obj(StackType::Null, nullptr);
                     Copy(v2, &obj);
-                    v1->v.ref->list->push_back(obj);
+                    v1->v.GetRef()->list->push_back(obj);
                     Copy(v1, target);
                 }
                 else
                 {
                     this->ThrowErr(Err::VM_UnsupportedOperandType);
                 }
-                _ip += 3;
             }
-            break;
+            NEXT;
 
             /// 
             /// Prefix Increment Identifier
             ///
-            case OpCode::Inc:
-                INCREMENTOP(++obj->v.integer, ++obj->v.fp);
-                break;
+            OPCASE(Inc):
+                QUICKENINT1(IncI);
+                INCREMENTOP(+);
+                NEXT;
 
             /// 
             /// Prefix Decrement Identifier
             ///
-            case OpCode::Dec:
-                INCREMENTOP(--obj->v.integer, --obj->v.fp);
-                break;
+            OPCASE(Dec):
+                QUICKENINT1(DecI);
+                INCREMENTOP(-);
+                NEXT;
 
             /// 
             /// Postfix Increment Identifier
             ///
-            case OpCode::PostInc:
-                INCREMENTOP(obj->v.integer++, obj->v.fp++);
-                break;
+            OPCASE(PostInc):
+                INCREMENTOP(+);
+                NEXT;
 
             /// 
             /// Postfix Decrement Identifier
             ///
-            case OpCode::PostDec:
-                INCREMENTOP(obj->v.integer--, obj->v.fp--);
-                break;
+            OPCASE(PostDec):
+                INCREMENTOP(-);
+                NEXT;
 
             ///
             /// Prefix negation
             ///
-            case OpCode::Neg:
+            OPCASE(Neg):
                 {
                     StackObj* obj = _framePointer + REG0;
-                    StackType t = obj->v.type;
+                    StackType t = obj->v.GetType();
                     if (t == StackType::Int)
-                        this->LoadInt(REG1, StackType::Int, -obj->v.integer);
+                        this->LoadInt(REG1, StackType::Int, -obj->v.GetInt());
                     else if (t == StackType::Float)
-                        this->LoadFloat(REG1, -obj->v.fp);
+                        this->LoadFloat(REG1, -obj->v.GetFloat());
                     else
                         this->ThrowErr(Err::VM_UnsupportedOperandType);
-                    _ip += 2;
                 }
-                break;
+                NEXT;
 
             /// 
             /// Less Than
             ///
-            case OpCode::LT: 
+            OPCASE(LT): 
+                QUICKENINT2(LTII);
                 COMPOP(<);
-                break;
+                NEXT;
 
             /// 
             /// Greater Than
             ///
-            case OpCode::GT:
+            OPCASE(GT):
+                QUICKENINT2(GTII);
                 COMPOP(>);
-                break;
+                NEXT;
 
             ///  
             /// Less Than or Equal
             ///
-            case OpCode::LTE:
+            OPCASE(LTE):
+                QUICKENINT2(LTEII);
                 COMPOP(<=);
-                break;
+                NEXT;
 
             /// 
             /// Greater Than or Equal
             ///
-            case OpCode::GTE:
+            OPCASE(GTE):
+                QUICKENINT2(GTEII);
                 COMPOP(>=);
-                break;
+                NEXT;
 
             /// 
             /// Call Function
             ///
-            case OpCode::Call:
+            OPCASE(Call):
                 {
                     StackObj* handle = _framePointer + REG0;
-                    if (handle->v.type != StackType::Func) this->ThrowErr(Err::VM_UnsupportedOperandType);
-                    const FunctionData& fd = _bytecode.functions[handle->v.id];
+                    if (handle->v.GetType() != StackType::Func) this->ThrowErr(Err::VM_UnsupportedOperandType);
+                    const FunctionData& fd = _functions[handle->v.GetId()];
                     if (fd.nParam != REG1) this->ThrowErr(Err::VM_IncorrectArity);
                     if (!fd.external)
                     {
                         // Stack size limits guarentee this will fit in a 32bit int even on 64bit builds
                         int framePointerOffset = (int)(_stackPointer - _framePointer + 1);
-                        this->PushStackFrame(_ip + 3, framePointerOffset);
+                        this->PushStackFrame((unsigned int)(_ip + 1 - code), framePointerOffset);
                         _framePointer = _stackPointer;
                         this->PushNull(fd.nLocalRegisters);
-                        _ip = fd.entry - 1;
+#if SCRPT_JIT
+                        // Hot functions run compiled until they return or reach something only the interpreter handles
+                        MethodJit::MethodFunc method = _methodJit->GetMethod(handle->v.GetId());
+                        if (method != nullptr)
+                        {
+                            const Instruction* resume = method(_framePointer);
+                            if (resume == nullptr) return;
+                            JUMP(resume);
+                        }
+#endif
+                        JUMP(_functionEntries[handle->v.GetId()]);
                     }
                     else
                     {
@@ -690,78 +1816,114 @@ namespace scrpt
 
                         fd.func(this);
                         // TODO: Support for no return value
-                        _ip += 2;
+                        POPN(REG1);
+                        Move(&_returnValue, _framePointer + REG2);
                     }
                 }
-                break;
+                NEXT;
 
             /// 
-            /// Return
+            /// Call Function Direct
             ///
-            case OpCode::Ret:
+            OPCASE(CallDirect):
                 {
-                    Copy(_framePointer + REG0, &_returnValue);
-                    while (_stackPointer > _framePointer)
-                    {
-                        POP1;
-                    }
-                    StackObj* stackFrame = _stackPointer - 1;
-                    if (stackFrame->frame.framePointerOffset != 0)
+                    // The callee and its arity were fixed when compiling, externals have no entry
+                    const Instruction* entry = _functionEntries[_ip->id];
+                    if (entry != nullptr)
                     {
-                        _ip = stackFrame->frame.returnIp - 1;
-                        _framePointer -= stackFrame->frame.framePointerOffset;
+                        int framePointerOffset = (int)(_stackPointer - _framePointer + 1);
+                        this->PushStackFrame((unsigned int)(_ip + 1 - code), framePointerOffset);
+                        _framePointer = _stackPointer;
+                        this->PushNull(REG0);
+#if SCRPT_JIT
+                        MethodJit::MethodFunc method = _methodJit->GetMethod(_ip->id);
+                        if (method != nullptr)
+                        {
+                            const Instruction* resume = method(_framePointer);
+                            if (resume == nullptr) return;
+                            JUMP(resume);
+                        }
+#endif
+                        JUMP(entry);
                     }
                     else
                     {
-                        running = false;
+                        _currentExternArgN = REG1;
+                        _functions[_ip->id].func(this);
+                        POPN(REG1);
+                        Move(&_returnValue, _framePointer + REG2);
                     }
-                    POP1; // Stack frame
                 }
-                break;
+                NEXT;
 
             /// 
-            /// Restore Return Value
+            /// Return
             ///
-            case OpCode::RestoreRet:
-                Move(&_returnValue, _framePointer + REG0);
-                ++_ip;
-                break;
+            OPCASE(Ret):
+                {
+                    const Instruction* returnIp = this->PopStackFrame(REG0);
+
+                    // Returning from the entry frame leaves the VM
+                    if (returnIp == nullptr) return;
+
+                    if (!_freeQueue.empty()) DrainFreeQueue(_freeQueue, _freeSlice);
+
+                    JUMP(returnIp);
+                }
+
+            /// 
+            /// Tail Call
+            ///
+            OPCASE(TailCall):
+                {
+                    this->ReuseStackFrame(REG1, REG2);
+                    this->PushNull(REG0);
+#if SCRPT_JIT
+                    MethodJit::MethodFunc method = _methodJit->GetMethod(_ip->id);
+                    if (method != nullptr)
+                    {
+                        const Instruction* resume = method(_framePointer);
+                        if (resume == nullptr) return;
+                        JUMP(resume);
+                    }
+#endif
+                    JUMP(_functionEntries[_ip->id]);
+                }
 
             /// 
             /// Branch True
             ///
-            case OpCode::BrT:
-                this->ConditionalJump(_framePointer + REG0, 1, GetOperand(unsigned int));
-                break;
+            OPCASE(BrT):
+                BRANCHOP(1);
+                NEXT;
 
             /// 
             /// Branch False
             ///
-            case OpCode::BrF:
-                this->ConditionalJump(_framePointer + REG0, 0, GetOperand(unsigned int));
-                break;
+            OPCASE(BrF):
+                BRANCHOP(0);
+                NEXT;
 
             /// 
             /// Jump
             ///
-            case OpCode::Jmp:
-                _ip = *((unsigned int*)(data + _ip + 1)) - 1;
-                break;
+            OPCASE(Jmp):
+                LOOPJUMP(_ip->target);
 
             ///
             /// Index An Object
             ///
-            case OpCode::Index:
+            OPCASE(Index):
                 {
                     StackObj* index = _framePointer + REG1;
                     StackObj* object = _framePointer + REG0;
-                    StackType indexType = index->v.type;
-                    StackType objectType = object->v.type;
+                    StackType indexType = index->v.GetType();
+                    StackType objectType = object->v.GetType();
                     if (objectType == StackType::List)
                     {
                         if (indexType != StackType::Int) this->ThrowErr(Err::VM_UnsupportedOperandType);
-                        List* list = object->v.ref->list;
-                        int idx = index->v.integer;
+                        List* list = object->v.GetRef()->list;
+                        int idx = index->v.GetInt();
                         if (idx < 0)
                         {
                             this->ThrowErr(Err::VM_NotImplemented);
@@ -779,10 +1941,10 @@ namespace scrpt
                     else if (objectType == StackType::Map)
                     {
                         if (indexType != StackType::StaticString && indexType != StackType::DynamicString) this->ThrowErr(Err::VM_UnsupportedOperandType);
-                        Map* map = object->v.ref->map;
+                        Map* map = object->v.GetRef()->map;
                         if (indexType == StackType::StaticString)
                         {
-                            auto entry = map->find(index->v.staticString);
+                            auto entry = map->find(index->v.GetStaticString());
                             if (entry != map->end())
                                 Copy(&entry->second, _framePointer + REG2);
                             else
@@ -790,7 +1952,7 @@ namespace scrpt
                         }
                         else if (indexType == StackType::DynamicString)
                         {
-                            auto entry = map->find(*index->v.ref->string);
+                            auto entry = map->find(*index->v.GetRef()->string);
                             if (entry != map->end())
                                 Copy(&entry->second, _framePointer + REG2);
                             else
@@ -802,68 +1964,246 @@ namespace scrpt
                         this->ThrowErr(Err::VM_UnsupportedOperandType);
                     }
 
-                    _ip += 3;
                 }
-                break;
+                NEXT;
 
             ///
             /// Make list
             ///
-            case OpCode::MakeList:
+            OPCASE(MakeList):
                 {
                     // TODO: Max list size must be less than intmax and stack size
-                    unsigned int size = GetOperand(unsigned int);
-                    List* list = new List(size);
+                    unsigned int size = _ip->id;
+                    StackRef* ref = NewRef<List>(_currentArena, size);
+                    List& list = *ref->list;
                     for (int index = -(int)size; index < 0; ++index)
                     {
-                        BlindMove(_stackPointer + index, &(*list)[index + size]);
+                        BlindMove(_stackPointer + index, &list[index + size]);
                     }
                     POPN(size);
-                    this->LoadList(REG0, list);
+                    this->LoadRef(REG0, StackType::List, ref);
+                    if (_cycleBudget != 0 && ++_cycleAllocations >= _cycleBudget) this->CollectCycles();
+                    if (!_freeQueue.empty()) DrainFreeQueue(_freeQueue, _freeSlice);
                 }
-                _ip += 5;
-                break;
+                NEXT;
 
             ///
             /// Make map
             ///
-            case OpCode::MakeMap:
+            OPCASE(MakeMap):
                 {
-                    unsigned int size = GetOperand(unsigned int);
-                    Map* map = new Map();
+                    unsigned int size = _ip->id;
+                    StackVal map(StackType::Map, NewRef<Map>(_currentArena));
                     for (int index = -(int)size; index < 0; index += 2)
                     {
                         StackObj* keyObj = _stackPointer + index;
                         StackObj* valueObj = _stackPointer + index + 1;
 
-                        if (keyObj->v.type != StackType::StaticString && keyObj->v.type != StackType::DynamicString) this->ThrowErr(Err::VM_UnsupportedOperandType);
-                        const char* key = keyObj->v.type == StackType::StaticString ? keyObj->v.staticString : keyObj->v.ref->string->c_str();
-                        BlindMove(valueObj, &(*map)[key]);
+                        if (keyObj->v.GetType() != StackType::StaticString && keyObj->v.GetType() != StackType::DynamicString)
+                        {
+                            Deref(&map);
+                            this->ThrowErr(Err::VM_UnsupportedOperandType);
+                        }
+                        const char* key = keyObj->v.GetType() == StackType::StaticString ? keyObj->v.GetStaticString() : keyObj->v.GetRef()->string->c_str();
+                        BlindMove(valueObj, &(*map.GetRef()->map)[key]);
                     }
                     POPN(size);
-                    this->LoadMap(REG0, map);
+                    this->LoadRef(REG0, StackType::Map, map.GetRef());
+                    if (_cycleBudget != 0 && ++_cycleAllocations >= _cycleBudget) this->CollectCycles();
+                    if (!_freeQueue.empty()) DrainFreeQueue(_freeQueue, _freeSlice);
                 }
-                _ip += 5;
-                break;
+                NEXT;
 
             ///
             /// Push Register
             ///
-            case OpCode::Push:
+            OPCASE(Push):
                 CHECKSTACK
                 BlindCopy(_framePointer + REG0, _stackPointer);
                 ++_stackPointer;
-                ++_ip;
-                break;
+                NEXT;
 
             ///
-            /// Pop Num
+            /// Push Num
             ///
-            case OpCode::PopN:
-                POPN(REG0);
-                ++_ip;
-                break;
+            OPCASE(PushN):
+                this->PushNull(REG0);
+                NEXT;
+
+            ///
+            /// Compare And Branch
+            ///
+            OPCASE(BrLT):
+                QUICKENINT2(BrLTII);
+                COMPBRANCHOP(<);
+                NEXT;
+
+            OPCASE(BrLTE):
+                QUICKENINT2(BrLTEII);
+                COMPBRANCHOP(<=);
+                NEXT;
+
+            OPCASE(BrGT):
+                QUICKENINT2(BrGTII);
+                COMPBRANCHOP(>);
+                NEXT;
+
+            OPCASE(BrGTE):
+                QUICKENINT2(BrGTEII);
+                COMPBRANCHOP(>=);
+                NEXT;
+
+            ///
+            /// Arithmetic With Immediate
+            ///
+            OPCASE(AddImm):
+                QUICKENINT1(AddImmI);
+                MATHIMMOP(+, LoadInt, LoadFloat);
+                NEXT;
+
+            OPCASE(MulImm):
+                QUICKENINT1(MulImmI);
+                MATHIMMOP(*, LoadInt, LoadFloat);
+                NEXT;
+
+            ///
+            /// Scalar Only Destination
+            ///
+            OPCASE(LoadIntS):
+                this->LoadScalarInt(REG0, StackType::Int, _ip->integer);
+                NEXT;
+
+            OPCASE(StoreS):
+                {
+                    StackVal& dest = (_framePointer + REG0)->v;
+                    StackVal& src = (_framePointer + REG1)->v;
+                    VERIFYSCALAR(dest);
+                    VERIFYSCALAR(src);
+                    dest = src;
+                }
+                NEXT;
+
+            OPCASE(AddS):
+                QUICKENINT2(AddIIS);
+                MATHOP(+, LoadScalarInt, LoadScalarFloat);
+                NEXT;
+
+            OPCASE(SubS):
+                QUICKENINT2(SubIIS);
+                MATHOP(-, LoadScalarInt, LoadScalarFloat);
+                NEXT;
+
+            OPCASE(MulS):
+                QUICKENINT2(MulIIS);
+                MATHOP(*, LoadScalarInt, LoadScalarFloat);
+                NEXT;
+
+            OPCASE(AddImmS):
+                QUICKENINT1(AddImmIS);
+                MATHIMMOP(+, LoadScalarInt, LoadScalarFloat);
+                NEXT;
+
+            OPCASE(MulImmS):
+                QUICKENINT1(MulImmIS);
+                MATHIMMOP(*, LoadScalarInt, LoadScalarFloat);
+                NEXT;
+
+            ///
+            /// Int Specialized Arithmetic
+            ///
+            OPCASE(AddII):
+                MATHOPII(+, StackType::Int, Add, LoadInt);
+                NEXT;
+
+            OPCASE(SubII):
+                MATHOPII(-, StackType::Int, Sub, LoadInt);
+                NEXT;
+
+            OPCASE(MulII):
+                MATHOPII(*, StackType::Int, Mul, LoadInt);
+                NEXT;
+
+            OPCASE(IncI):
+                INCREMENTOPI(+, Inc);
+                NEXT;
+
+            OPCASE(DecI):
+                INCREMENTOPI(-, Dec);
+                NEXT;
+
+            OPCASE(AddImmI):
+                MATHIMMOPI(+, AddImm, LoadInt);
+                NEXT;
+
+            OPCASE(MulImmI):
+                MATHIMMOPI(*, MulImm, LoadInt);
+                NEXT;
+
+            OPCASE(AddIIS):
+                MATHOPII(+, StackType::Int, AddS, LoadScalarInt);
+                NEXT;
+
+            OPCASE(SubIIS):
+                MATHOPII(-, StackType::Int, SubS, LoadScalarInt);
+                NEXT;
+
+            OPCASE(MulIIS):
+                MATHOPII(*, StackType::Int, MulS, LoadScalarInt);
+                NEXT;
+
+            OPCASE(AddImmIS):
+                MATHIMMOPI(+, AddImmS, LoadScalarInt);
+                NEXT;
+
+            OPCASE(MulImmIS):
+                MATHIMMOPI(*, MulImmS, LoadScalarInt);
+                NEXT;
+
+            ///
+            /// Int Specialized Comparison
+            ///
+            OPCASE(LTII):
+                MATHOPII(<, StackType::Boolean, LT, LoadInt);
+                NEXT;
+
+            OPCASE(GTII):
+                MATHOPII(>, StackType::Boolean, GT, LoadInt);
+                NEXT;
+
+            OPCASE(LTEII):
+                MATHOPII(<=, StackType::Boolean, LTE, LoadInt);
+                NEXT;
+
+            OPCASE(GTEII):
+                MATHOPII(>=, StackType::Boolean, GTE, LoadInt);
+                NEXT;
+
+            OPCASE(BrLTII):
+                COMPBRANCHOPII(<, BrLT);
+                NEXT;
+
+            OPCASE(BrLTEII):
+                COMPBRANCHOPII(<=, BrLTE);
+                NEXT;
+
+            OPCASE(BrGTII):
+                COMPBRANCHOPII(>, BrGT);
+                NEXT;
+
+            OPCASE(BrGTEII):
+                COMPBRANCHOPII(>=, BrGTE);
+                NEXT;
+
+#if SCRPT_THREADED_DISPATCH && SCRPT_JIT
+            ///
+            /// Record For The JIT
+            ///
+            Label_Record:
+                if (!_jit->Record(_ip, _framePointer)) activeTable = dispatchTable;
+                goto *dispatchTable[(int)OPCODE];
+#endif
 
+#if !SCRPT_THREADED_DISPATCH
             default:
                 this->ThrowErr(Err::VM_NotImplemented);
                 break;
@@ -871,6 +2211,97 @@ namespace scrpt
 
             ++_ip;
         }
+#endif
+
+        #undef OPCASE
+        #undef NEXT
+        #undef JUMP
+        #undef DISPATCH
+        #undef PROFILEOP
+#if SCRPT_JIT
+        #undef STARTRECORDING
+#endif
+    }
+
+    void VM::DumpOpPairProfile(size_t count)
+    {
+#if SCRPT_PROFILE_OPS
+        typedef std::tuple<unsigned long long, OpCode, OpCode> PairCount;
+        std::vector<PairCount> pairs;
+        unsigned long long total = 0;
+        for (int first = 0; first < (int)OpCode::__Num; ++first)
+        {
+            for (int second = 0; second < (int)OpCode::__Num; ++second)
+            {
+                unsigned long long n = s_opPairCounts[first][second];
+                if (n == 0 || first == (int)OpCode::Unknown) continue;
+                pairs.push_back(PairCount(n, (OpCode)first, (OpCode)second));
+                total += n;
+            }
+        }
+
+        std::sort(pairs.begin(), pairs.end(), std::greater<PairCount>());
+        std::cout << "[OP PAIRS] " << total << " dispatches" << std::endl;
+        for (size_t idx = 0; idx < pairs.size() && idx < count; ++idx)
+        {
+            std::cout << std::setw(12) << std::setfill(' ') << std::get<0>(pairs[idx]) << " "
+                << std::fixed << std::setprecision(2) << std::setw(6) << 100.0 * std::get<0>(pairs[idx]) / total << "% "
+                << std::string(OpCodeToString(std::get<1>(pairs[idx]))).substr(8) << " -> "
+                << std::string(OpCodeToString(std::get<2>(pairs[idx]))).substr(8) << std::endl;
+        }
+        std::cout.unsetf(std::ios_base::floatfield);
+#else
+        std::cout << "[OP PAIRS] Build with SCRPT_PROFILE_OPS to collect op pair counts" << std::endl;
+#endif
+    }
+
+    SlabStats VM::GetObjectStats()
+    {
+        return RefSlab::GetStats();
+    }
+
+    void VM::ReserveStack(size_t slots)
+    {
+        // Address space for the whole ceiling is reserved so the stack never moves, frames and compiled code
+        // hold pointers into it. Only the part in use is committed.
+        size_t initial = std::min(slots, (size_t)INITIALSTACKSIZE);
+        void* memory = ReserveMemory(slots * sizeof(StackObj));
+        if (memory == nullptr || !CommitMemory(memory, initial * sizeof(StackObj)))
+        {
+            if (memory != nullptr) ReleaseMemory(memory, slots * sizeof(StackObj));
+            throw CreateEx("Failed to reserve the stack", Err::VM_StackOverflow);
+        }
+
+        _stackRoot = (StackObj*)memory;
+        _stackLimit = _stackRoot + initial;
+        _maxStackSize = slots;
+        _stackPointer = _stackRoot;
+    }
+
+    void VM::ReleaseStack()
+    {
+        if (_stackRoot != nullptr)
+        {
+            ReleaseMemory(_stackRoot, _maxStackSize * sizeof(StackObj));
+            _stackRoot = _stackLimit = _stackPointer = nullptr;
+        }
+    }
+
+    void VM::GrowStack(size_t slots)
+    {
+        // Commits at least twice what was committed, which reads as null, up to the ceiling
+        size_t needed = (_stackPointer - _stackRoot) + slots;
+        if (needed > _maxStackSize)
+        {
+            this->ThrowErr(Err::VM_StackOverflow);
+        }
+
+        size_t size = std::min(std::max(needed, (size_t)(_stackLimit - _stackRoot) * 2), _maxStackSize);
+        if (!CommitMemory(_stackRoot, size * sizeof(StackObj)))
+        {
+            this->ThrowErr(Err::VM_StackOverflow);
+        }
+        _stackLimit = _stackRoot + size;
     }
 
     void VM::PushStackFrame(unsigned int returnIp, int framePointerOffset)
@@ -881,81 +2312,183 @@ namespace scrpt
         ++_stackPointer;
     }
 
+    // Returns the instruction the caller continues at, or null when the entry frame returned and left its result in
+    // _returnValue
+    const Instruction* VM::PopStackFrame(int returnReg)
+    {
+        Move(_framePointer + returnReg, &_returnValue);
+        while (_stackPointer > _framePointer)
+        {
+            POP1;
+        }
+        StackObj* stackFrame = _stackPointer - 1;
+        int framePointerOffset = stackFrame->frame.framePointerOffset;
+        unsigned int returnIp = stackFrame->frame.returnIp;
+        POPFRAME;
+
+        if (framePointerOffset == 0) return nullptr;
+
+        // The call that pushed the frame is the instruction before the return point. Its arguments are released
+        // and the result goes straight to its result register.
+        const Instruction* call = &_code[returnIp - 1];
+        POPN(call->reg1);
+        _framePointer -= framePointerOffset;
+        Move(&_returnValue, _framePointer + call->reg2);
+        return &_code[returnIp];
+    }
+
+    // Turns the current frame into the frame of a tail call, keeping its return point. The call's arguments replace
+    // the top of the current ones and the rest are released along with the registers.
+    void VM::ReuseStackFrame(int nParam, int nCallerParam)
+    {
+        StackObj* args = _stackPointer - nParam;
+        StackObj* params = _framePointer - 1 - nParam;
+        for (int arg = 0; arg < nParam; ++arg)
+        {
+            Move(args + arg, params + arg);
+        }
+
+        for (StackObj* unused = _framePointer - 1 - nCallerParam; unused < params; ++unused)
+        {
+            Deref(&unused->v);
+            unused->v.SetNull();
+        }
+
+        while (_stackPointer > _framePointer)
+        {
+            POP1;
+        }
+    }
+
+#if SCRPT_JIT
+    // Mirrors the Call and CallDirect handlers for a compiled caller. Anything the handler would need to raise an
+    // error for, or a callee that is not compiled, returns the call itself for the interpreter to run.
+    const Instruction* VM::JitCall(VM* vm, unsigned int funcId, const Instruction* ip)
+    {
+        const FunctionData& fd = vm->_functions[funcId];
+        if (fd.external || fd.nParam != ip->reg1) return ip;
+
+        MethodJit::MethodFunc method = vm->_methodJit->GetMethod(funcId);
+        if (method == nullptr) return ip;
+
+        if (vm->_stackPointer + 1 + fd.nLocalRegisters > vm->_stackLimit) return ip;
+        if (vm->_jitCallDepth >= MAXJITCALLDEPTH) return ip;
+
+        int framePointerOffset = (int)(vm->_stackPointer - vm->_framePointer + 1);
+        vm->PushStackFrame((unsigned int)(ip + 1 - vm->_code), framePointerOffset);
+        vm->_framePointer = vm->_stackPointer;
+        vm->PushNull(fd.nLocalRegisters);
+        ++vm->_jitCallDepth;
+        const Instruction* resume = method(vm->_framePointer);
+        --vm->_jitCallDepth;
+        return resume;
+    }
+
+    const Instruction* VM::JitRet(VM* vm, int reg)
+    {
+        return vm->PopStackFrame(reg);
+    }
+
+    // A compiled function's tail call to itself, which needs no more registers than the frame already had
+    void VM::JitTailCall(VM* vm, const Instruction* ip)
+    {
+        vm->ReuseStackFrame(ip->reg1, ip->reg2);
+        vm->PushNull(ip->reg0);
+    }
+
+    void VM::JitCopy(StackObj* src, StackObj* dest)
+    {
+        Copy(src, dest);
+    }
+
+    void VM::JitBlindCopy(StackObj* src, StackObj* dest)
+    {
+        BlindCopy(src, dest);
+    }
+#endif
+
     void VM::PushNull(size_t num /* = 1 */)
     {
-        CHECKSTACK
-        Assert(num <= 256, "Mass null push over limit");
+        if (_stackPointer + num > _stackLimit) this->GrowStack(num);
         while (num-- > 0)
         {
-            _stackPointer->v.type = StackType::Null;
+            _stackPointer->v.SetNull();
             ++_stackPointer;
         }
     }
 
-    void VM::LoadNull(char reg)
+    void VM::LoadNull(int reg)
     {
         StackVal& v = (_framePointer + reg)->v;
         Deref(&v);
-        v.type = StackType::Null;
+        v.SetNull();
     }
 
-    void VM::LoadInt(char reg, StackType type, int val)
+    void VM::LoadInt(int reg, StackType type, int val)
     {
         StackVal& v = (_framePointer + reg)->v;
         Deref(&v);
-        v.type = type;
-        v.integer = val;
+        v.SetInt(type, val);
     }
 
-    void VM::LoadFloat(char reg, float val)
+    // Stores into registers that BytecodeGen proved never hold a ref counted value, so there is nothing to Deref
+    void VM::LoadScalarInt(int reg, StackType type, int val)
     {
         StackVal& v = (_framePointer + reg)->v;
-        Deref(&v);
-        v.type = StackType::Float;
-        v.fp = val;
+        VERIFYSCALAR(v);
+        v.SetInt(type, val);
     }
 
-    void VM::LoadString(char reg, const char* string)
+    void VM::LoadScalarFloat(int reg, float val)
     {
-        AssertNotNull(string);
+        StackVal& v = (_framePointer + reg)->v;
+        VERIFYSCALAR(v);
+        v.SetFloat(val);
+    }
 
+    void VM::LoadFloat(int reg, float val)
+    {
         StackVal& v = (_framePointer + reg)->v;
         Deref(&v);
-        v.type = StackType::DynamicString;
-        v.ref = new StackRef{ 1, new std::string(string) };
+        v.SetFloat(val);
     }
 
-    const FunctionData& VM::GetFunction(unsigned int id) const
+    void VM::LoadString(int reg, const char* string)
     {
-        return _bytecode.functions[id];
+        AssertNotNull(string);
+
+        StackVal& v = (_framePointer + reg)->v;
+        Deref(&v);
+        v.SetRef(StackType::DynamicString, NewRef<std::string>(_currentArena, string));
     }
 
-    void VM::LoadString(char reg, unsigned int id)
+    void VM::LoadString(int reg, std::string&& string)
     {
+        StackRef* ref = NewRef<std::string>(_currentArena, std::move(string));
         StackVal& v = (_framePointer + reg)->v;
         Deref(&v);
-        v.type = StackType::StaticString;
-        v.staticString = _bytecode.strings[id].c_str();
+        v.SetRef(StackType::DynamicString, ref);
     }
 
-    void VM::LoadList(char reg, List* list)
+    const FunctionData& VM::GetFunction(unsigned int id) const
     {
-        AssertNotNull(list);
+        return _program->GetFunction(id);
+    }
 
+    void VM::LoadStaticString(int reg, const char* string)
+    {
         StackVal& v = (_framePointer + reg)->v;
         Deref(&v);
-        v.type = StackType::List;
-        v.ref = new StackRef{ 1, list };
+        v.SetStaticString(string);
     }
 
-    inline void VM::LoadMap(char reg, Map* map)
+    void VM::LoadRef(int reg, StackType type, StackRef* ref)
     {
-        AssertNotNull(map);
+        AssertNotNull(ref);
 
         StackVal& v = (_framePointer + reg)->v;
         Deref(&v);
-        v.type = StackType::Map;
-        v.ref = new StackRef{ 1, map };
+        v.SetRef(type, ref);
     }
 
     StackObj* VM::GetParamBase(ParamId id)
@@ -975,24 +2508,9 @@ namespace scrpt
         throw CreateEx("", err);
     }
 
-    const FunctionData& VM::LookupFunction(unsigned int ip) const
-    {
-        Assert(_bytecode.functions.size() > 0, "Cannot perform lookup with no functions");
-
-        for (size_t idx = 0; idx < _bytecode.functions.size() - 1; ++idx)
-        {
-            if (_bytecode.functions[idx].entry <= ip && _bytecode.functions[idx + 1].entry > ip)
-            {
-                return _bytecode.functions[idx];
-            }
-        }
-
-        return _bytecode.functions.back();
-    }
-
-    void VM::FormatCallstackFunction(unsigned int ip, std::stringstream& ss) const
+    void VM::FormatCallstackFunction(unsigned int offset, std::stringstream& ss) const
     {
-        const FunctionData& fd = this->LookupFunction(ip);
+        const FunctionData& fd = _program->LookupFunction(offset);
         ss << "> " << fd.name << "(";
         for (int idx = 0; idx < fd.nParam; ++idx)
         {
@@ -1008,11 +2526,11 @@ namespace scrpt
         ss << ")" << std::endl;
     }
 
-    std::string VM::CreateCallstack(unsigned int startingIp)
+    std::string VM::CreateCallstack(const Instruction* startingIp)
     {
         std::stringstream ss;
         ss << std::endl;
-        this->FormatCallstackFunction(startingIp, ss);
+        this->FormatCallstackFunction(_program->GetBytecodeOffset(startingIp), ss);
 
         while (_stackPointer > _stackRoot)
         {
@@ -1021,8 +2539,10 @@ namespace scrpt
                 StackObj* stackFrame = _stackPointer - 1;
                 if (stackFrame->frame.framePointerOffset != 0)
                 {
-                    this->FormatCallstackFunction(stackFrame->frame.returnIp, ss);
+                    this->FormatCallstackFunction(_program->GetBytecodeOffset(&_code[stackFrame->frame.returnIp]), ss);
                     _framePointer -= stackFrame->frame.framePointerOffset;
+                    POPFRAME
+                    continue;
                 }
                 else
                 {
@@ -1036,16 +2556,34 @@ namespace scrpt
         return ss.str();
     }
 
-    void VM::ConditionalJump(StackObj* obj, int test, unsigned int dest)
+    void ShareValue(StackVal* val)
     {
-        if (obj->v.type != StackType::Boolean) this->ThrowErr(Err::VM_UnsupportedOperandType);
-        if (obj->v.integer == test)
+        AssertNotNull(val);
+
+        // Objects already shared were shared along with everything they reach, which also ends cycles
+        if (!IsRefCounted(val->GetType()) || val->GetRef()->shared)
         {
-            _ip = dest - 1;
+            return;
         }
-        else
+
+        // Other threads will use its count, so it can't stay a candidate root of the collector
+        StackRef* ref = val->GetRef();
+        if (ref->buffered && t_cycleRoots != nullptr)
+        {
+            auto root = std::find_if(t_cycleRoots->begin(), t_cycleRoots->end(), [&](const StackVal& candidate) { return candidate.GetRef() == ref; });
+            if (root != t_cycleRoots->end()) t_cycleRoots->erase(root);
+            ref->buffered = false;
+            SetColor(ref, CycleColor::Black);
+        }
+
+        ref->shared = true;
+        if (val->GetType() == StackType::List)
+        {
+            for (StackObj& item : *ref->list) ShareValue(&item.v);
+        }
+        else if (val->GetType() == StackType::Map)
         {
-            _ip += 5;
+            for (auto& entry : *ref->map) ShareValue(&entry.second.v);
         }
     }
 
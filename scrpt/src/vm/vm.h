@@ -15,25 +15,76 @@ namespace scrpt
         _4,
     };
 
+    struct CycleCollectorStats
+    {
+        size_t collections;
+        size_t freedObjects;
+        double totalPauseMs;
+        double maxPauseMs;
+    };
+
+    // A VM runs one call at a time and must only be used by one thread at a time. To run a script on several threads,
+    // give each thread its own VM made from a shared Program. The program is immutable, and each VM has its own stack,
+    // registers, return value and JIT. Values created by one VM are never visible to another. Externs are called on
+    // whichever thread is running the script, so they must be safe to call concurrently.
     class VM
     {
     public:
         VM();
+        // Runs an already built program, e.g. one taken from another VM, with a stack of its own. Nothing is compiled
+        // or decoded again.
+        explicit VM(std::shared_ptr<const Program> program);
         ~VM();
 
         void AddExternFunc(const char* name, unsigned char nParam, const std::function<void(VM*)>& func);
 		void AddSource(std::shared_ptr<const char> source);
 		void Finalize();
+        // Enables the AST optimization pass that Finalize runs before bytecode generation, on by default
+        void SetAstOptimization(bool enabled);
+        // Largest function body, in AST nodes, that Finalize compiles inline at its call sites. 0 turns it off.
+        void SetInlineBudget(size_t nodes);
+        // Most stack slots a script may use before it fails with VM_StackOverflow. The stack starts at a few KB
+        // and grows up to this on demand, which is a million slots unless set.
+        void SetMaxStackSize(size_t slots);
+        // Makes the strings, lists and maps of each Execute from an arena that is freed as a whole when it returns,
+        // without following references between them. The return value is moved out of the arena first. Suits calls
+        // that build large structures and throw them away, as nothing made during the call is freed before it
+        // returns. Externs must not keep values they are passed past the call.
+        void SetExecuteArena(bool enabled);
+        // Lists and maps a script can make before the VM looks for garbage reference cycles in the middle of an
+        // Execute. Every Execute also collects before it returns. 0 only collects on return.
+        void SetCycleBudget(size_t allocations);
+        // Frees lists and maps that die during an Execute a slice at a time rather than all at once, so dropping a
+        // large structure doesn't stall the script and a deep one can't overflow the native stack. The VM frees up
+        // to slice entries and objects each time a function returns or a list or map is made, and frees the rest
+        // before Execute returns. 0, the default, frees them as they die.
+        void SetDeferredFree(size_t slice);
+        const CycleCollectorStats& GetCycleCollectorStats() const;
+        const AstOptimizerStats& GetAstOptimizerStats() const;
+        const BytecodeGenStats& GetBytecodeGenStats() const;
+        // Loads a compiled image in place of AddSource and Finalize. Externs must already be added.
+        void LoadImage(const char* path);
+        void SaveImage(const char* path);
         void Decompile();
+        // The program this VM runs, finalizing the sources first if they haven't been
+        std::shared_ptr<const Program> GetProgram();
         StackVal* Execute(const char* funcName);
+        // Calls a function with arguments from outside the VM, such as values owned by a VM on another thread.
+        // Strings, lists and maps are copied deeply so the VM never shares an object with their owner.
+        StackVal* Execute(unsigned int funcId, const StackVal* args, unsigned char nArgs);
+        // Hands the result of the last Execute to the caller, who then owns it. Apart from shared objects, nothing
+        // in the result is referenced by another VM.
+        StackVal TakeResult();
 
         void SetExternResult(StackType type, int val);
+        // Makes the result a new list of size nulls, returned for the extern to fill in
+        List* SetExternListResult(size_t size);
 
         void PushNull(size_t num = 1);
-        void LoadNull(char reg);
-        void LoadInt(char reg, StackType type, int val);
-        void LoadFloat(char reg, float val);
-        void LoadString(char reg, const char* string);
+        void LoadNull(int reg);
+        void LoadInt(int reg, StackType type, int val);
+        void LoadFloat(int reg, float val);
+        void LoadString(int reg, const char* string);
         template<typename T> T GetParam(ParamId id);
         template<> int GetParam<int>(ParamId id);
         template<> float GetParam<float>(ParamId id);
@@ -43,82 +94,128 @@ namespace scrpt
         template<> StackVal* GetParam<StackVal*>(ParamId id);
         const FunctionData& GetFunction(unsigned int id) const;
 
+        // Prints the most frequently executed opcode pairs, requires a SCRPT_PROFILE_OPS build. The counts are
+        // shared by every VM and are not reliable while VMs run on several threads.
+        static void DumpOpPairProfile(size_t count);
+
+        // Strings, lists and maps live in slab blocks shared by every VM in the process. Live counts them all, and
+        // peak is the most made and not yet freed on any one thread.
+        static SlabStats GetObjectStats();
+
     private:
 		std::unique_ptr<Parser> _parser;
         std::unique_ptr<BytecodeGen> _compiler;
-        Bytecode _bytecode;
-        std::map<std::string, unsigned int> _functionMap;
-
-        unsigned int _ip;
-        std::vector<StackObj> _stack;
+        bool _astOptimization;
+        AstOptimizerStats _astOptimizerStats;
+        BytecodeGenStats _bytecodeGenStats;
+        std::shared_ptr<const Program> _program;
+        // Held by the program, cached here for the dispatch loop
+        const Instruction* _code;
+        const FunctionData* _functions;
+        const Instruction* const* _functionEntries;
+#if SCRPT_JIT
+        std::unique_ptr<Jit> _jit;
+        std::unique_ptr<MethodJit> _methodJit;
+        int _jitCallDepth; // Compiled calls currently nested on the native stack
+#endif
+
+        const Instruction* _ip;
 		StackObj* _stackRoot;
+        StackObj* _stackLimit; // End of the committed part of the stack
+        size_t _maxStackSize; // Slots reserved for the stack, which it never grows past
         StackObj* _stackPointer;
         StackObj* _framePointer;
         StackObj _returnValue;
         int _currentExternArgN;
-
+        std::unique_ptr<Arena> _arena;
+        Arena* _currentArena; // The arena while an Execute is running in it, where new objects are made
+        std::vector<StackVal> _cycleRoots; // Lists and maps whose count dropped but not to zero, during an Execute
+        size_t _cycleBudget;
+        size_t _cycleAllocations; // Lists and maps made since the last collection
+        CycleCollectorStats _cycleStats;
+        std::vector<StackVal> _freeQueue; // Lists and maps that died and are still being freed, during an Execute
+        size_t _freeSlice;
+
+        void AttachProgram(std::shared_ptr<const Program> program);
+        void ReleaseArena();
+        void CollectCycles();
+        friend struct ExecuteScope;
         void Run();
+        void ReserveStack(size_t slots);
+        void ReleaseStack();
+        void GrowStack(size_t slots);
 
         inline void PushStackFrame(unsigned int returnIp, int framePointerOffset);
-        inline void LoadString(char reg, unsigned int id);
-        inline void LoadList(char reg, List* list);
-        inline void LoadMap(char reg, Map* map);
+        inline const Instruction* PopStackFrame(int returnReg);
+        inline void ReuseStackFrame(int nParam, int nCallerParam);
+        inline void LoadScalarInt(int reg, StackType type, int val);
+        inline void LoadScalarFloat(int reg, float val);
+        inline void LoadStaticString(int reg, const char* string);
+        void LoadString(int reg, std::string&& string);
+        inline void LoadRef(int reg, StackType type, StackRef* ref);
         inline void ThrowErr(Err err) const;
-        const FunctionData& LookupFunction(unsigned int ip) const;
-        void FormatCallstackFunction(unsigned int ip, std::stringstream& ss) const;
-        std::string CreateCallstack(unsigned int startingIp);
+        void FormatCallstackFunction(unsigned int offset, std::stringstream& ss) const;
+        std::string CreateCallstack(const Instruction* startingIp);
         StackObj* GetParamBase(ParamId id);
 
-        void ConditionalJump(StackObj* obj, int test, unsigned int dest);
+#if SCRPT_JIT
+        // Support routines called from compiled methods, which must not throw
+        friend class MethodJit;
+        static const Instruction* JitCall(VM* vm, unsigned int funcId, const Instruction* ip);
+        static const Instruction* JitRet(VM* vm, int reg);
+        static void JitTailCall(VM* vm, const Instruction* ip);
+        static void JitCopy(StackObj* src, StackObj* dest);
+        static void JitBlindCopy(StackObj* src, StackObj* dest);
+#endif
     };
 
     template<>
     inline int VM::GetParam(ParamId id)
     {
         StackObj* obj = this->GetParamBase(id);
-        if (obj->v.type != StackType::Int)
+        if (obj->v.GetType() != StackType::Int)
         {
             this->ThrowErr(Err::VM_UnexpectedParamType);
         }
 
-        return obj->v.integer;
+        return obj->v.GetInt();
     }
 
     template<>
     inline float VM::GetParam(ParamId id)
     {
         StackObj* obj = this->GetParamBase(id);
-        if (obj->v.type != StackType::Float)
+        if (obj->v.GetType() != StackType::Float)
         {
             this->ThrowErr(Err::VM_UnexpectedParamType);
         }
 
-        return obj->v.fp;
+        return obj->v.GetFloat();
     }
 
     template<>
     inline bool VM::GetParam(ParamId id)
     {
         StackObj* obj = this->GetParamBase(id);
-        if (obj->v.type != StackType::Boolean)
+        if (obj->v.GetType() != StackType::Boolean)
         {
             this->ThrowErr(Err::VM_UnexpectedParamType);
         }
 
-        return !(obj->v.integer == 0);
+        return !(obj->v.GetInt() == 0);
     }
 
     template<>
     inline const char* VM::GetParam(ParamId id)
     {
         StackObj* obj = this->GetParamBase(id);
-        if (obj->v.type == StackType::DynamicString)
+        if (obj->v.GetType() == StackType::DynamicString)
         {
-            return obj->v.ref->string->c_str();
+            return obj->v.GetRef()->string->c_str();
         }
-        else if (obj->v.type == StackType::StaticString)
+        else if (obj->v.GetType() == StackType::StaticString)
         {
-            return obj->v.staticString;
+            return obj->v.GetStaticString();
         }
 
         this->ThrowErr(Err::VM_UnexpectedParamType);
@@ -129,12 +226,12 @@ namespace scrpt
     inline List* VM::GetParam(ParamId id)
     {
         StackObj* obj = this->GetParamBase(id);
-        if (obj->v.type != StackType::List)
+        if (obj->v.GetType() != StackType::List)
         {
             this->ThrowErr(Err::VM_UnexpectedParamType);
         }
 
-        return obj->v.ref->list;
+        return obj->v.GetRef()->list;
     }
 
     template<>
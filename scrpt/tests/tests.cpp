@@ -10,10 +10,18 @@ enum class Phase
     Parser,
     BytecodeGen,
     VM,
+    Image, // VM test run from a saved and reloaded bytecode image
+    Optimizer, // VM test that must give the same result with and without the AST optimizer and optimize something
+    Inliner, // VM test that must give the same result with and without inlining and inline some call
+    Shared, // VM test run again in a second VM sharing the first one's program after the first has run it
+    Threaded, // VM test run concurrently on several threads, each in its own VM sharing one program
+    Arena, // VM test run with the Execute arena on, whose main returns a list that is checked by its first item
+    Deferred, // VM test run with deferred freeing on, in small slices
 };
 
 static bool ExecuteTest(const char* testName, Phase phase, int resultValue, scrpt::Err resultErr, bool verbose, bool perfTest, const char* source);
 static std::shared_ptr<const char> DuplicateSource(const char* source);
+static bool ExecuteThreaded(std::shared_ptr<const scrpt::Program> program, int resultValue, unsigned int nThreads, int nRuns, double* runtime);
 
 void scrpt::RunTests()
 {
@@ -44,6 +52,9 @@ void scrpt::RunTests()
     //ACCUMTEST("", Phase::, 0, scrpt::Err::, false, false, R"testCode(
     //)testCode");
 
+    // List and stack memory scale directly with the value size, so record it alongside perf results
+    if (testPerf) std::cout << "StackObj size: " << sizeof(scrpt::StackObj) << " bytes" << std::endl;
+
     // Lexer
     // 
 
@@ -77,6 +88,16 @@ func main() {
     // Bytecode Gen
     //
 
+    ACCUMTEST("Call arity", Phase::BytecodeGen, 0, scrpt::Err::BytecodeGen_IncorrectCallArity, false, false, R"testCode(
+func main() {
+    return add(1, 2, 3);
+}
+
+func add(a, b) {
+    return a + b;
+}
+)testCode");
+
     // TODO: Missing var decl
     // TODO: Double decl
 
@@ -85,7 +106,7 @@ func main() {
 
     ACCUMTEST("Complex Expansion", Phase::VM, 11, scrpt::Err::NoError, false, false, R"testCode(
 func main() {
-    foo()[1][2].blah("hello world");
+    return foo()[1][2].blah("hello world");
 }
 
 func foo() {
@@ -111,7 +132,7 @@ func main() {
 }
 )testCode");
 
-    ACCUMTEST("Loop counting", Phase::VM, 300000, scrpt::Err::NoError, false, false, R"testCode(
+    ACCUMTEST("Loop counting", Phase::VM, 300000, scrpt::Err::NoError, false, true, R"testCode(
 func main() {
     var sum = 0;
     var max = 100000;
@@ -146,7 +167,7 @@ func main() {
 }
 )testCode");
 
-    ACCUMTEST("Fibonacci Recursive", Phase::VM, 6765, scrpt::Err::NoError, false, false, R"testCode(
+    ACCUMTEST("Fibonacci Recursive", Phase::VM, 6765, scrpt::Err::NoError, false, true, R"testCode(
 func main() {
     return fib(20);
 }
@@ -180,6 +201,465 @@ func main() {
 func main() {
     return 2 - (5 + 2);
 }
+)testCode");
+
+    ACCUMTEST("Quickened ops with changing types", Phase::VM, 109, scrpt::Err::NoError, false, false, R"testCode(
+func add(a, b) {
+    return a + b;
+}
+
+func main() {
+    var result = 0;
+    for (var i = 0; i < 4; ++i)
+        result = add(result, i);
+
+    var f = add(0.5, 0.25);
+    if (f > 0.7 && f < 0.8)
+        result = result + 100;
+
+    var count = 0;
+    for (var j = 0; j < 3; ++j) {
+        if (count == 1)
+            j = 1.5;
+        ++count;
+    }
+
+    return result + count;
+}
+)testCode");
+
+    ACCUMTEST("Registers mixing lists and numbers", Phase::VM, 9, scrpt::Err::NoError, false, false, R"testCode(
+func main() {
+    var total = 0;
+    var x = 1;
+    for (var i = 0; i < 3; ++i) {
+        total = total + x;
+        x = [i, i];
+        total = total + length(x);
+        x = i * 2;
+    }
+
+    return total;
+}
+)testCode");
+
+    ACCUMTEST("Registers shared by short lived locals", Phase::VM, 47, scrpt::Err::NoError, false, false, R"testCode(
+func main() {
+    var a = 3;
+    var b = a * 4;
+    var unset;
+    var s = "v" # unset;
+    var total = 0;
+    for (var i = 0; i < 5; ++i) {
+        var sq = i * i;
+        var copy = sq;
+        total = total + copy;
+    }
+    var c = total + b;
+    return c + strlen(s);
+}
+)testCode");
+
+    ACCUMTEST("Redundant stores and unreachable code", Phase::VM, 220, scrpt::Err::NoError, false, false, R"testCode(
+func pick(n) {
+    if (n > 10) {
+        return n - 10;
+    } else {
+        return n + 10;
+    }
+    n = 99;
+    return n;
+}
+
+func triple(n) {
+    n = n * 3;
+    return n;
+}
+
+func main() {
+    var total = 0;
+    var unused = 5;
+    unused = 6;
+    for (var i = 0; i < 20; ++i) {
+        var t = pick(i);
+        total += t;
+    }
+    var s = "x";
+    s #= total;
+    return total + strlen(s) + triple(2);
+}
+)testCode");
+
+    ACCUMTEST("Hot loop with floats and side exits", Phase::VM, 1011, scrpt::Err::NoError, false, false, R"testCode(
+func main() {
+    var f = 0.5;
+    var x = 0;
+    var n = 0;
+    var last = 0;
+    for (var i = 0; i < 1000; ++i) {
+        f = f * 1.0 + 0.25;
+        if (i < 500)
+            n = n + 2;
+        else
+            n = n - 1;
+        if (i == 700)
+            x = 0.5;
+        x = x + 1;
+        if (i == 999)
+            last = -n;
+    }
+
+    var result = n - last;
+    if (f == 250.5)
+        result = result + 1;
+    if (x == 300.5)
+        result = result + 10;
+    return result;
+}
+)testCode");
+
+    ACCUMTEST("Hot functions with mixed types", Phase::VM, 8451, scrpt::Err::NoError, false, false, R"testCode(
+func scale(a, b) {
+    var r = a * b;
+    if (r > 100)
+        r = r - 100;
+    return r;
+}
+
+func build(n) {
+    if (n == 0)
+        return [];
+    var l = build(n - 1);
+    l #= n;
+    return l;
+}
+
+func main() {
+    var total = 0;
+    for (var i = 0; i < 100; ++i)
+        total = total + scale(i, 3);
+
+    var f = scale(1.5, 2);
+    if (f == 3.0)
+        total = total + 1;
+
+    for (var j = 0; j < 40; ++j)
+        total = total + length(build(5));
+    return total;
+}
+)testCode");
+
+    ACCUMTEST("Arguments passed in the callee frame", Phase::VM, 2213823, scrpt::Err::NoError, false, false, R"testCode(
+func join(a, b, c) {
+    var total = 0;
+    for (var i = 0; i < length(a); ++i)
+        total = total + a[i];
+    return total * 100 + strlen(b) * 10 + c;
+}
+
+func pick(l, i) {
+    if (i < 0)
+        return l;
+    return pick(l, i - 1);
+}
+
+func main() {
+    var counter = {"n": 1, "Step": Counter_Step};
+    var total = 0;
+    for (var i = 0; i < 50; ++i)
+        total = total + join([i, counter:Step(i)], "ab" # i, length(pick([1, 2, 3], i - i / 4 * 4)));
+    var fun = join;
+    total = total + fun(pick([5], 2), "xyz" # strlen("xyz"), counter:Step(join([], "", 7)));
+    return total;
+}
+
+func Counter_Step(this, by) {
+    this.n += by;
+    return this.n;
+}
+)testCode");
+
+    ACCUMTEST("Tail calls", Phase::VM, 1250028017, scrpt::Err::NoError, false, false, R"testCode(
+func sum(n, acc) {
+    if (n == 0)
+        return acc;
+    return sum(n - 1, acc + n);
+}
+
+func isEven(n, list) {
+    if (n == 0)
+        return length(list);
+    return isOdd(n - 1, list);
+}
+
+func isOdd(n, list) {
+    if (n == 0)
+        return 0;
+    return isEven(n - 1, list);
+}
+
+func countDown(n, step, list) {
+    if (n <= 0)
+        return finish(list);
+    return countDown(n - step, step, list);
+}
+
+func finish(list) {
+    return length(list) * 1000;
+}
+
+func widen(a) {
+    return pad(a, a, a);
+}
+
+func pad(a, b, c) {
+    return a + b + c;
+}
+
+func main() {
+    return sum(50000, 0) + isEven(30001, [1]) + isEven(30000, [1, 2]) + countDown(40000, 1, [1, 2, 3]) + widen(5);
+}
+)testCode");
+
+    ACCUMTEST("Deep recursion grows the stack", Phase::VM, 30000, scrpt::Err::NoError, false, false, R"testCode(
+func depth(n, list) {
+    if (n == 0)
+        return 0;
+    return 1 + depth(n - 1, list);
+}
+
+func main() {
+    return depth(30000, [1, 2, 3]);
+}
+)testCode");
+
+    ACCUMTEST("Unbounded recursion", Phase::VM, 0, scrpt::Err::VM_StackOverflow, false, false, R"testCode(
+func forever(n) {
+    return 1 + forever(n + 1);
+}
+
+func main() {
+    return forever(0);
+}
+)testCode");
+
+    ACCUMTEST("Bytecode image round trip", Phase::Image, 2482, scrpt::Err::NoError, false, false, R"testCode(
+func main() {
+    var s = "hello" # " image";
+    var l = [1, 2, 3];
+    return strlen(s) + length(l) + twice(testextern(12, 34));
+}
+
+func twice(x) {
+    return x * 2;
+}
+)testCode");
+
+    ACCUMTEST("Program shared between VMs", Phase::Shared, 5904, scrpt::Err::NoError, false, false, R"testCode(
+func main() {
+    var total = 0;
+    var names = ["shared", "program"];
+    var i = 0;
+    while (i < 100) {
+        total = total + scale(i) + strlen(names[i - i / 2 * 2]);
+        i = i + 1;
+    }
+    return total + testextern(3, 4);
+}
+
+func scale(x) {
+    return x;
+}
+)testCode");
+
+    ACCUMTEST("Program run on several threads", Phase::Threaded, 400140000, scrpt::Err::NoError, false, true, R"testCode(
+func main() {
+    var total = 0;
+    for (var i = 0; i < 20000; ++i) {
+        var pair = [i, i + 1];
+        total = total + add(pair[0], pair[1]) + strlen("threads");
+    }
+    return total;
+}
+
+func add(a, b) {
+    return a + b;
+}
+)testCode");
+
+    ACCUMTEST("Parallel map", Phase::VM, 332833526, scrpt::Err::NoError, false, false, R"testCode(
+func square(x) {
+    return x * x;
+}
+
+func size(s) {
+    return strlen(s);
+}
+
+func pair(x) {
+    return [x, x + 1];
+}
+
+func main() {
+    var numbers = [];
+    for (var i = 0; i < 1000; ++i)
+        numbers #= i;
+    var squares = parallel_map(numbers, square);
+    var total = 0;
+    for (var i = 0; i < length(squares); ++i)
+        total = total + squares[i];
+
+    var word = "eleven";
+    var words = ["one", "three", word # "de"];
+    var sizes = parallel_map(words, size);
+    var pairs = parallel_map([4, 9], pair);
+    parallel_for(100, square);
+    return total + sizes[0] + sizes[1] + sizes[2] + pairs[1][1];
+}
+)testCode");
+
+    ACCUMTEST("Failing parallel call", Phase::VM, 0, scrpt::Err::VM_UnsupportedOperandType, false, false, R"testCode(
+func suffix(x) {
+    return x + "s";
+}
+
+func main() {
+    return parallel_map([1, 2, 3], suffix);
+}
+)testCode");
+
+    ACCUMTEST("Shared objects", Phase::VM, 14851, scrpt::Err::NoError, false, false, R"testCode(
+func lookup(item) {
+    return item[0]["scale"] * item[1];
+}
+
+func main() {
+    var config = {"scale": 3, "names": ["a", "b"]};
+    share(config);
+    var items = [];
+    for (var i = 0; i < 100; ++i)
+        items #= [config, i];
+    var scaled = parallel_map(items, lookup);
+    var total = 0;
+    for (var i = 0; i < length(scaled); ++i)
+        total = total + scaled[i];
+    return total + length(config["names"]) - 1;
+}
+)testCode");
+
+    ACCUMTEST("Modified shared object", Phase::VM, 0, scrpt::Err::VM_ModifiedSharedObject, false, false, R"testCode(
+func main() {
+    var config = {"limits": [1, 2]};
+    share(config);
+    var limits = config["limits"];
+    limits[0] = 5;
+    return limits[0];
+}
+)testCode");
+
+    ACCUMTEST("Temporaries in the Execute arena", Phase::Arena, 39800, scrpt::Err::NoError, false, true, R"testCode(
+func build(n) {
+    var rows = [];
+    for (var i = 0; i < n; ++i)
+        rows #= {"id": i, "name": "row " # i, "tags": [i, i * 2]};
+    return rows;
+}
+
+func main() {
+    var total = 0;
+    for (var pass = 0; pass < 20; ++pass)
+    {
+        var rows = build(200);
+        total = 0;
+        for (var i = 0; i < length(rows); ++i)
+            total = total + rows[i]["tags"][1];
+    }
+
+    var rows = build(10);
+    var kept = [total, rows[5]["name"], rows[5], rows[5]["tags"]];
+    kept[2]["id"] = kept[1] # "!";
+    return kept;
+}
+)testCode");
+
+    ACCUMTEST("Constant folding", Phase::Optimizer, 930, scrpt::Err::NoError, false, false, R"testCode(
+func main() {
+    var day = 60 * 60 * 24;
+    var neg = -(3 - 10) * 2;
+    var f = 1.5 * 4 / 2;
+    var total = day / 100 + neg;
+    if (2 * 3 > 5 && true) total = total + 1;
+
+    if (false) total = 0;
+    elif (1 == 2) total = 0;
+    elif (true) total = total + strlen("ab" # 12 # true);
+    else total = 0;
+
+    var x = 21;
+    total = total + x * 2;
+    if (f == 3.0) total = total + 1;
+    return total;
+}
+)testCode");
+
+    ACCUMTEST("Pruned branches keep scope", Phase::Optimizer, 6, scrpt::Err::NoError, false, false, R"testCode(
+func main() {
+    var a = 1;
+    if (false) { var a = 5; }
+    else { var a = 3; a = a * 2; }
+    if (true) { var a = 9; }
+    if (1 > 2) a = 100;
+    return a * 2 + 5 - a;
+}
+)testCode");
+
+    ACCUMTEST("Inlined calls", Phase::Inliner, 1167, scrpt::Err::NoError, false, false, R"testCode(
+func get(list, i) {
+    return list[i];
+}
+
+func bump(n) {
+    n = n + 100;
+    return n;
+}
+
+func pair(a, b) {
+    return a * 10 + b;
+}
+
+func sign(n) {
+    if (n < 0) return -1;
+    if (n > 0) return 1;
+}
+
+func count(n) {
+    if (n == 0) return 0;
+    return 1 + count(n - 1);
+}
+
+func square(x) {
+    return pair(x, 0) * x / 10;
+}
+
+func main() {
+    var l = [4, 5, 6];
+    var total = 0;
+    for (var i = 0; i < 3; ++i)
+        total = total + get(l, i);
+
+    var x = 1;
+    total = total + bump(x) + x;
+
+    var y = 2;
+    total = total + pair(y, ++y) + y;
+
+    total = total + sign(-5) + sign(7) + strlen("s" # sign(0));
+    total = total + count(3);
+
+    var pair = 1000;
+    total = total + square(4) + pair;
+    return total;
+}
 )testCode");
 
     ACCUMTEST("FFI Stress", Phase::VM, 1234, scrpt::Err::NoError, false, true, R"testCode(
@@ -196,6 +676,18 @@ func main() {
     var a = "hello world" # "!";
     return strlen(a);
 }
+)testCode");
+
+    ACCUMTEST("String building", Phase::VM, 436670, scrpt::Err::NoError, false, true, R"testCode(
+func main() {
+    var total = 0;
+    for (var i = 0; i < 20000; ++i)
+    {
+        var line = "item " # i # ": " # (i * 0.5) # " " # (i < 10000);
+        total = total + strlen(line);
+    }
+    return total;
+}
 )testCode");
 
     ACCUMTEST("Quick sort", Phase::VM, 1, scrpt::Err::NoError, false, true, R"testCode(
@@ -241,6 +733,63 @@ func partition(list, left, right) {
 
     return i;
 }
+)testCode");
+
+    ACCUMTEST("Reference cycles", Phase::VM, 25000, scrpt::Err::NoError, false, false, R"testCode(
+func main() {
+    var total = 0;
+    for (var i = 0; i < 25000; ++i)
+    {
+        var counter = MakeCounter(i);
+        counter:Add(1);
+        var ring = [counter, [counter]];
+        ring[1] #= ring;
+        total = total + counter.owner.count - i;
+    }
+    return total;
+}
+
+func MakeCounter(start) {
+    var counter = {"count": start, "Add": Counter_Add};
+    counter["owner"] = counter;
+    return counter;
+}
+
+func Counter_Add(this, n) {
+    this.count += n;
+}
+)testCode");
+
+    ACCUMTEST("Freeing deep and large lists in slices", Phase::Deferred, 4990000, scrpt::Err::NoError, false, true, R"testCode(
+func main() {
+    // Too deep to free by recursing on the native stack
+    var deep = [0];
+    for (var i = 0; i < 200000; ++i)
+        deep = [deep];
+    deep = 0;
+
+    var total = 0;
+    for (var pass = 0; pass < 20; ++pass)
+    {
+        var rows = Build(500);
+        total = total + Sum(rows);
+    }
+    return total;
+}
+
+func Build(n) {
+    var rows = [];
+    for (var i = 0; i < n; ++i)
+        rows #= {"id": i, "tags": [i, i * 2]};
+    return rows;
+}
+
+func Sum(rows) {
+    var total = 0;
+    for (var i = 0; i < length(rows); ++i)
+        total = total + rows[i]["tags"][1];
+    return total;
+}
 )testCode");
 
     ACCUMTEST("First class function", Phase::VM, 7, scrpt::Err::NoError, false, false, R"testCode(
@@ -300,7 +849,7 @@ func Vec_Add(this, other) {
 }
 )testCode");
 
-    ACCUMTEST("Conway's Game of Life", Phase::VM, 29, scrpt::Err::NoError, false, false, R"testCode(
+    ACCUMTEST("Conway's Game of Life", Phase::VM, 29, scrpt::Err::NoError, false, true, R"testCode(
 func main() {
     var game = MakeGame(15);
     var generations = 5;
@@ -405,6 +954,10 @@ func Game_IsAlive(this, x, y) {
 )testCode");
 
     std::cout << passed << " passed and " << failed << " failed" << std::endl;
+
+#if SCRPT_PROFILE_OPS
+    scrpt::VM::DumpOpPairProfile(20);
+#endif
 }
 
 std::shared_ptr<const char> DuplicateSource(const char* source)
@@ -430,6 +983,45 @@ double ConvertTimeMS(LONGLONG time)
     return (time / (double)freq.QuadPart) * 1000.0;
 }
 
+// Runs main the given number of times in a VM of its own on each thread. Returns whether every run gave the
+// expected result, with the time taken in ms for all the threads.
+bool ExecuteThreaded(std::shared_ptr<const scrpt::Program> program, int resultValue, unsigned int nThreads, int nRuns, double* runtime)
+{
+    std::atomic<bool> passed(true);
+    std::vector<std::thread> threads;
+
+    LARGE_INTEGER startTime = GetTime();
+    for (unsigned int count = 0; count < nThreads; ++count)
+    {
+        threads.emplace_back([&]()
+        {
+            try
+            {
+                scrpt::VM vm(program);
+                for (int run = 0; run < nRuns; ++run)
+                {
+                    scrpt::StackVal* ret = vm.Execute("main");
+                    if (ret == nullptr || ret->GetInt() != resultValue) passed = false;
+                }
+            }
+            catch (scrpt::Exception& ex)
+            {
+                std::cout << ex.what() << std::endl;
+                passed = false;
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    LARGE_INTEGER endTime = GetTime();
+
+    *runtime = ConvertTimeMS(endTime.QuadPart - startTime.QuadPart);
+    return passed;
+}
+
 void randomInt(scrpt::VM* vm)
 {
     vm->SetExternResult(scrpt::StackType::Int, rand() % 100000);
@@ -454,6 +1046,13 @@ bool ExecuteTest(const char* testName, Phase phase, int resultValue, scrpt::Err
     case Phase::Parser: ss << "P"; break;
     case Phase::BytecodeGen: ss << "B"; break;
     case Phase::VM: ss << "V"; break;
+    case Phase::Image: ss << "I"; break;
+    case Phase::Optimizer: ss << "O"; break;
+    case Phase::Inliner: ss << "N"; break;
+    case Phase::Shared: ss << "S"; break;
+    case Phase::Threaded: ss << "T"; break;
+    case Phase::Arena: ss << "A"; break;
+    case Phase::Deferred: ss << "D"; break;
     }
     ss << "|" << testName << "> ";
 
@@ -535,22 +1134,114 @@ bool ExecuteTest(const char* testName, Phase phase, int resultValue, scrpt::Err
         break;
 
         case Phase::VM:
+        case Phase::Image:
+        case Phase::Optimizer:
+        case Phase::Inliner:
+        case Phase::Shared:
+        case Phase::Threaded:
+        case Phase::Arena:
+        case Phase::Deferred:
         {
             scrpt::Err err = scrpt::Err::NoError;
             bool gotExpectedResult = true;
             double runtime = 0.0;
+            long long liveObjects = scrpt::VM::GetObjectStats().live;
             try
             {
-                scrpt::VM vm;
-                scrpt::RegisterStdLib(vm);
-                vm.AddExternFunc("testextern", 2, testextern);
-                vm.AddExternFunc("randomInt", 0, randomInt);
-                vm.AddSource(DuplicateSource(source));
-                vm.Finalize();
+                auto addExterns = [](scrpt::VM& target)
+                {
+                    scrpt::RegisterStdLib(target);
+                    target.AddExternFunc("testextern", 2, testextern);
+                    target.AddExternFunc("randomInt", 0, randomInt);
+                };
+
+                scrpt::VM compiledVM;
+                addExterns(compiledVM);
+                compiledVM.AddSource(DuplicateSource(source));
+                compiledVM.Finalize();
+
+                // Image tests run in a second VM loaded from the first one's image
+                scrpt::VM imageVM;
+                if (phase == Phase::Image)
+                {
+                    fs::path imagePath = fs::temp_directory_path() / "scrpt_test.img";
+                    compiledVM.SaveImage(imagePath.string().c_str());
+                    addExterns(imageVM);
+                    imageVM.LoadImage(imagePath.string().c_str());
+                    fs::remove(imagePath);
+                }
+
+                // Optimizer tests compare against a second VM compiled without the AST optimization pass
+                if (phase == Phase::Optimizer)
+                {
+                    scrpt::VM unoptimizedVM;
+                    addExterns(unoptimizedVM);
+                    unoptimizedVM.SetAstOptimization(false);
+                    unoptimizedVM.AddSource(DuplicateSource(source));
+                    unoptimizedVM.Finalize();
+                    scrpt::StackVal* ret = unoptimizedVM.Execute("main");
+                    gotExpectedResult = ret != nullptr && ret->GetInt() == resultValue;
+
+                    const scrpt::AstOptimizerStats& stats = compiledVM.GetAstOptimizerStats();
+                    if (verbose) ss << "Folded: " << stats.foldedNodes << " Reduced: " << stats.reducedOps << " Pruned: " << stats.prunedBranches << " ";
+                    gotExpectedResult = gotExpectedResult && stats.foldedNodes + stats.reducedOps + stats.prunedBranches > 0;
+                }
+
+                // Inliner tests compare against a second VM compiled without inlining
+                if (phase == Phase::Inliner)
+                {
+                    scrpt::VM callingVM;
+                    addExterns(callingVM);
+                    callingVM.SetInlineBudget(0);
+                    callingVM.AddSource(DuplicateSource(source));
+                    callingVM.Finalize();
+                    scrpt::StackVal* ret = callingVM.Execute("main");
+                    gotExpectedResult = ret != nullptr && ret->GetInt() == resultValue;
+
+                    size_t inlinedCalls = compiledVM.GetBytecodeGenStats().inlinedCalls;
+                    if (verbose) ss << "Inlined: " << inlinedCalls << " ";
+                    gotExpectedResult = gotExpectedResult && inlinedCalls > 0 && callingVM.GetBytecodeGenStats().inlinedCalls == 0;
+                }
+
+                // Shared tests run the program quickened by the first VM in a second VM that didn't compile it
+                std::unique_ptr<scrpt::VM> sharedVM;
+                if (phase == Phase::Shared)
+                {
+                    scrpt::StackVal* ret = compiledVM.Execute("main");
+                    gotExpectedResult = ret != nullptr && ret->GetInt() == resultValue;
+                    sharedVM.reset(new scrpt::VM(compiledVM.GetProgram()));
+                }
+
+                // Threaded tests check every thread gets the result, perf runs time it on 1 to 32 threads where each
+                // thread does the same work, so the time stays flat for as long as execution scales
+                if (phase == Phase::Threaded)
+                {
+                    std::shared_ptr<const scrpt::Program> program = compiledVM.GetProgram();
+                    gotExpectedResult = ExecuteThreaded(program, resultValue, 8, 2, &runtime);
+
+                    for (unsigned int nThreads = 1; gotExpectedResult && perfTest && nThreads <= 32; nThreads *= 2)
+                    {
+                        gotExpectedResult = ExecuteThreaded(program, resultValue, nThreads, nTimedRuns, &runtime);
+                        ss << "[" << nThreads << "t " << runtime / nTimedRuns << "] ";
+                    }
+                    perfTest = false;
+                }
+
+                if (phase == Phase::Arena) compiledVM.SetExecuteArena(true);
+                if (phase == Phase::Deferred) compiledVM.SetDeferredFree(64);
+
+                scrpt::VM& vm = phase == Phase::Image ? imageVM : (phase == Phase::Shared ? *sharedVM : compiledVM);
                 if (verbose) vm.Decompile();
                 // Run the first, untimed test to validate test and ensure the code path is warm
                 scrpt::StackVal* ret = vm.Execute("main");
-                gotExpectedResult = ret != nullptr && ret->integer == resultValue;
+
+                // The returned list must have been moved out of the arena
+                if (phase == Phase::Arena && ret != nullptr)
+                {
+                    bool promoted = ret->GetType() == scrpt::StackType::List && !ret->GetRef()->arena && !ret->GetRef()->list->empty();
+                    ret = promoted ? &(*ret->GetRef()->list)[0].v : nullptr;
+                }
+                gotExpectedResult = gotExpectedResult && ret != nullptr && ret->GetInt() == resultValue;
 
                 if (gotExpectedResult && nTimedRuns > 0 && perfTest)
                 {
@@ -563,6 +1254,12 @@ bool ExecuteTest(const char* testName, Phase phase, int resultValue, scrpt::Err
                     runtime = ConvertTimeMS(endTime.QuadPart - startTime.QuadPart) / (double)nTimedRuns;
                     ss << "[" << runtime << "] ";
                 }
+
+                if (verbose)
+                {
+                    const scrpt::CycleCollectorStats& cycles = vm.GetCycleCollectorStats();
+                    ss << "Collections: " << cycles.collections << " Freed: " << cycles.freedObjects << " Max pause: " << cycles.maxPauseMs << "ms ";
+                }
             }
             catch (scrpt::Exception& ex)
             {
@@ -570,6 +1267,14 @@ bool ExecuteTest(const char* testName, Phase phase, int resultValue, scrpt::Err
                 if (err != resultErr) ss << ex.what() << std::endl;
             }
 
+            // Every string, list and map the test made is freed along with its VMs, including after an error
+            long long leaked = scrpt::VM::GetObjectStats().live - liveObjects;
+            if (leaked != 0)
+            {
+                ss << "Leaked " << leaked << " objects ";
+                gotExpectedResult = false;
+            }
+
             passed = err == resultErr && gotExpectedResult;
         }
         break;